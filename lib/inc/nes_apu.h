@@ -1,167 +1,437 @@
 #pragma once
 
 #include <nes_component.h>
+#include <nes_cycle.h>
+#include <atomic>
 
 class nes_system;
 
-class nes_audio_device
+//
+// Hands audio samples from the emulation thread (producer) to the audio callback thread (consumer)
+// without locking. Each side only ever writes its own index, and indices keep counting up and get
+// masked into the buffer - which is why the capacity is a power of 2. The indices live on separate
+// cache lines so the two threads don't keep stealing the same line from each other
+//
+// Both sides work in spans: get the (at most 2, because of the wrap) spans available, fill or 
+// consume them in place, then commit. write/read are simple copying wrappers on top of that
+//
+#define AUDIO_RING_CACHE_LINE 64
+
+struct nes_audio_span
+{
+    int16_t *data;
+    size_t size;
+};
+
+class nes_audio_ring
 {
 public :
-    void read_buffer(uint8_t *buf, size_t buf_size)
+    nes_audio_ring(size_t capacity)
     {
-        if (_write_offset == _read_offset && !_buf_full)
-        {
-            memset(buf, 0, buf_size);
-            NES_TRACE1("[NES_APU] Not enough buffered audio. " << buf_size << " filled with silence.");
-            return;
-        }
+        // round up to power of 2
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
 
-        _buf_full = false;
-        if (_write_offset > _read_offset)
-        {
-            //  read          write
-            //   ^             ^
-            // --------------------
-            size_t remaining_size = _write_offset - _read_offset;
-            size_t copy_size = remaining_size > buf_size ? buf_size : remaining_size;
+        _buffer.resize(size);
+        _mask = size - 1;
 
-            memcpy_s(buf, buf_size, _audio_buffer.data() + _read_offset, copy_size);
+        _write_index.store(0, memory_order_relaxed);
+        _read_index.store(0, memory_order_relaxed);
+        _underrun_samples.store(0, memory_order_relaxed);
+        _overrun_samples.store(0, memory_order_relaxed);
+    }
 
-            // wrap to 0 if _read_offset is at the end
-            _read_offset = (_read_offset + copy_size) % _audio_buffer.size();
-            if (buf_size > remaining_size)
-            {
-                buf_size -= remaining_size;
-                buf += remaining_size;
-                memset(buf, 0, buf_size);
-                NES_TRACE1("[NES_APU] Not enough buffered audio. " << buf_size << " filled with silence.");
+    size_t capacity() { return _buffer.size(); }
 
-                return;
-            }
-        }
-        else
-        {
-            // write         read
-            //   ^             ^
-            // --------------------
-            size_t remaining_size = _audio_buffer.size() - _read_offset;
-            size_t first_copy = remaining_size > buf_size ? buf_size : remaining_size;
-            memcpy_s(buf, buf_size, _audio_buffer.data() + _read_offset, first_copy);
-            buf_size -= first_copy;
-            buf += first_copy;
-            if (buf_size == 0)
-            {
-                _read_offset += first_copy;
-                return;
-            }
+    // Samples buffered - may be stale by the time it returns if the other side is running
+    size_t size()
+    {
+        size_t read_index = _read_index.load(memory_order_acquire);
+        return _write_index.load(memory_order_acquire) - read_index;
+    }
 
-            memcpy_s(buf, buf_size, _audio_buffer.data(), _write_offset > buf_size ? buf_size : _write_offset);
-            if (buf_size > _write_offset)
-            {
-                buf_size -= _write_offset;
-                buf += _write_offset;
-                memset(buf, 0, buf_size);
-                NES_TRACE1("[NES_APU] Not enough buffered audio. " << buf_size << " filled with silence.");
+    //
+    // Producer (emulation thread)
+    //
 
-                _read_offset = _write_offset;
+    // Returns the free space in spans[0] and spans[1]
+    size_t get_write_spans(nes_audio_span spans[2])
+    {
+        size_t write_index = _write_index.load(memory_order_relaxed);
+        size_t free_size = _buffer.size() - (write_index - _read_index.load(memory_order_acquire));
 
-                return;
-            }
+        return get_spans(write_index, free_size, spans);
+    }
 
-            _read_offset += buf_size;
-        }
+    // Publishes count samples written into the write spans
+    void commit_write(size_t count)
+    {
+        size_t write_index = _write_index.load(memory_order_relaxed);
+        assert(count <= _buffer.size() - (write_index - _read_index.load(memory_order_relaxed)));
+        _write_index.store(write_index + count, memory_order_release);
     }
 
-    void write_buffer(const uint8_t *buf, size_t buf_size)
+    // Anything that doesn't fit is dropped and counted as overrun
+    size_t write(const int16_t *buf, size_t count)
     {
-        if (_buf_full)
+        nes_audio_span spans[2];
+        get_write_spans(spans);
+
+        size_t written = 0;
+        for (auto &span : spans)
         {
-            NES_TRACE1("[NES_APU] Buffer full - " << buf_size << " bytes lost");
-            return;
+            size_t copy_size = min(span.size, count - written);
+            memcpy(span.data, buf + written, copy_size * sizeof(int16_t));
+            written += copy_size;
         }
+        commit_write(written);
 
-        if (_write_offset >= _read_offset)
-        {
-            //  read          write
-            //   ^             ^
-            // --------------------
-            size_t remaining_size = _audio_buffer.size() - _write_offset;
-            if (remaining_size >= buf_size)
-            {
-                memcpy_s(_audio_buffer.data() + _write_offset, remaining_size, buf, buf_size);
+        if (written < count)
+            _overrun_samples.fetch_add(count - written, memory_order_relaxed);
 
-                // handle special case remaining_size == buf_size
-                _write_offset = (_write_offset + buf_size) % _audio_buffer.size();
-                if (_write_offset == _read_offset)
-                    _buf_full = true;
-            }
-            else
-            {
-                memcpy_s(_audio_buffer.data() + _write_offset, remaining_size, buf, remaining_size);
+        return written;
+    }
 
-                buf_size -= remaining_size;
-                if (_read_offset < buf_size)
-                {
-                    NES_TRACE1("[NES_APU] Buffer full - " << buf_size << " bytes lost");
-                    return;
-                }
+    //
+    // Consumer (audio callback thread)
+    //
+
+    // Returns the samples available in spans[0] and spans[1]
+    size_t get_read_spans(nes_audio_span spans[2])
+    {
+        size_t read_index = _read_index.load(memory_order_relaxed);
+        size_t avail_size = _write_index.load(memory_order_acquire) - read_index;
 
-                memcpy_s(_audio_buffer.data(), buf_size, buf + remaining_size, buf_size);
+        return get_spans(read_index, avail_size, spans);
+    }
 
-                _write_offset = buf_size;
-            }
+    // Releases count samples consumed from the read spans back to the producer
+    void commit_read(size_t count)
+    {
+        size_t read_index = _read_index.load(memory_order_relaxed);
+        assert(count <= _write_index.load(memory_order_relaxed) - read_index);
+        _read_index.store(read_index + count, memory_order_release);
+    }
+
+    // Whatever isn't there is filled with silence and counted as underrun
+    size_t read(int16_t *buf, size_t count)
+    {
+        nes_audio_span spans[2];
+        get_read_spans(spans);
+
+        size_t read_size = 0;
+        for (auto &span : spans)
+        {
+            size_t copy_size = min(span.size, count - read_size);
+            memcpy(buf + read_size, span.data, copy_size * sizeof(int16_t));
+            read_size += copy_size;
         }
-        else
+        commit_read(read_size);
+
+        if (read_size < count)
         {
-            // write         read
-            //   ^             ^
-            // --------------------
-            size_t remaining_size = _read_offset - _write_offset;
-            if (remaining_size < buf_size)
-            {
-                NES_TRACE1("[NES_APU] Buffer full - " << buf_size << " bytes lost");
-                return;
-            }
+            memset(buf + read_size, 0, (count - read_size) * sizeof(int16_t));
+            _underrun_samples.fetch_add(count - read_size, memory_order_relaxed);
+        }
 
-            memcpy_s(_audio_buffer.data() + _write_offset, remaining_size, buf, buf_size);
+        return read_size;
+    }
 
-            _write_offset += buf_size;
+    //
+    // Monitoring - safe from any thread
+    //
+    uint64_t underrun_samples() { return _underrun_samples.load(memory_order_relaxed); }
+    uint64_t overrun_samples() { return _overrun_samples.load(memory_order_relaxed); }
 
-            if (_write_offset == _read_offset)
-                _buf_full = true;
-        }
+private :
+    size_t get_spans(size_t index, size_t size, nes_audio_span spans[2])
+    {
+        size_t offset = index & _mask;
+        size_t first_size = _buffer.size() - offset;
+        if (first_size > size)
+            first_size = size;
+
+        spans[0].data = _buffer.data() + offset;
+        spans[0].size = first_size;
+        spans[1].data = _buffer.data();
+        spans[1].size = size - first_size;
+
+        return size;
+    }
+
+private :
+    vector<int16_t> _buffer;
+    size_t _mask;
+
+    // Producer's cache line
+    alignas(AUDIO_RING_CACHE_LINE) atomic<size_t> _write_index;
+    atomic<uint64_t> _overrun_samples;                                  // samples dropped
+
+    // Consumer's cache line
+    alignas(AUDIO_RING_CACHE_LINE) atomic<size_t> _read_index;
+    atomic<uint64_t> _underrun_samples;                                 // samples filled with silence
+};
+
+//
+// Dynamic rate control - the emulation thread and the audio device each run off their own clock, 
+// and they never agree exactly. Rather than letting the audio ring slowly run dry or overflow
+// (and then pop), APU output is resampled by a ratio that nudges the ring towards half full: 
+// a bit more samples when it's below, a bit less when above. AUDIO_RATE_MAX_DEVIATION is small 
+// enough that the pitch change can't be heard
+//
+#define AUDIO_RATE_MAX_DEVIATION 0.005
+
+class nes_audio_rate_control
+{
+public :
+    nes_audio_rate_control(nes_audio_ring *ring)
+        :_ring(ring)
+    {
+        _fill_level.store(0.5, memory_order_relaxed);
+        _ratio.store(1.0, memory_order_relaxed);
+    }
+
+    // Emulation thread - returns the ratio to produce the next batch of samples with
+    double update()
+    {
+        double fill_level = double(_ring->size()) / _ring->capacity();
+        double ratio = 1.0 + AUDIO_RATE_MAX_DEVIATION * (1.0 - 2.0 * fill_level);
+
+        _fill_level.store(fill_level, memory_order_relaxed);
+        _ratio.store(ratio, memory_order_relaxed);
+
+        return ratio;
     }
 
+    //
+    // Monitoring - safe from any thread
+    //
+    double fill_level() { return _fill_level.load(memory_order_relaxed); }
+    double ratio() { return _ratio.load(memory_order_relaxed); }
+
 private :
-    bool            _buf_full;              // distingush full or empty when begin == end
-    size_t          _write_offset;          // end of data - increment when writing
-    size_t          _read_offset;           // begin of data - increment when reading
-    vector<uint8_t> _audio_buffer;          // circular audio buffer of desired size
+    nes_audio_ring *_ring;
+    atomic<double> _fill_level;         // ring fill level [0, 1] at last update
+    atomic<double> _ratio;              // ratio from last update
 };
 
+//
+// APU runs off the CPU clock - everything below is in CPU cycles
+//
+#define APU_CPU_CLOCK_HZ (NES_CLOCK_HZ / 3.0)
+#define APU_SAMPLE_RATE_DEFAULT 44100
+
+// Samples kept around for whoever reads them with read_samples - older samples are dropped after that
+#define APU_BUFFER_MS 500
+
+// Output sample rate can be adjusted by this much at most (see set_resample_ratio)
+#define APU_RESAMPLE_RATIO_MIN (1.0 - AUDIO_RATE_MAX_DEVIATION)
+#define APU_RESAMPLE_RATIO_MAX (1.0 + AUDIO_RATE_MAX_DEVIATION)
+
+// Samples are made available (blip_end_frame) when they are read, and at least every 
+// APU_FRAME_MAX_CYCLES (keeps time within what blip_buf can take)
+#define APU_FRAME_MAX_CYCLES 32768
+
+// Amplitude of full scale mixer output - leaves some head room for blip_buf's ringing
+#define APU_AMPLITUDE 26000
+
+struct blip_t;
+class nes_cpu;
+class nes_memory;
+
+//
+// Nonlinear mixer - http://wiki.nesdev.com/w/index.php/APU_Mixer
+//
+//   pulse_out = 95.52 / (8128 / (pulse_1 + pulse_2) + 100)
+//   tnd_out = 163.67 / (24329 / (3 * triangle + 2 * noise + dmc) + 100)
+//
+// Both only depend on a small sum of channel outputs, so they are precomputed into a pulse table 
+// indexed by pulse_1 + pulse_2 and a TND table indexed by 3 * triangle + 2 * noise + dmc. Mixing 
+// is then 2 lookups and an add. mix is fixed point, scaled to APU_AMPLITUDE, and mix_float is
+// (just about) [0, 1]
+//
+#define APU_PULSE_TABLE_SIZE 31         // 15 + 15 + 1
+#define APU_TND_TABLE_SIZE 203          // 3 * 15 + 2 * 15 + 127 + 1
+
 class nes_apu_mixer
 {
-    
+public :
+    nes_apu_mixer();
+
+    int mix(uint8_t pulse_1, uint8_t pulse_2, uint8_t triangle, uint8_t noise, uint8_t dmc)
+    {
+        return _pulse_table[pulse_index(pulse_1, pulse_2)] + _tnd_table[tnd_index(triangle, noise, dmc)];
+    }
+
+    float mix_float(uint8_t pulse_1, uint8_t pulse_2, uint8_t triangle, uint8_t noise, uint8_t dmc)
+    {
+        return _pulse_table_float[pulse_index(pulse_1, pulse_2)] + _tnd_table_float[tnd_index(triangle, noise, dmc)];
+    }
+
+private :
+    static int pulse_index(uint8_t pulse_1, uint8_t pulse_2)
+    {
+        assert(pulse_1 <= 15 && pulse_2 <= 15);
+        return pulse_1 + pulse_2;
+    }
+
+    static int tnd_index(uint8_t triangle, uint8_t noise, uint8_t dmc)
+    {
+        assert(triangle <= 15 && noise <= 15 && dmc <= 127);
+        return 3 * triangle + 2 * noise + dmc;
+    }
+
+private :
+    int32_t _pulse_table[APU_PULSE_TABLE_SIZE];
+    int32_t _tnd_table[APU_TND_TABLE_SIZE];
+    float _pulse_table_float[APU_PULSE_TABLE_SIZE];
+    float _tnd_table_float[APU_TND_TABLE_SIZE];
+};
+
+//
+// Length counter shared by all channels except DMC - silences the channel when it reaches 0
+//
+class nes_apu_length_counter
+{
+public :
+    void init()
+    {
+        _enabled = false;
+        _halt = false;
+        _counter = 0;
+    }
+
+    void set_enabled(bool enabled)
+    {
+        _enabled = enabled;
+        if (!enabled)
+            _counter = 0;
+    }
+
+    void set_halt(bool halt) { _halt = halt; }
+
+    // Top 5 bits of $4003/$4007/$400B/$400F
+    void load(uint8_t val)
+    {
+        if (_enabled)
+            _counter = s_length_table[val >> 3];
+    }
+
+    // half frame
+    void clock()
+    {
+        if (!_halt && _counter > 0)
+            _counter--;
+    }
+
+    bool is_active() { return _counter > 0; }
+
+private :
+    bool _enabled;
+    bool _halt;
+    uint8_t _counter;
+
+private :
+    static uint8_t s_length_table[32];
+};
+
+//
+// Envelope generator of pulse / noise channels - either constant volume or a decaying saw
+//
+class nes_apu_envelope
+{
+public :
+    void init()
+    {
+        _start = false;
+        _loop = false;
+        _constant_volume = false;
+        _volume = 0;
+        _divider = 0;
+        _decay = 0;
+    }
+
+    void write(uint8_t val)
+    {
+        _loop = val & 0x20;
+        _constant_volume = val & 0x10;
+        _volume = val & 0xf;
+    }
+
+    void restart() { _start = true; }
+
+    // quarter frame
+    void clock()
+    {
+        if (_start)
+        {
+            _start = false;
+            _decay = 15;
+            _divider = _volume;
+        }
+        else if (_divider > 0)
+        {
+            _divider--;
+        }
+        else
+        {
+            _divider = _volume;
+            if (_decay > 0)
+                _decay--;
+            else if (_loop)
+                _decay = 15;
+        }
+    }
+
+    uint8_t volume() { return _constant_volume ? _volume : _decay; }
+
+private :
+    bool _start;
+    bool _loop;                 // also length counter halt
+    bool _constant_volume;      
+    uint8_t _volume;            // constant volume, or the period of the divider
+    uint8_t _divider;
+    uint8_t _decay;             // decay level counting 15 -> 0
 };
 
+//
+// Channels don't run their timers cycle by cycle. Each one has the CPU cycle its timer clocks next
+// (_next_clock) and nes_apu only goes there if the channel is not idle - ie. clocking the timer can
+// change its output. Idle channels are simply moved past a given time with skip_to before anything
+// about them changes
+//
+
 // 
 // Pulse channel that produce square wave
 //
 class nes_apu_pulse_channel
 {
 public :
-    void init()
+    // Pulse 1 negates with one's complement in sweep and pulse 2 with two's complement
+    void init(bool ones_complement)
     {
-        _cur_timer = 0;
+        _ones_complement = ones_complement;
+        _duty_cycle = 0;
+        _duty_pos = 0;
         _timer = 0;
+        _next_clock = 0;
+        _envelope.init();
+        _length_counter.init();
+
+        _sweep_enabled = false;
+        _period = 0;
+        _negate = false;
+        _shift_count = 0;
+        _sweep_reload = false;
+        _sweep_divider = 0;
     }
 
     void write_duty(uint8_t val)
     {
         _duty_cycle = (val & 0xc0) >> 6;
-        _length_counter_halt = val & 0x20;
-        _constant_volume = val & 0x10;
-        _volume = val & 0x7;
+        _length_counter.set_halt(val & 0x20);
+        _envelope.write(val);
     }
 
     void write_sweep(uint8_t val)
@@ -170,65 +440,449 @@ public :
         _period = (val & 0x70) >> 4;
         _negate = val & 0x8;
         _shift_count = val & 0x7;
+        _sweep_reload = true;
     }
 
     void write_timer(uint8_t val)
     {
-        _timer |= val;
+        _timer = (_timer & 0x700) | val;
     }
 
     void write_length_counter(uint8_t val)
     {
         _timer = (_timer & 0xff) | ((val & 0x7) << 8);
-        _length_counter = val >> 3;
+        _length_counter.load(val);
+
+        // sequencer gets immediately reset
+        _duty_pos = 0;
+        _envelope.restart();
+    }
 
-        // timer gets immediately reset
-        _cur_timer = _timer;
+    void set_enabled(bool enabled) { _length_counter.set_enabled(enabled); }
+    bool is_active() { return _length_counter.is_active(); }
+
+    void clock_quarter_frame() { _envelope.clock(); }
+
+    void clock_half_frame()
+    {
+        _length_counter.clock();
+
+        if (_sweep_divider == 0 && _sweep_enabled && _shift_count > 0 && !is_muted())
+            _timer = uint16_t(target_timer());
+
+        if (_sweep_divider == 0 || _sweep_reload)
+        {
+            _sweep_divider = _period;
+            _sweep_reload = false;
+        }
+        else
+        {
+            _sweep_divider--;
+        }
+    }
+
+    int32_t next_clock() { return _next_clock; }
+
+    void clock()
+    {
+        _duty_pos = (_duty_pos + 1) & 0x7;
+        _next_clock += timer_period();
+    }
+
+    void skip_to(int32_t time)
+    {
+        if (_next_clock < time)
+        {
+            int32_t count = (time - _next_clock + timer_period() - 1) / timer_period();
+            _duty_pos = (_duty_pos + count) & 0x7;
+            _next_clock += count * timer_period();
+        }
+    }
+
+    void rebase(int32_t time) { _next_clock -= time; }
+
+    bool is_idle() { return !_length_counter.is_active() || is_muted() || _envelope.volume() == 0; }
+
+    uint8_t output()
+    {
+        if (is_idle() || !s_duty_cycle[_duty_cycle][_duty_pos])
+            return 0;
+        return _envelope.volume();
     }
 
 private :
+    int32_t timer_period() { return (_timer + 1) * 2; }
+
+    int32_t target_timer()
+    {
+        int32_t change = _timer >> _shift_count;
+        if (_negate)
+            return _timer - change - (_ones_complement ? 1 : 0);
+        return _timer + change;
+    }
+
+    // sweep unit mutes the channel even when it is disabled
+    bool is_muted() { return _timer < 8 || target_timer() > 0x7ff; }
+
+private :
+    bool _ones_complement;
+
     // duty
     uint8_t _duty_cycle;        // which of the duty cycle it is using
-    bool _length_counter_halt;  // length counter halt
-    bool _constant_volume;      // true if using constant volume, otherwise use volume from envelop
-    uint8_t _volume;            // constant volume (if _use_envelop is false), otherwise it is the period of envelop
+    uint8_t _duty_pos;          // position in the duty cycle
+    nes_apu_envelope _envelope;
 
     // length counter
-    uint16_t _cur_timer;
     uint16_t _timer;            // internal waveform generator timer goes from t -> 0 -> t
-    uint8_t _length_counter;    // length counter
-    uint8_t _divider;
+    int32_t _next_clock;        // see nes_apu_pulse_channel
+    nes_apu_length_counter _length_counter;
 
     // sweep
     bool _sweep_enabled;
     uint8_t _period;
     bool _negate;
     uint8_t _shift_count;
+    bool _sweep_reload;
+    uint8_t _sweep_divider;
 
 private :
     static uint8_t s_duty_cycle[4][8];
 };
 
+//
+// Triangle channel - 32 step triangle gated by both linear counter and length counter
+//
 class nes_apu_triangle_channel
 {
+public :
+    void init()
+    {
+        _control = false;
+        _linear_reload_value = 0;
+        _linear_counter = 0;
+        _linear_reload = false;
+        _timer = 0;
+        _next_clock = 0;
+        _sequence_pos = 0;
+        _length_counter.init();
+    }
+
+    void write_linear_counter(uint8_t val)
+    {
+        _control = val & 0x80;
+        _length_counter.set_halt(val & 0x80);
+        _linear_reload_value = val & 0x7f;
+    }
+
+    void write_timer(uint8_t val)
+    {
+        _timer = (_timer & 0x700) | val;
+    }
+
+    void write_length_counter(uint8_t val)
+    {
+        _timer = (_timer & 0xff) | ((val & 0x7) << 8);
+        _length_counter.load(val);
+        _linear_reload = true;
+    }
+
+    void set_enabled(bool enabled) { _length_counter.set_enabled(enabled); }
+    bool is_active() { return _length_counter.is_active(); }
+
+    void clock_quarter_frame()
+    {
+        if (_linear_reload)
+            _linear_counter = _linear_reload_value;
+        else if (_linear_counter > 0)
+            _linear_counter--;
+
+        if (!_control)
+            _linear_reload = false;
+    }
+
+    void clock_half_frame() { _length_counter.clock(); }
+
+    int32_t next_clock() { return _next_clock; }
+
+    void clock()
+    {
+        _sequence_pos = (_sequence_pos + 1) & 0x1f;
+        _next_clock += timer_period();
+    }
+
+    // sequencer stays where it is while idle
+    void skip_to(int32_t time)
+    {
+        if (_next_clock < time)
+            _next_clock += (time - _next_clock + timer_period() - 1) / timer_period() * timer_period();
+    }
+
+    void rebase(int32_t time) { _next_clock -= time; }
+
+    // Ultrasonic periods (timer < 2) are frozen rather than played - they only pop
+    bool is_idle() { return _linear_counter == 0 || !_length_counter.is_active() || _timer < 2; }
+
+    uint8_t output() { return s_sequence[_sequence_pos]; }
+
+private :
+    int32_t timer_period() { return _timer + 1; }
+
+private :
+    bool _control;                  // also length counter halt
+    uint8_t _linear_reload_value;
+    uint8_t _linear_counter;
+    bool _linear_reload;
+
+    uint16_t _timer;
+    int32_t _next_clock;            // see nes_apu_pulse_channel
+    uint8_t _sequence_pos;
+    nes_apu_length_counter _length_counter;
+
+private :
+    static uint8_t s_sequence[32];
 };
 
+//
+// Noise channel - pseudo random bits from a 15-bit LFSR
+//
 class nes_apu_noise_channel
 {
+public :
+    void init()
+    {
+        _mode = false;
+        _timer_period = s_timer_period[0];
+        _next_clock = 0;
+        _shift = 1;
+        _envelope.init();
+        _length_counter.init();
+    }
+
+    void write_volume(uint8_t val)
+    {
+        _length_counter.set_halt(val & 0x20);
+        _envelope.write(val);
+    }
+
+    void write_period(uint8_t val)
+    {
+        _mode = val & 0x80;
+        _timer_period = s_timer_period[val & 0xf];
+    }
+
+    void write_length_counter(uint8_t val)
+    {
+        _length_counter.load(val);
+        _envelope.restart();
+    }
+
+    void set_enabled(bool enabled) { _length_counter.set_enabled(enabled); }
+    bool is_active() { return _length_counter.is_active(); }
+
+    void clock_quarter_frame() { _envelope.clock(); }
+    void clock_half_frame() { _length_counter.clock(); }
+
+    int32_t next_clock() { return _next_clock; }
+
+    void clock()
+    {
+        uint16_t feedback = (_shift ^ (_shift >> (_mode ? 6 : 1))) & 1;
+        _shift = (_shift >> 1) | (feedback << 14);
+        _next_clock += _timer_period;
+    }
+
+    // LFSR only runs while we can hear it - nobody can tell the difference
+    void skip_to(int32_t time)
+    {
+        if (_next_clock < time)
+            _next_clock += (time - _next_clock + _timer_period - 1) / _timer_period * _timer_period;
+    }
+
+    void rebase(int32_t time) { _next_clock -= time; }
+
+    bool is_idle() { return !_length_counter.is_active() || _envelope.volume() == 0; }
+
+    uint8_t output()
+    {
+        if (is_idle() || (_shift & 1))
+            return 0;
+        return _envelope.volume();
+    }
+
+private :
+    bool _mode;                     // short (93 step) sequence
+    int32_t _timer_period;
+    int32_t _next_clock;            // see nes_apu_pulse_channel
+    uint16_t _shift;                // LFSR
+    nes_apu_envelope _envelope;
+    nes_apu_length_counter _length_counter;
 
+private :
+    static int32_t s_timer_period[16];
 };
 
+//
+// Delta modulation channel - plays 1-bit delta samples fetched from CPU memory
+// Fetching doesn't steal CPU cycles
+//
 class nes_apu_dmc_channel
 {
+public :
+    void init(nes_memory *mem)
+    {
+        _mem = mem;
+        _irq_enabled = false;
+        _irq_flag = false;
+        _loop = false;
+        _timer_period = s_timer_period[0];
+        _next_clock = 0;
+        _output_level = 0;
+        _sample_addr = 0xc000;
+        _sample_length = 1;
+        _cur_addr = 0xc000;
+        _bytes_remaining = 0;
+        _buffer = 0;
+        _buffer_empty = true;
+        _shift = 0;
+        _bits_remaining = 8;
+        _silence = true;
+    }
+
+    void write_flags(uint8_t val)
+    {
+        _irq_enabled = val & 0x80;
+        if (!_irq_enabled)
+            _irq_flag = false;
+        _loop = val & 0x40;
+        _timer_period = s_timer_period[val & 0xf];
+    }
+
+    void write_direct_load(uint8_t val) { _output_level = val & 0x7f; }
+    void write_sample_addr(uint8_t val) { _sample_addr = 0xc000 | (uint16_t(val) << 6); }
+    void write_sample_length(uint8_t val) { _sample_length = (uint16_t(val) << 4) + 1; }
+
+    void set_enabled(bool enabled)
+    {
+        _irq_flag = false;
+        if (!enabled)
+        {
+            _bytes_remaining = 0;
+        }
+        else if (_bytes_remaining == 0)
+        {
+            restart();
+            fill_buffer();
+        }
+    }
+
+    bool is_active() { return _bytes_remaining > 0; }
+    bool irq_flag() { return _irq_flag; }
+
+    int32_t next_clock() { return _next_clock; }
+
+    void clock()
+    {
+        if (!_silence)
+        {
+            if (_shift & 1)
+            {
+                if (_output_level <= 125)
+                    _output_level += 2;
+            }
+            else if (_output_level >= 2)
+            {
+                _output_level -= 2;
+            }
+        }
+
+        _shift >>= 1;
+        if (--_bits_remaining == 0)
+        {
+            // next output cycle
+            _bits_remaining = 8;
+            if (_buffer_empty)
+            {
+                _silence = true;
+            }
+            else
+            {
+                _silence = false;
+                _shift = _buffer;
+                _buffer_empty = true;
+                fill_buffer();
+            }
+        }
 
+        _next_clock += _timer_period;
+    }
+
+    // Output cycles keep going while idle - with nothing to play
+    void skip_to(int32_t time)
+    {
+        if (_next_clock < time)
+        {
+            int32_t count = (time - _next_clock + _timer_period - 1) / _timer_period;
+            _bits_remaining = uint8_t((_bits_remaining - 1 - count % 8 + 8) % 8 + 1);
+            _next_clock += count * _timer_period;
+        }
+    }
+
+    void rebase(int32_t time) { _next_clock -= time; }
+
+    bool is_idle() { return _silence && _buffer_empty; }
+
+    uint8_t output() { return _output_level; }
+
+private :
+    void restart()
+    {
+        _cur_addr = _sample_addr;
+        _bytes_remaining = _sample_length;
+    }
+
+    // memory reader
+    void fill_buffer();
+
+private :
+    nes_memory *_mem;
+
+    bool _irq_enabled;
+    bool _irq_flag;
+    bool _loop;
+    int32_t _timer_period;
+    int32_t _next_clock;            // see nes_apu_pulse_channel
+    uint8_t _output_level;          // 7-bit DAC
+
+    // memory reader
+    uint16_t _sample_addr;
+    uint16_t _sample_length;
+    uint16_t _cur_addr;
+    uint16_t _bytes_remaining;
+    uint8_t _buffer;
+    bool _buffer_empty;
+
+    // output unit
+    uint8_t _shift;
+    uint8_t _bits_remaining;
+    bool _silence;
+
+private :
+    static int32_t s_timer_period[16];
 };
 
 //
 // NES APU implementation
 // http://wiki.nesdev.com/w/index.php/APU
 //
-class nes_apu : nes_component
-
+// Instead of sampling the channels every CPU cycle, every change of the mixed output goes into 
+// blip_buf as a delta at the exact CPU cycle it happens, and blip_buf takes care of turning that
+// into band-limited samples. The cost goes with how often the waveforms change rather than the 
+// clock rate. Like PPU, APU is only brought up to date when someone needs it - register access 
+// (see sync) and the end of nes_system::step
+//
+// Frame IRQ and DMC IRQ only show up in $4015 - CPU doesn't take IRQs
+//
+class nes_apu : public nes_component
 {
 public:
     nes_apu();
@@ -238,26 +892,47 @@ public :
     //
     // nes_component overrides
     //
-    virtual void power_on(nes_system *system) 
-    { 
-        _system = system;
-        init(); 
-    }
+    virtual void power_on(nes_system *system);
 
     virtual void reset() { init(); }
 
-    virtual void step_to(nes_cycle_t count) {}
+    virtual void step_to(nes_cycle_t count);
+
+public :
+    //
+    // Audio output - 16-bit signed mono samples
+    //
+    void set_sample_rate(int sample_rate);
+    int sample_rate() { return _sample_rate; }
+    int samples_avail();
+    int read_samples(int16_t *buf, int count);
+
+    //
+    // Produce ratio times as many samples from now on - blip_buf does the resampling as part of 
+    // band-limiting, so this costs nothing. Used for dynamic rate control (nes_audio_rate_control)
+    //
+    void set_resample_ratio(double ratio);
+    double resample_ratio() { return _resample_ratio; }
 
 private :
-    void init()
-    {
-        // status
-        _dmc_enabled = _noise_enabled = _triangle_enabled = _pulse_1_enabled = _pulse_2_enabled = false;
+    void init();
 
-        // frame counter
-        _frame_counter_mode = 0;
-        _irq_inhibit = true;
-    }
+    // Bring APU up to the start of the current CPU instruction, ready for a register access
+    void sync();
+
+    // Run up to (but not including) time
+    void run_to(int32_t time);
+
+    // Make samples up to _time available and start a new blip_buf time frame there
+    void end_frame();
+
+    void skip_idle_channels(int32_t time);
+    void update_output(int32_t time);
+
+    int32_t frame_step_time() { return _frame_seq_start + s_frame_step_cycles[_frame_counter_mode][_frame_step]; }
+    void clock_frame_counter();
+    void clock_quarter_frame();
+    void clock_half_frame();
 
 public :
     //
@@ -266,57 +941,103 @@ public :
 
     void write_status(uint8_t val)
     {
-        _dmc_enabled = val & 0x10;
-        _noise_enabled = val & 0x8;
-        _triangle_enabled = val & 0x4;
-        _pulse_2_enabled = val & 0x2;
-        _pulse_1_enabled = val & 0x1;
+        sync();
+        _pulse_1.set_enabled(val & 0x1);
+        _pulse_2.set_enabled(val & 0x2);
+        _triangle.set_enabled(val & 0x4);
+        _noise.set_enabled(val & 0x8);
+        _dmc.set_enabled(val & 0x10);
+        update_output(_time);
     }
 
     uint8_t read_status()
     {
-        // @TODO
-        return 0;
+        sync();
+        uint8_t status = 
+            (_pulse_1.is_active() ? 0x1 : 0) |
+            (_pulse_2.is_active() ? 0x2 : 0) |
+            (_triangle.is_active() ? 0x4 : 0) |
+            (_noise.is_active() ? 0x8 : 0) |
+            (_dmc.is_active() ? 0x10 : 0) |
+            (_frame_irq_flag ? 0x40 : 0) |
+            (_dmc.irq_flag() ? 0x80 : 0);
+
+        _frame_irq_flag = false;
+        return status;
     }
 
     void write_frame_counter(uint8_t val)
     {
-        // @TODO
+        sync();
         _frame_counter_mode = val >> 7;
         _irq_inhibit = val & 0x40;
-    }
+        if (_irq_inhibit)
+            _frame_irq_flag = false;
 
-    void write_pulse_1_duty(uint8_t val)
-    {
-        
+        // sequencer restarts - 5-step mode clocks everything right away
+        _frame_seq_start = _time;
+        _frame_step = 0;
+        if (_frame_counter_mode)
+        {
+            clock_quarter_frame();
+            clock_half_frame();
+        }
+        update_output(_time);
     }
 
-    void write_pulse_1_sweep(uint8_t val)
-    {
-
-    }
+    void write_pulse_1_duty(uint8_t val) { sync(); _pulse_1.write_duty(val); update_output(_time); }
+    void write_pulse_1_sweep(uint8_t val) { sync(); _pulse_1.write_sweep(val); update_output(_time); }
+    void write_pulse_1_timer_low(uint8_t val) { sync(); _pulse_1.write_timer(val); update_output(_time); }
+    void write_pulse_1_length_counter(uint8_t val) { sync(); _pulse_1.write_length_counter(val); update_output(_time); }
 
-    void write_pulse_1_timer_low(uint8_t val)
-    {
+    void write_pulse_2_duty(uint8_t val) { sync(); _pulse_2.write_duty(val); update_output(_time); }
+    void write_pulse_2_sweep(uint8_t val) { sync(); _pulse_2.write_sweep(val); update_output(_time); }
+    void write_pulse_2_timer_low(uint8_t val) { sync(); _pulse_2.write_timer(val); update_output(_time); }
+    void write_pulse_2_length_counter(uint8_t val) { sync(); _pulse_2.write_length_counter(val); update_output(_time); }
 
-    }
+    void write_triangle_linear_counter(uint8_t val) { sync(); _triangle.write_linear_counter(val); update_output(_time); }
+    void write_triangle_timer_low(uint8_t val) { sync(); _triangle.write_timer(val); update_output(_time); }
+    void write_triangle_length_counter(uint8_t val) { sync(); _triangle.write_length_counter(val); update_output(_time); }
 
-    void write_pulse_1_length_counter(uint8_t val)
-    {
+    void write_noise_volume(uint8_t val) { sync(); _noise.write_volume(val); update_output(_time); }
+    void write_noise_period(uint8_t val) { sync(); _noise.write_period(val); update_output(_time); }
+    void write_noise_length_counter(uint8_t val) { sync(); _noise.write_length_counter(val); update_output(_time); }
 
-    }
+    void write_dmc_flags(uint8_t val) { sync(); _dmc.write_flags(val); update_output(_time); }
+    void write_dmc_direct_load(uint8_t val) { sync(); _dmc.write_direct_load(val); update_output(_time); }
+    void write_dmc_sample_addr(uint8_t val) { sync(); _dmc.write_sample_addr(val); update_output(_time); }
+    void write_dmc_sample_length(uint8_t val) { sync(); _dmc.write_sample_length(val); update_output(_time); }
 
 private:
-    nes_system * _system;
+    nes_system *_system;
+    nes_cpu *_cpu;
+
+    int64_t _cpu_cycle;                 // CPU cycles we've run so far
+    int32_t _time;                      // CPU cycles since the start of current blip_buf time frame
 
     // status
-    bool _dmc_enabled;
-    bool _noise_enabled;
-    bool _triangle_enabled;
-    bool _pulse_2_enabled;
-    bool _pulse_1_enabled;
+    nes_apu_pulse_channel _pulse_1;
+    nes_apu_pulse_channel _pulse_2;
+    nes_apu_triangle_channel _triangle;
+    nes_apu_noise_channel _noise;
+    nes_apu_dmc_channel _dmc;
+
+    nes_apu_mixer _mixer;
 
     // frame counter
-    uint8_t _frame_counter_mode;
+    uint8_t _frame_counter_mode;        // 0 = 4-step, 1 = 5-step
     bool _irq_inhibit;
+    bool _frame_irq_flag;
+    uint8_t _frame_step;                // next step in the sequence
+    int32_t _frame_seq_start;           // _time the current sequence started
+
+    // output
+    blip_t *_blip;
+    int _sample_rate;
+    double _resample_ratio;
+    int _amplitude;                     // mixed output last put in _blip
+
+private :
+    static int32_t s_frame_step_cycles[2][4];
+    static int32_t s_frame_period[2];
 };
@@ -8,6 +8,7 @@
 #include "nes_memory.h"
 #include "nes_mapper.h"
 #include "nes_component.h"
+#include "nes_jit.h"
 #include <vector>
 
 using namespace std;
@@ -71,6 +72,29 @@ enum nes_addr_mode
     nes_addr_mode_ind_y,      // (d), y   val = PEEK(PEEK(arg) + PEEK((arg + 1) % $FF)* $FF + Y), 5+ cycles
 };
 
+// Number of operand bytes following the op code
+constexpr int get_operand_size(nes_addr_mode addr_mode)
+{
+    switch (addr_mode)
+    {
+    case nes_addr_mode_imp:
+    case nes_addr_mode_acc:
+        return 0;
+
+    case nes_addr_mode_rel:
+    case nes_addr_mode_imm:
+    case nes_addr_mode_zp:
+    case nes_addr_mode_zp_ind_x:
+    case nes_addr_mode_zp_ind_y:
+    case nes_addr_mode_ind_x:
+    case nes_addr_mode_ind_y:
+        return 1;
+
+    default:
+        return 2;
+    }
+}
+
 // All 6502 CPU registers - all 6 of them :)
 // http://wiki.nesdev.com/w/index.php/CPU_registers
 struct nes_cpu_context
@@ -83,17 +107,277 @@ struct nes_cpu_context
     unsigned char P;        // Status register - used by ALU unit
 };
 
-enum nes_op_code
-{
-    ORA_base = 0x00,
-    AND_base = 0x20,
-    EOR_base = 0x40,
-    ADC_base = 0x60,
-    STA_base = 0x80,
-    LDA_base = 0xA0,
-    CMP_base = 0xC0,
-    SBC_base = 0xE0,
-};
+//
+// All 256 op codes in op code order - everything the CPU knows about an op code lives here
+// X(op_code, instruction, addressing mode, cycles, page crossing cycles, is_official)
+//
+// cycles - base cycle count. Stores and read-modify-write op codes always take the page crossing
+//     path so that is already part of their base count.
+// page crossing cycles - extra cycles when indexing (abs,X / abs,Y / (d),Y) crosses a page. For 
+//     branches it's the extra cycle when the branch target is on another page (taking the branch 
+//     costs 1 more cycle on top of that).
+//
+// Op codes that aren't implemented (yet) go to ILL
+// http://obelisk.me.uk/6502/reference.html
+// http://wiki.nesdev.com/w/index.php/CPU_unofficial_opcodes
+//
+#define NES_OP_CODE_TABLE(X) \
+    X(0x00, BRK, imp,      7, 0, 1) \
+    X(0x01, ORA, ind_x,    6, 0, 1) \
+    X(0x02, KIL, imp,      0, 0, 0) \
+    X(0x03, SLO, ind_x,    8, 0, 0) \
+    X(0x04, NOP, zp,       3, 0, 0) \
+    X(0x05, ORA, zp,       3, 0, 1) \
+    X(0x06, ASL, zp,       5, 0, 1) \
+    X(0x07, SLO, zp,       5, 0, 0) \
+    X(0x08, PHP, imp,      3, 0, 1) \
+    X(0x09, ORA, imm,      2, 0, 1) \
+    X(0x0a, ASL, acc,      2, 0, 1) \
+    X(0x0b, ANC, imm,      2, 0, 0) \
+    X(0x0c, NOP, abs,      4, 0, 0) \
+    X(0x0d, ORA, abs,      4, 0, 1) \
+    X(0x0e, ASL, abs,      6, 0, 1) \
+    X(0x0f, SLO, abs,      6, 0, 0) \
+    X(0x10, BPL, rel,      2, 1, 1) \
+    X(0x11, ORA, ind_y,    5, 1, 1) \
+    X(0x12, KIL, imp,      0, 0, 0) \
+    X(0x13, SLO, ind_y,    8, 0, 0) \
+    X(0x14, NOP, zp_ind_x, 4, 0, 0) \
+    X(0x15, ORA, zp_ind_x, 4, 0, 1) \
+    X(0x16, ASL, zp_ind_x, 6, 0, 1) \
+    X(0x17, SLO, zp_ind_x, 6, 0, 0) \
+    X(0x18, CLC, imp,      2, 0, 1) \
+    X(0x19, ORA, abs_y,    4, 1, 1) \
+    X(0x1a, NOP, imp,      2, 0, 0) \
+    X(0x1b, SLO, abs_y,    7, 0, 0) \
+    X(0x1c, NOP, abs_x,    4, 1, 0) \
+    X(0x1d, ORA, abs_x,    4, 1, 1) \
+    X(0x1e, ASL, abs_x,    7, 0, 1) \
+    X(0x1f, SLO, abs_x,    7, 0, 0) \
+    X(0x20, JSR, abs_jmp,  6, 0, 1) \
+    X(0x21, AND, ind_x,    6, 0, 1) \
+    X(0x22, KIL, imp,      0, 0, 0) \
+    X(0x23, RLA, ind_x,    8, 0, 0) \
+    X(0x24, BIT, zp,       3, 0, 1) \
+    X(0x25, AND, zp,       3, 0, 1) \
+    X(0x26, ROL, zp,       5, 0, 1) \
+    X(0x27, RLA, zp,       5, 0, 0) \
+    X(0x28, PLP, imp,      4, 0, 1) \
+    X(0x29, AND, imm,      2, 0, 1) \
+    X(0x2a, ROL, acc,      2, 0, 1) \
+    X(0x2b, ANC, imm,      2, 0, 0) \
+    X(0x2c, BIT, abs,      4, 0, 1) \
+    X(0x2d, AND, abs,      4, 0, 1) \
+    X(0x2e, ROL, abs,      6, 0, 1) \
+    X(0x2f, RLA, abs,      6, 0, 0) \
+    X(0x30, BMI, rel,      2, 1, 1) \
+    X(0x31, AND, ind_y,    5, 1, 1) \
+    X(0x32, KIL, imp,      0, 0, 0) \
+    X(0x33, RLA, ind_y,    8, 0, 0) \
+    X(0x34, NOP, zp_ind_x, 4, 0, 0) \
+    X(0x35, AND, zp_ind_x, 4, 0, 1) \
+    X(0x36, ROL, zp_ind_x, 6, 0, 1) \
+    X(0x37, RLA, zp_ind_x, 6, 0, 0) \
+    X(0x38, SEC, imp,      2, 0, 1) \
+    X(0x39, AND, abs_y,    4, 1, 1) \
+    X(0x3a, NOP, imp,      2, 0, 0) \
+    X(0x3b, RLA, abs_y,    7, 0, 0) \
+    X(0x3c, NOP, abs_x,    4, 1, 0) \
+    X(0x3d, AND, abs_x,    4, 1, 1) \
+    X(0x3e, ROL, abs_x,    7, 0, 1) \
+    X(0x3f, RLA, abs_x,    7, 0, 0) \
+    X(0x40, RTI, imp,      6, 0, 1) \
+    X(0x41, EOR, ind_x,    6, 0, 1) \
+    X(0x42, KIL, imp,      0, 0, 0) \
+    X(0x43, SRE, ind_x,    8, 0, 0) \
+    X(0x44, NOP, zp,       3, 0, 0) \
+    X(0x45, EOR, zp,       3, 0, 1) \
+    X(0x46, LSR, zp,       5, 0, 1) \
+    X(0x47, SRE, zp,       5, 0, 0) \
+    X(0x48, PHA, imp,      3, 0, 1) \
+    X(0x49, EOR, imm,      2, 0, 1) \
+    X(0x4a, LSR, acc,      2, 0, 1) \
+    X(0x4b, ALR, imm,      2, 0, 0) \
+    X(0x4c, JMP, abs_jmp,  3, 0, 1) \
+    X(0x4d, EOR, abs,      4, 0, 1) \
+    X(0x4e, LSR, abs,      6, 0, 1) \
+    X(0x4f, SRE, abs,      6, 0, 0) \
+    X(0x50, BVC, rel,      2, 1, 1) \
+    X(0x51, EOR, ind_y,    5, 1, 1) \
+    X(0x52, KIL, imp,      0, 0, 0) \
+    X(0x53, SRE, ind_y,    8, 0, 0) \
+    X(0x54, NOP, zp_ind_x, 4, 0, 0) \
+    X(0x55, EOR, zp_ind_x, 4, 0, 1) \
+    X(0x56, LSR, zp_ind_x, 6, 0, 1) \
+    X(0x57, SRE, zp_ind_x, 6, 0, 0) \
+    X(0x58, CLI, imp,      2, 0, 1) \
+    X(0x59, EOR, abs_y,    4, 1, 1) \
+    X(0x5a, NOP, imp,      2, 0, 0) \
+    X(0x5b, SRE, abs_y,    7, 0, 0) \
+    X(0x5c, NOP, abs_x,    4, 1, 0) \
+    X(0x5d, EOR, abs_x,    4, 1, 1) \
+    X(0x5e, LSR, abs_x,    7, 0, 1) \
+    X(0x5f, SRE, abs_x,    7, 0, 0) \
+    X(0x60, RTS, imp,      6, 0, 1) \
+    X(0x61, ADC, ind_x,    6, 0, 1) \
+    X(0x62, KIL, imp,      0, 0, 0) \
+    X(0x63, RRA, ind_x,    8, 0, 0) \
+    X(0x64, NOP, zp,       3, 0, 0) \
+    X(0x65, ADC, zp,       3, 0, 1) \
+    X(0x66, ROR, zp,       5, 0, 1) \
+    X(0x67, RRA, zp,       5, 0, 0) \
+    X(0x68, PLA, imp,      4, 0, 1) \
+    X(0x69, ADC, imm,      2, 0, 1) \
+    X(0x6a, ROR, acc,      2, 0, 1) \
+    X(0x6b, ARR, imm,      2, 0, 0) \
+    X(0x6c, JMP, ind_jmp,  5, 0, 1) \
+    X(0x6d, ADC, abs,      4, 0, 1) \
+    X(0x6e, ROR, abs,      6, 0, 1) \
+    X(0x6f, RRA, abs,      6, 0, 0) \
+    X(0x70, BVS, rel,      2, 1, 1) \
+    X(0x71, ADC, ind_y,    5, 1, 1) \
+    X(0x72, KIL, imp,      0, 0, 0) \
+    X(0x73, RRA, ind_y,    8, 0, 0) \
+    X(0x74, NOP, zp_ind_x, 4, 0, 0) \
+    X(0x75, ADC, zp_ind_x, 4, 0, 1) \
+    X(0x76, ROR, zp_ind_x, 6, 0, 1) \
+    X(0x77, RRA, zp_ind_x, 6, 0, 0) \
+    X(0x78, SEI, imp,      2, 0, 1) \
+    X(0x79, ADC, abs_y,    4, 1, 1) \
+    X(0x7a, NOP, imp,      2, 0, 0) \
+    X(0x7b, RRA, abs_y,    7, 0, 0) \
+    X(0x7c, NOP, abs_x,    4, 1, 0) \
+    X(0x7d, ADC, abs_x,    4, 1, 1) \
+    X(0x7e, ROR, abs_x,    7, 0, 1) \
+    X(0x7f, RRA, abs_x,    7, 0, 0) \
+    X(0x80, NOP, imm,      2, 0, 0) \
+    X(0x81, STA, ind_x,    6, 0, 1) \
+    X(0x82, NOP, imm,      2, 0, 0) \
+    X(0x83, SAX, ind_x,    6, 0, 0) \
+    X(0x84, STY, zp,       3, 0, 1) \
+    X(0x85, STA, zp,       3, 0, 1) \
+    X(0x86, STX, zp,       3, 0, 1) \
+    X(0x87, SAX, zp,       3, 0, 0) \
+    X(0x88, DEY, imp,      2, 0, 1) \
+    X(0x89, NOP, imm,      2, 0, 0) \
+    X(0x8a, TXA, imp,      2, 0, 1) \
+    X(0x8b, XAA, imm,      2, 0, 0) \
+    X(0x8c, STY, abs,      4, 0, 1) \
+    X(0x8d, STA, abs,      4, 0, 1) \
+    X(0x8e, STX, abs,      4, 0, 1) \
+    X(0x8f, SAX, abs,      4, 0, 0) \
+    X(0x90, BCC, rel,      2, 1, 1) \
+    X(0x91, STA, ind_y,    6, 0, 1) \
+    X(0x92, KIL, imp,      0, 0, 0) \
+    X(0x93, AHX, ind_y,    6, 0, 0) \
+    X(0x94, STY, zp_ind_x, 4, 0, 1) \
+    X(0x95, STA, zp_ind_x, 4, 0, 1) \
+    X(0x96, STX, zp_ind_y, 4, 0, 1) \
+    X(0x97, SAX, zp_ind_y, 4, 0, 0) \
+    X(0x98, TYA, imp,      2, 0, 1) \
+    X(0x99, STA, abs_y,    5, 0, 1) \
+    X(0x9a, TXS, imp,      2, 0, 1) \
+    X(0x9b, TAS, abs_y,    5, 0, 0) \
+    X(0x9c, ILL, imp,      0, 0, 0) \
+    X(0x9d, STA, abs_x,    5, 0, 1) \
+    X(0x9e, ILL, imp,      0, 0, 0) \
+    X(0x9f, AHX, abs_y,    5, 0, 0) \
+    X(0xa0, LDY, imm,      2, 0, 1) \
+    X(0xa1, LDA, ind_x,    6, 0, 1) \
+    X(0xa2, LDX, imm,      2, 0, 1) \
+    X(0xa3, LAX, ind_x,    6, 0, 0) \
+    X(0xa4, LDY, zp,       3, 0, 1) \
+    X(0xa5, LDA, zp,       3, 0, 1) \
+    X(0xa6, LDX, zp,       3, 0, 1) \
+    X(0xa7, LAX, zp,       3, 0, 0) \
+    X(0xa8, TAY, imp,      2, 0, 1) \
+    X(0xa9, LDA, imm,      2, 0, 1) \
+    X(0xaa, TAX, imp,      2, 0, 1) \
+    X(0xab, LAX, imm,      2, 0, 0) \
+    X(0xac, LDY, abs,      4, 0, 1) \
+    X(0xad, LDA, abs,      4, 0, 1) \
+    X(0xae, LDX, abs,      4, 0, 1) \
+    X(0xaf, LAX, abs,      4, 0, 0) \
+    X(0xb0, BCS, rel,      2, 1, 1) \
+    X(0xb1, LDA, ind_y,    5, 1, 1) \
+    X(0xb2, KIL, imp,      0, 0, 0) \
+    X(0xb3, LAX, ind_y,    5, 1, 0) \
+    X(0xb4, LDY, zp_ind_x, 4, 0, 1) \
+    X(0xb5, LDA, zp_ind_x, 4, 0, 1) \
+    X(0xb6, LDX, zp_ind_y, 4, 0, 1) \
+    X(0xb7, LAX, zp_ind_y, 4, 0, 0) \
+    X(0xb8, CLV, imp,      2, 0, 1) \
+    X(0xb9, LDA, abs_y,    4, 1, 1) \
+    X(0xba, TSX, imp,      2, 0, 1) \
+    X(0xbb, LAS, abs_y,    4, 1, 0) \
+    X(0xbc, LDY, abs_x,    4, 1, 1) \
+    X(0xbd, LDA, abs_x,    4, 1, 1) \
+    X(0xbe, LDX, abs_y,    4, 1, 1) \
+    X(0xbf, LAX, abs_y,    4, 1, 0) \
+    X(0xc0, CPY, imm,      2, 0, 1) \
+    X(0xc1, CMP, ind_x,    6, 0, 1) \
+    X(0xc2, NOP, imm,      2, 0, 0) \
+    X(0xc3, DCP, ind_x,    8, 0, 0) \
+    X(0xc4, CPY, zp,       3, 0, 1) \
+    X(0xc5, CMP, zp,       3, 0, 1) \
+    X(0xc6, DEC, zp,       5, 0, 1) \
+    X(0xc7, DCP, zp,       5, 0, 0) \
+    X(0xc8, INY, imp,      2, 0, 1) \
+    X(0xc9, CMP, imm,      2, 0, 1) \
+    X(0xca, DEX, imp,      2, 0, 1) \
+    X(0xcb, AXS, imm,      2, 0, 0) \
+    X(0xcc, CPY, abs,      4, 0, 1) \
+    X(0xcd, CMP, abs,      4, 0, 1) \
+    X(0xce, DEC, abs,      6, 0, 1) \
+    X(0xcf, DCP, abs,      6, 0, 0) \
+    X(0xd0, BNE, rel,      2, 1, 1) \
+    X(0xd1, CMP, ind_y,    5, 1, 1) \
+    X(0xd2, KIL, imp,      0, 0, 0) \
+    X(0xd3, DCP, ind_y,    8, 0, 0) \
+    X(0xd4, NOP, zp_ind_x, 4, 0, 0) \
+    X(0xd5, CMP, zp_ind_x, 4, 0, 1) \
+    X(0xd6, DEC, zp_ind_x, 6, 0, 1) \
+    X(0xd7, DCP, zp_ind_x, 6, 0, 0) \
+    X(0xd8, CLD, imp,      2, 0, 1) \
+    X(0xd9, CMP, abs_y,    4, 1, 1) \
+    X(0xda, NOP, imp,      2, 0, 0) \
+    X(0xdb, DCP, abs_y,    7, 0, 0) \
+    X(0xdc, NOP, abs_x,    4, 1, 0) \
+    X(0xdd, CMP, abs_x,    4, 1, 1) \
+    X(0xde, DEC, abs_x,    7, 0, 1) \
+    X(0xdf, DCP, abs_x,    7, 0, 0) \
+    X(0xe0, CPX, imm,      2, 0, 1) \
+    X(0xe1, SBC, ind_x,    6, 0, 1) \
+    X(0xe2, NOP, imm,      2, 0, 0) \
+    X(0xe3, ISC, ind_x,    8, 0, 0) \
+    X(0xe4, CPX, zp,       3, 0, 1) \
+    X(0xe5, SBC, zp,       3, 0, 1) \
+    X(0xe6, INC, zp,       5, 0, 1) \
+    X(0xe7, ISC, zp,       5, 0, 0) \
+    X(0xe8, INX, imp,      2, 0, 1) \
+    X(0xe9, SBC, imm,      2, 0, 1) \
+    X(0xea, NOP, imp,      2, 0, 1) \
+    X(0xeb, SBC, imm,      2, 0, 0) \
+    X(0xec, CPX, abs,      4, 0, 1) \
+    X(0xed, SBC, abs,      4, 0, 1) \
+    X(0xee, INC, abs,      6, 0, 1) \
+    X(0xef, ISC, abs,      6, 0, 0) \
+    X(0xf0, BEQ, rel,      2, 1, 1) \
+    X(0xf1, SBC, ind_y,    5, 1, 1) \
+    X(0xf2, KIL, imp,      0, 0, 0) \
+    X(0xf3, ISC, ind_y,    8, 0, 0) \
+    X(0xf4, NOP, zp_ind_x, 4, 0, 0) \
+    X(0xf5, SBC, zp_ind_x, 4, 0, 1) \
+    X(0xf6, INC, zp_ind_x, 6, 0, 1) \
+    X(0xf7, ISC, zp_ind_x, 6, 0, 0) \
+    X(0xf8, SED, imp,      2, 0, 1) \
+    X(0xf9, SBC, abs_y,    4, 1, 1) \
+    X(0xfa, NOP, imp,      2, 0, 0) \
+    X(0xfb, ISC, abs_y,    7, 0, 0) \
+    X(0xfc, NOP, abs_x,    4, 1, 0) \
+    X(0xfd, SBC, abs_x,    4, 1, 1) \
+    X(0xfe, INC, abs_x,    7, 0, 1) \
+    X(0xff, ISC, abs_x,    7, 0, 0)
 
 class nes_cpu : public nes_component
 {
@@ -102,6 +386,8 @@ public :
     {
         _system = nullptr;
         _mem = nullptr;
+        _jit_enabled = false;
+        _idle_loop_skip_enabled = true;
     }
 
 public :
@@ -118,11 +404,26 @@ public :
     void stop_at_infinite_loop() { _stop_at_infinite_loop = true; }
     void stop_at_addr(uint16_t addr) { _is_stop_at_addr = true;  _stop_at_addr = addr; }
 
+    // Opt-in native code backend (see nes_jit.h). Stays disabled if the platform doesn't support it
+    void enable_jit(bool enable);
+    bool is_jit_enabled() { return _jit_enabled; }
+
+    // Bring PPU up to the start of the current instruction. PPU is only stepped on demand - before PPU 
+    // register / mapper register accesses, and when it reaches a point that CPU would notice on its own
+    void sync_ppu();
+
+    // Start of the current instruction - register accesses happen "at" this cycle (see sync_ppu)
+    nes_cycle_t instruction_cycle() { return _instruction_cycle; }
+
+    // Fast-forward through idle loops polling RAM or PPUSTATUS (see skip_idle_loop). On by default
+    void enable_idle_loop_skip(bool enable) { _idle_loop_skip_enabled = enable; }
+    bool is_idle_loop_skip_enabled() { return _idle_loop_skip_enabled; }
+
     void set_carry_flag(bool set) { set_flag(PROCESSOR_STATUS_CARRY_MASK, set); }
     uint8_t get_carry() { return (_context.P & PROCESSOR_STATUS_CARRY_MASK); }
 
-    void set_zero_flag(bool set) { set_flag(PROCESSOR_STATUS_ZERO_MASK, set); }
-    bool is_zero() { return _context.P & PROCESSOR_STATUS_ZERO_MASK; }
+    void set_zero_flag(bool set) { _z_result = set ? 0 : 1; }
+    bool is_zero() { return _z_result == 0; }
 
     void set_interrupt_flag(bool set) { set_flag(PROCESSOR_STATUS_INTERRUPT_MASK, set); }
     bool is_interrupt() { return _context.P & PROCESSOR_STATUS_INTERRUPT_MASK; }
@@ -132,11 +433,11 @@ public :
     void set_I_flag(bool set) { set_flag(PROCESSOR_STATUS_I_MASK, set); }
     void set_B_flag(bool set) { set_flag(PROCESSOR_STATUS_B_MASK, set); }
 
-    void set_overflow_flag(bool set) { set_flag(PROCESSOR_STATUS_OVERFLOW_MASK, set); }
-    bool is_overflow() { return _context.P & PROCESSOR_STATUS_OVERFLOW_MASK; }
+    void set_overflow_flag(bool set) { _v_result = set ? 0x80 : 0; }
+    bool is_overflow() { return _v_result & 0x80; }
 
-    void set_negative_flag(bool set) { set_flag(PROCESSOR_STATUS_NEGATIVE_MASK, set); }
-    bool is_negative() { return _context.P & PROCESSOR_STATUS_NEGATIVE_MASK; }
+    void set_negative_flag(bool set) { _n_result = set ? 0x80 : 0; }
+    bool is_negative() { return _n_result & 0x80; }
 
     uint8_t peek(uint16_t addr) { return _mem->get_byte(addr); }
     uint16_t peek_word(uint16_t addr) { return _mem->get_word(addr); }
@@ -146,9 +447,24 @@ public :
     uint8_t &X() { return _context.X; }
     uint8_t &Y() { return _context.Y; }
     uint16_t &PC() { return _context.PC; }
-    uint8_t &P() { return _context.P; }
     uint8_t &S() { return _context.S; }
 
+    uint8_t P()
+    {
+        // N/Z/V are only materialized here - see _n_result/_z_result/_v_result
+        return (_context.P & ~(PROCESSOR_STATUS_NEGATIVE_MASK | PROCESSOR_STATUS_ZERO_MASK | PROCESSOR_STATUS_OVERFLOW_MASK)) |
+            (_n_result & PROCESSOR_STATUS_NEGATIVE_MASK) |
+            (_z_result ? 0 : PROCESSOR_STATUS_ZERO_MASK) |
+            ((_v_result & 0x80) >> 1);
+    }
+    void set_P(uint8_t val)
+    {
+        _context.P = val;
+        _n_result = val;
+        _z_result = (val & PROCESSOR_STATUS_ZERO_MASK) ? 0 : 1;
+        _v_result = val << 1;
+    }
+
     void request_nmi() { _nmi_pending = true; };
     void request_dma(uint16_t addr) { _dma_pending = true; _dma_addr = addr; }
 
@@ -190,11 +506,109 @@ public :
     }
 
 private :
-    // execute on instruction, update processor status as needed, and move CPU internal cycle count
-    void exec_one_instruction();
+    //
+    // An instruction decoded from PRG. Only valid while version matches the PRG window version in 
+    // nes_memory - any bank switch or write into the window makes it stale
+    //
+    struct nes_decoded_op
+    {
+        uint32_t version;
+        uint8_t op_code;
+        uint8_t size;                           // op code + operand
+        uint16_t operand;
+    };
+
+    // Handles everything between two instructions (PPU catch up, stop requests, NMI, OAMDMA) 
+    // Returns false if we should stop executing instructions
+    bool begin_instruction(nes_cycle_t new_count);
+
+    // execute instructions until new_count, update processor status as needed, and move CPU internal cycle count
+    template <bool trace>
+    void dispatch(nes_cycle_t new_count);
+    void trace_op_code(uint8_t op_code);
+
+    //
+    // JIT - runs translated blocks for PRG code and interprets everything else
+    // Translated code works on registers / flags / cycles here directly
+    //
+    friend class nes_jit;
+
+    void jit_dispatch(nes_cycle_t new_count);
+
+    // Called from translated code (see nes_jit) for bus accesses / instructions it doesn't do on its
+    // own, with _cycle written back. limit is the latest cycle the rest of the block could start an
+    // instruction at - these set _jit_exit if the block can't keep going
+    static uint32_t jit_read(nes_cpu *cpu, uint32_t addr, int64_t limit);
+    static void jit_write(nes_cpu *cpu, uint32_t addr, uint32_t val, int64_t limit);
+    static void jit_interpret(nes_cpu *cpu, uint32_t pc, int64_t limit);
+
+    // Whether begin_instruction would have anything to do before limit
+    bool jit_must_exit(nes_cycle_t limit)
+    {
+        return _nmi_pending || _dma_pending || _system->stop_requested() || limit >= _ppu_sync_cycle || limit >= _step_target;
+    }
+
+    //
+    // Idle loops - a short loop in PRG that only reads RAM/PPUSTATUS and branches, such as 
+    // LDA $2002 / BPL or LDA flag / BEQ. Once an iteration comes back to the loop with exactly the 
+    // same registers, every following iteration does the same until NMI or the PPU changes what the 
+    // loop reads - so we can move _cycle straight to just before that point
+    //
+    struct nes_idle_loop
+    {
+        uint16_t pc;                            // loop start (back edge target)
+        uint16_t back_edge_pc;                  // the branch / JMP going back to pc
+        uint32_t version;                       // PRG version the loop is analyzed from
+        bool is_idle;
+        bool reads_ppu_status;
+        uint8_t max_cycles;                     // longest possible iteration
+
+        // State last time we're back at pc - only valid if is_armed
+        bool is_armed;
+        nes_cycle_t cycle;
+        nes_cycle_t next_event;
+        uint8_t A, X, Y, P;
+    };
+
+    // Called when a branch / JMP at back_edge_pc is going back to loop_pc, with the cycles
+    // of the branch / JMP not yet stepped
+    void skip_idle_loop(uint16_t loop_pc, uint16_t back_edge_pc, nes_cpu_cycle_t pending_cycles);
+    void analyze_idle_loop(uint16_t loop_pc, uint16_t back_edge_pc, nes_idle_loop &loop);
+
     void NMI();
     void OAMDMA();
 
+    //
+    // Fetches op code at PC and its operand (into _operand), and moves PC to the next instruction
+    // Code in PRG ($8000~$FFFF) comes from the decoded cache. Everything else (RAM, WRAM) goes 
+    // through the bus every time as it can change under us.
+    //
+    uint8_t fetch_op_code()
+    {
+        if (_context.PC >= PRG_WINDOW_START)
+        {
+            nes_decoded_op &decoded = _decoded_ops[_context.PC - PRG_WINDOW_START];
+            if (decoded.version == _mem->get_prg_version(_context.PC) || decode_op(decoded))
+            {
+                _operand = decoded.operand;
+                _context.PC += decoded.size;
+                return decoded.op_code;
+            }
+        }
+
+        uint8_t op_code = decode_byte();
+        int operand_size = get_operand_size(s_op_code_info[op_code].addr_mode);
+        if (operand_size == 1)
+            _operand = decode_byte();
+        else if (operand_size == 2)
+            _operand = decode_word();
+
+        return op_code;
+    }
+
+    // Decodes the instruction at PC into the decoded cache. Returns false if it can't be cached
+    bool decode_op(nes_decoded_op &decoded);
+
     uint8_t decode_byte()
     {
         return _mem->get_byte(_context.PC++);
@@ -216,104 +630,98 @@ private :
     }
 
 private :
-    enum operand_kind : uint8_t
-    {
-        operand_kind_acc,
-        operand_kind_imm,
-        operand_kind_addr
-    };
-
     struct operand_t
     {
         uint16_t addr_or_value;
-        operand_kind kind;
-        bool is_page_crossing : 1;
+        bool is_page_crossing;
     };
 
     void step_cpu(nes_cpu_cycle_t cycle);
     void step_cpu(int64_t cycle);
 
-    nes_cpu_cycle_t get_cpu_cycle(operand_t operand, nes_addr_mode mode);
-    nes_cpu_cycle_t get_branch_cycle(bool cond, uint16_t new_addr, int8_t rel);
-    nes_cpu_cycle_t get_shift_cycle(nes_addr_mode addr_mode);
+    // Base cycles of each op code are stepped by the dispatcher - this adds the page crossing cycles
+    template <uint8_t op_code>
+    void step_page_crossing(operand_t op)
+    {
+        if (op.is_page_crossing)
+            step_cpu(nes_cpu_cycle_t(s_op_code_info[op_code].page_cross_cycles));
+    }
 
     //
     // Implements all address mode
+    // Addressing mode is a compile time constant of each op code so all the addressing mode checks below 
+    // fold away in each instruction
     //
-    operand_t decode_operand(nes_addr_mode addr_mode)
+    template <uint8_t op_code>
+    operand_t decode_operand()
     {    
+        constexpr nes_addr_mode addr_mode = s_op_code_info[op_code].addr_mode;
         if (addr_mode == nes_addr_mode::nes_addr_mode_acc)
         {
-            return { 0, operand_kind_acc, false };
+            return { 0, false };
         }
         else if (addr_mode == nes_addr_mode::nes_addr_mode_imm)
         {
             // immediate - next byte is a constant
-            return { decode_byte(), operand_kind_imm, false };
+            return { uint8_t(_operand), false };
         }
         else
         {
             bool page_crossing;
-            uint16_t addr = decode_operand_addr(addr_mode, &page_crossing);
-            return { addr, operand_kind_addr, page_crossing };
+            uint16_t addr = decode_operand_addr<op_code>(&page_crossing);
+            return { addr, page_crossing };
         }
     }
 
+    template <uint8_t op_code>
     uint8_t read_operand(operand_t op)
     {
-        switch (op.kind)
-        {
-        case operand_kind_acc:
+        constexpr nes_addr_mode addr_mode = s_op_code_info[op_code].addr_mode;
+        if (addr_mode == nes_addr_mode::nes_addr_mode_acc)
             return A();
-        case operand_kind_imm:
+        else if (addr_mode == nes_addr_mode::nes_addr_mode_imm)
             // constants are always 8-bit
             return (uint8_t)op.addr_or_value;
-        case operand_kind_addr:
+        else
             return peek(op.addr_or_value);
-        default:
-            assert(false);
-            return -1;
-        }
     }
 
+    template <uint8_t op_code>
     void write_operand(operand_t op, int8_t value)
     {
-        switch (op.kind)
-        {
-        case operand_kind_acc:
+        constexpr nes_addr_mode addr_mode = s_op_code_info[op_code].addr_mode;
+        static_assert(addr_mode != nes_addr_mode::nes_addr_mode_imm, "can't write to a constant");
+        if (addr_mode == nes_addr_mode::nes_addr_mode_acc)
             A() = value;
-            break;
-        case operand_kind_addr:
+        else
             poke(op.addr_or_value, value);
-            break;
-        default:
-            assert(false);
-        }
     }
 
-    uint16_t decode_operand_addr(nes_addr_mode addr_mode, bool *page_crossing = nullptr)
+    template <uint8_t op_code>
+    uint16_t decode_operand_addr(bool *page_crossing = nullptr)
     {
+        constexpr nes_addr_mode addr_mode = s_op_code_info[op_code].addr_mode;
         if (page_crossing)
             *page_crossing = false;
         if (addr_mode == nes_addr_mode::nes_addr_mode_zp)
         {
             // zero page - next byte is 8-bit address
-            return decode_byte();
+            return uint8_t(_operand);
         }
         else if (addr_mode == nes_addr_mode::nes_addr_mode_zp_ind_x)
         {
             // zero page indexed X
-            return (decode_byte() + _context.X) & 0xff;
+            return (uint8_t(_operand) + _context.X) & 0xff;
         }
         else if (addr_mode == nes_addr_mode::nes_addr_mode_zp_ind_y)
         {
             // zero page indexed Y 
-            return (decode_byte() + _context.Y) & 0xff;
+            return (uint8_t(_operand) + _context.Y) & 0xff;
         }
         else if (addr_mode == nes_addr_mode::nes_addr_mode_ind_jmp)
         {
             // Indirect
-            uint16_t addr = decode_word();
+            uint16_t addr = _operand;
             if ((addr & 0xff) == 0xff)
             {
                 // Account for JMP hardware bug
@@ -328,12 +736,12 @@ private :
         else if (addr_mode == nes_addr_mode::nes_addr_mode_abs || addr_mode == nes_addr_mode::nes_addr_mode_abs_jmp)
         {
             // Absolute
-            return decode_word();
+            return _operand;
         }
         else if (addr_mode == nes_addr_mode::nes_addr_mode_abs_x)
         {
             // Absolute X
-            uint16_t addr = decode_word();
+            uint16_t addr = _operand;
             uint16_t new_addr = addr + _context.X;
             if (page_crossing)
                 *page_crossing = ((addr & 0xff00) != (new_addr & 0xff00));
@@ -342,7 +750,7 @@ private :
         else if (addr_mode == nes_addr_mode::nes_addr_mode_abs_y)
         {
             // Absolute Y
-            uint16_t addr = decode_word();
+            uint16_t addr = _operand;
             uint16_t new_addr = addr + _context.Y;
             if (page_crossing)
                 *page_crossing = ((addr & 0xff00) != (new_addr & 0xff00));
@@ -351,14 +759,14 @@ private :
         else if (addr_mode == nes_addr_mode::nes_addr_mode_ind_x)
         {
             // Indexed Indirect, rarely used
-            uint8_t addr = decode_byte();
+            uint8_t addr = uint8_t(_operand);
             return peek((addr + _context.X) & 0xff) + (uint16_t(peek((addr + _context.X + 1) & 0xff)) << 8);
         }
         else if (addr_mode == nes_addr_mode::nes_addr_mode_ind_y)
         {
             // Indirect Indexed
             // implies a table of table address in zero page
-            uint8_t arg_addr = decode_byte();
+            uint8_t arg_addr = uint8_t(_operand);
             uint16_t addr = peek(arg_addr) + (uint16_t(peek((arg_addr + 1) & 0xff)) << 8);
             uint16_t new_addr = addr + _context.Y;
             if (page_crossing)
@@ -379,230 +787,274 @@ private :
     // http://obelisk.me.uk/6502/reference.html
     //
 
+    //
+    // N/Z/V are evaluated lazily: ALU op codes only record the result, and P() / branches derive 
+    // the flags from it when they actually need them. Most results are overwritten before that.
+    //
     void calc_alu_flag(uint8_t value)
     {
-        set_zero_flag(value == 0);
-        set_negative_flag(value & 0x80);
+        _n_result = value;
+        _z_result = value;
     }
 
-    bool is_sign_overflow(uint8_t val1, int8_t val2, uint8_t new_value)
+    // Overflow happens when both operands have the same sign and the result has a different sign
+    void calc_overflow_flag(uint8_t val1, uint8_t val2, uint8_t new_value)
     {
-        return (((val1 & 0x80) == (val2 & 0x80)) &&
-            ((val1 & 0x80) != (new_value & 0x80)));
+        _v_result = (val1 ^ new_value) & (val2 ^ new_value);
     }
 
-    string get_op_str(const char *op, nes_addr_mode addr_mode, bool is_official = true);
-    void append_operand_str(string &str, nes_addr_mode addr_mode);
+    string get_op_str(uint8_t op_code);
+    void append_operand_str(string &str, nes_addr_mode addr_mode, uint16_t operand_addr);
 
-    void branch(bool cond, nes_addr_mode addr_mode);
+    template <uint8_t op_code>
+    void branch(bool cond);
 
     // ADC - Add with carry
-    void ADC(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void ADC();
     void _ADC(uint8_t val);
 
     // AND - Logical AND
-    void AND(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void AND();
 
     // ASL - Arithmetic Shift Left
-    void ASL(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void ASL();
     
     // BCC - Branch if Carry Clear
-    void BCC(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void BCC();
 
     // BCS - Branch if Carry Set 
-    void BCS(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void BCS();
 
     // BEQ - Branch if Equal
-    void BEQ(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void BEQ();
 
     // BIT - Bit test
-    void BIT(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void BIT();
 
     // BMI - Branch if minus
-    void BMI(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void BMI();
 
     // BNE - Branch if not equal
-    void BNE(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void BNE();
 
     // BPL - Branch if positive 
-    void BPL(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void BPL();
 
     // BRK - Force interrupt
-    void BRK(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void BRK();
 
     // BVC - Branch if overflow clear
-    void BVC(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void BVC();
 
     // BVS - Branch if overflow set
-    void BVS(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void BVS();
 
     // CLC - Clear carry flag
-    void CLC(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void CLC();
 
     // CLD - Clear decimal mode
-    void CLD(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void CLD();
 
     // CLI - Clear interrupt disable
-    void CLI(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void CLI();
 
     // CLV - Clear overflow flag
-    void CLV(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void CLV();
 
     // CMP - Compare 
-    void CMP(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void CMP();
 
     // CPX - Compare X register
-    void CPX(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void CPX();
 
     // CPY - Compare Y register
-    void CPY(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void CPY();
 
     // DEC - Decrement memory
-    void DEC(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void DEC();
 
     // DEX - Decrement X register
-    void DEX(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void DEX();
 
     // DEY - Decrement Y register
-    void DEY(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void DEY();
 
     // Exclusive OR 
-    void EOR(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void EOR();
 
     // INC - Increment memory
-    void INC(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void INC();
 
     // INX - Increment X
-    void INX(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void INX();
 
     // INY - Increment Y
-    void INY(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void INY();
 
     // JMP - Jump 
-    void JMP(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void JMP();
 
     // JSR - Jump to subroutine
-    void JSR(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void JSR();
 
     // LDA - Load Accumulator
-    void LDA(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void LDA();
 
     // LDX - Load X register
-    void LDX(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void LDX();
 
     // LDY - Load Y register
-    void LDY(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void LDY();
 
     // LSR - Logical shift right
-    void LSR(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void LSR();
 
     // NOP - NOP
-    void NOP(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void NOP();
 
     // ORA - Logical Inclusive OR
-    void ORA(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void ORA();
 
     // PHA - Push accumulator
-    void PHA(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void PHA();
 
     // PHP - Push processor status
-    void PHP(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void PHP();
 
     // PLA - Pull accumulator
-    void PLA(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void PLA();
 
     // PLP - Pull processor status
-    void PLP(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void PLP();
     void _PLP();
 
     // ROL - Rotate left
-    void ROL(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void ROL();
 
     // ROR - Rotate right
-    void ROR(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void ROR();
 
     // RTI - Return from interrupt
-    void RTI(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void RTI();
 
     // RTS - Return from subroutine
-    void RTS(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void RTS();
 
     // SBC - Subtract with carry
-    void SBC(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void SBC();
     void _SBC(uint8_t val);
 
     // SEC - Set carry flag
-    void SEC(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void SEC();
 
     // SED - Set decimal flag
-    void SED(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void SED();
 
     // SEI - Set interrupt disable
-    void SEI(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void SEI();
 
     // STA - Store Accumulator  
-    void STA(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void STA();
 
     // STX - Store X
-    void STX(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void STX();
 
     // STY- Store Y
-    void STY(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void STY();
 
     // TAX - Transfer accumulator to X 
-    void TAX(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void TAX();
 
     // TAY - Transfer accumulator to Y
-    void TAY(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void TAY();
 
     // TSX - Transfer stack pointer to X 
-    void TSX(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void TSX();
 
     // TXA - Transfer X to acc
-    void TXA(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void TXA();
 
     // TXS - Transfer X to stack pointer
-    void TXS(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void TXS();
 
     // TYA - Transfer Y to accumulator
-    void TYA(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void TYA();
 
     // KIL - Kill?
-    void KIL(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void KIL();
 
     //===================================================================================
     // Unofficial OP codes
     //===================================================================================
 
-    void ALR(nes_addr_mode addr_mode);
-    void ANC(nes_addr_mode addr_mode);
-    void ARR(nes_addr_mode addr_mode);
-    void AXS(nes_addr_mode addr_mode);
-    void LAX(nes_addr_mode addr_mode);
-    void SAX(nes_addr_mode addr_mode);
-    void DCP(nes_addr_mode addr_mode);
-    void ISC(nes_addr_mode addr_mode);
-    void RLA(nes_addr_mode addr_mode);
-    void RRA(nes_addr_mode addr_mode);
-    void SLO(nes_addr_mode addr_mode);
-    void SRE(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void ALR();
+    template <uint8_t op_code> void ANC();
+    template <uint8_t op_code> void ARR();
+    template <uint8_t op_code> void AXS();
+    template <uint8_t op_code> void LAX();
+    template <uint8_t op_code> void SAX();
+    template <uint8_t op_code> void DCP();
+    template <uint8_t op_code> void ISC();
+    template <uint8_t op_code> void RLA();
+    template <uint8_t op_code> void RRA();
+    template <uint8_t op_code> void SLO();
+    template <uint8_t op_code> void SRE();
     
-    void XAA(nes_addr_mode addr_mode);
-    void AHX(nes_addr_mode addr_mode);
-    void TAS(nes_addr_mode addr_mode);
-    void LAS(nes_addr_mode addr_mode);
+    template <uint8_t op_code> void XAA();
+    template <uint8_t op_code> void AHX();
+    template <uint8_t op_code> void TAS();
+    template <uint8_t op_code> void LAS();
+
+    // Unrecognized instruction or illegal instruction
+    template <uint8_t op_code> void ILL();
+
+private :
+    //
+    // One entry per op code - see NES_OP_CODE_TABLE
+    //
+    struct op_code_info
+    {
+        const char *name;
+        nes_addr_mode addr_mode;
+        uint8_t cycles;
+        uint8_t page_cross_cycles;
+        bool is_official;
+    };
+
+    #define OP_CODE_INFO(op_code, op, mode, cycles, page_cross_cycles, official) { #op, nes_addr_mode_##mode, cycles, page_cross_cycles, official },
+    static constexpr op_code_info s_op_code_info[0x100] = { NES_OP_CODE_TABLE(OP_CODE_INFO) };
+    #undef OP_CODE_INFO
+
+    typedef void (nes_cpu::*op_code_handler)();
+    static const op_code_handler s_op_code_handlers[0x100];
+
+    // Op codes that could be part of an idle loop - see analyze_idle_loop
+    static const bool s_idle_loop_op_codes[0x100];
 
 private :
     nes_system      *_system;
     nes_memory      *_mem;
     nes_ppu         *_ppu;
-    nes_cpu_context _context;
+    nes_cpu_context _context;               // N/Z/V bits in P are stale - use P()
+    uint8_t         _n_result;              // last result that set N - N is its bit 7
+    uint8_t         _z_result;              // last result that set Z - Z is set if it is 0
+    uint8_t         _v_result;              // V is bit 7 - see calc_overflow_flag
     nes_cycle_t     _cycle;
+    nes_cycle_t     _instruction_cycle;     // _cycle at the start of current instruction
+    nes_cycle_t     _ppu_sync_cycle;        // PPU needs to catch up once we get here - see sync_ppu
     bool            _nmi_pending;           // NMI interrupt pending from PPU vertical blanking
     bool            _dma_pending;           // OAMDMA is requested from writing $4014
     uint16_t        _dma_addr;              // starting address
     bool            _stop_at_infinite_loop; // stop at when the ROM starts infinite loop - useful for testing
     bool            _is_stop_at_addr;       // stop at a certain address - useful for testing
     uint16_t        _stop_at_addr;          // stop at a certain address - useful for testing
+    uint16_t        _operand;               // operand bytes of current instruction
+    vector<nes_decoded_op> _decoded_ops;    // decoded instruction cache for $8000~$FFFF, indexed by PC
+    unique_ptr<nes_jit> _jit;
+    bool            _jit_enabled;
+    nes_cycle_t     _step_target;           // target cycle of current step_to
+    bool            _jit_exit;              // translated code needs to leave - see jit_must_exit
+    bool            _idle_loop_skip_enabled;
+    nes_idle_loop   _idle_loop;             // last loop we've seen
 };
 
@@ -0,0 +1,214 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//=================================================================================================
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+//
+// Native code backend for nes_cpu - only x86-64 for now
+// Everywhere else nes_jit::is_available returns false and CPU always interprets
+//
+#if defined(__x86_64__) || defined(_M_X64)
+#define NES_JIT_X64
+#endif
+
+// Memory reserved for translated blocks - everything is thrown away once it is full
+#define NES_JIT_CODE_SIZE   0x400000
+
+// Blocks are cached for $8000~$FFFF, indexed by starting PC
+#define NES_JIT_BLOCK_START 0x8000
+#define NES_JIT_BLOCK_COUNT 0x8000
+
+// Longest block we'd translate, in instructions
+#define NES_JIT_MAX_BLOCK_OPS 32
+
+class nes_cpu;
+
+//
+// Translates straight line PRG code into x86-64. While a block runs A/X/Y and the cycle count live
+// in registers, RAM and the memory page tables are accessed inline and the ALU op codes are done
+// natively. What's left (I/O registers, mapper registers, the odd op codes) goes through nes_cpu
+// one access / instruction at a time.
+//
+// PPU catch up and everything else begin_instruction looks for is checked once per block: a block
+// only starts if its last instruction would still start before the PPU needs to catch up (and
+// before the end of the step), assuming every instruction takes its longest path. Only a register
+// access through the bus can change that, so the block re-checks after those and leaves if needed.
+// Blocks jump straight into the next block while that holds, so loops stay in native code.
+//
+// Code memory is never writable and executable at the same time - it is only made writable while
+// a block is being written into it.
+//
+class nes_jit
+{
+public :
+    nes_jit();
+    ~nes_jit();
+
+    // Whether we could get executable memory on this platform
+    bool is_available() { return _code != nullptr; }
+
+    // Throw away all translated blocks
+    void reset();
+
+    // Returns the block starting at pc if it was translated from the same PRG version
+    const uint8_t *get_block(uint16_t pc, uint32_t version)
+    {
+        auto &entry = _blocks[pc - NES_JIT_BLOCK_START];
+        if (entry.code && entry.version == version)
+            return entry.code;
+
+        return nullptr;
+    }
+
+    // Translates the block starting at pc ($8000~$FFFF). Returns null if it can't be translated
+    const uint8_t *translate(nes_cpu *cpu, uint16_t pc, uint32_t version);
+
+    // Runs block until it (or a block it jumps to) leaves, with PC / registers / cycles written back
+    void run(nes_cpu *cpu, const uint8_t *block)
+    {
+        ((void (*)(nes_cpu *, const uint8_t *))_enter)(cpu, block);
+    }
+
+private :
+    struct block_entry
+    {
+        const uint8_t *code;
+        uint32_t version;               // PRG window version the block is translated from
+    };
+
+    // One instruction of the block being translated
+    struct block_op
+    {
+        uint16_t pc;
+        uint8_t op_code;
+        uint16_t operand;
+        uint16_t next_pc;
+        int max_cycles;                 // page crossing and taken branch included
+    };
+
+    // Memory operand [base + index * scale + disp]
+    struct mem_t
+    {
+        int base;
+        int index;
+        int scale;
+        int32_t disp;
+    };
+
+    // Where the operand of an instruction is
+    enum operand_kind
+    {
+        operand_ram,                    // RAM at ram
+        operand_static,                 // addr, known at translation
+        operand_dynamic,                // address in ecx
+    };
+
+    struct operand_loc
+    {
+        operand_kind kind;
+        mem_t ram;
+        uint16_t addr;
+    };
+
+    // What emit_native_op did
+    enum native_op
+    {
+        native_op_none,                 // nothing - needs the interpreter
+        native_op_done,                 // falls through to the next instruction, cycles not added yet
+        native_op_jump,                 // left the block
+    };
+
+    // A forward jump to be patched once the target is known
+    typedef size_t fixup_t;
+
+    // Makes [start, end) of the code memory writable / executable
+    bool protect(size_t start, size_t end, bool writable);
+
+    // Shared entry / exit / chaining code at the start of code memory
+    bool emit_stubs(nes_cpu *cpu);
+
+    //
+    // Translation
+    //
+    int decode_block(nes_cpu *cpu, uint16_t pc, block_op *ops);
+    static bool is_block_end(const block_op &op);
+    bool emit_op(const block_op &op, int64_t rest_cycles, const uint8_t *block);
+    native_op emit_native_op(const block_op &op, int64_t rest_cycles, const uint8_t *block);
+    void emit_interpret(const block_op &op, int64_t rest_cycles);
+    void emit_exit_jcc(int cc, uint16_t pc);
+    void emit_exit_check(uint16_t pc, bool check_version);
+    void emit_jump_to(uint16_t pc, const uint8_t *block);
+    void emit_store_regs();
+    void emit_load_regs();
+
+    // Operand address into loc, and the operand itself into eax
+    void emit_operand_addr(const block_op &op, operand_loc &loc);
+    void emit_read_operand(const block_op &op, int64_t rest_cycles);
+    void emit_read(const operand_loc &loc, int64_t rest_cycles);
+    void emit_write(const operand_loc &loc, int val_reg, int64_t rest_cycles);
+    void emit_page_crossing(const block_op &op);
+
+    // Bus access through nes_cpu - address in ecx
+    void emit_bus_read(int64_t rest_cycles);
+    void emit_bus_write(int val_reg, int64_t rest_cycles);
+
+    // Flags
+    void emit_set_nz(int reg);
+    void emit_set_carry(int reg);
+    void emit_load_carry(int reg);
+
+    //
+    // x86-64 encoding
+    //
+    void emit_byte(uint8_t val) { _code[_code_size++] = val; }
+    void emit_word(uint16_t val);
+    void emit_dword(uint32_t val);
+    void emit_qword(uint64_t val);
+    void emit_rex(bool w, int reg, int index, int base, bool byte_reg);
+    void emit_opcode(uint32_t opcode);
+    void emit_modrm(int reg, const mem_t &mem);
+    void emit_rm(int size, uint32_t opcode, int reg, const mem_t &mem);
+    void emit_rr(int size, uint32_t opcode, int reg, int rm);
+    void emit_mov_imm(int reg, uint64_t val);
+    void emit_mov_mem_imm(int size, const mem_t &mem, uint32_t val);
+    void emit_alu_imm(int size, int ext, int rm, int32_t val);
+    void emit_alu_mem_imm(int size, int ext, const mem_t &mem, int32_t val);
+    void emit_test_mem_imm(const mem_t &mem, uint8_t val);
+    void emit_shift_imm(int size, int ext, int reg, uint8_t count);
+    void emit_push(int reg);
+    void emit_pop(int reg);
+    void emit_call(const void *func);
+    void emit_jmp_reg(int reg);
+    fixup_t emit_jcc(int cc);
+    fixup_t emit_jmp();
+    void emit_jcc_to(int cc, const uint8_t *target);
+    void emit_jmp_to(const uint8_t *target);
+    void bind(fixup_t fixup);
+
+    static mem_t mem(int base, int32_t disp, int index = -1, int scale = 1) { return { base, index, scale, disp }; }
+    mem_t cpu_mem(const void *field);
+
+private :
+    uint8_t             *_code;         // code memory
+    size_t              _code_size;     // bytes used
+    nes_cpu             *_cpu;          // CPU the shared stubs are emitted for
+    const uint8_t       *_enter;        // (cpu, block) - loads registers and jumps to block
+    const uint8_t       *_exit;         // writes registers back and returns from _enter
+    const uint8_t       *_chain;        // jumps to the block at ecx if there is a valid one, or exits
+    vector<block_entry> _blocks;
+
+    // Block being translated
+    uint16_t            _block_pc;
+    uint32_t            _block_version;
+    vector<fixup_t>     _exits;         // exits to be emitted at the end of the block, and their PC
+    vector<uint16_t>    _exit_pcs;
+    bool                _bus_access;    // current instruction could go through nes_cpu
+    bool                _bus_write;     // ... and write
+};
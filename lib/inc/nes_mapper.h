@@ -122,6 +122,9 @@ public :
     void write_chr_bank_1(uint8_t val);
     void write_prg_bank(uint8_t val);
 
+    // Maps 16KB/32KB of PRG ROM at offset into $8000~$FFFF
+    void map_prg(uint16_t addr, uint32_t offset, uint32_t size);
+
 private :
     nes_ppu *_ppu;
     nes_memory *_mem;
@@ -3,6 +3,7 @@
 #include <vector>
 #include <cassert>
 #include <memory>
+#include <algorithm>
 
 #include <nes_component.h>
 #include <nes_mapper.h>
@@ -11,8 +12,32 @@ using namespace std;
 
 #define RAM_SIZE 0x10000
 
+//
+// PRG ($8000~$FFFF) is tracked in 8KB windows - the granularity of MMC1/MMC3 bank switching
+// Each window has a version that changes whenever its content changes (bank switch or write) so 
+// that CPU can tell when its decoded instructions are stale
+//
+#define PRG_WINDOW_START  0x8000
+#define PRG_WINDOW_SIZE   0x2000
+#define PRG_WINDOW_SHIFT  13
+#define PRG_WINDOW_COUNT  4
+
+//
+// CPU address space is mapped in 256 byte pages. A page either points straight into memory or is
+// null, in which case the access goes to read_page_handler/write_page_handler (I/O registers,
+// mapper registers, and writes to PRG)
+//
+#define MEMORY_PAGE_SHIFT 8
+#define MEMORY_PAGE_SIZE  0x100
+#define MEMORY_PAGE_COUNT 0x100
+
+// Versions reserved for the PRG ROM banks of each loaded mapper - see map_prg
+#define PRG_ROM_MAX_BANKS 0x1000
+
 class nes_mapper;
+class nes_cpu;
 class nes_ppu;
+class nes_apu;
 
 class nes_memory : public nes_component
 {
@@ -20,6 +45,12 @@ public :
     nes_memory()
     {
         _ram.reserve(RAM_SIZE);
+
+        _prg_version_count = 0;
+        _prg_rom_version = 0;
+        invalidate_prg(PRG_WINDOW_START, PRG_WINDOW_COUNT * PRG_WINDOW_SIZE);
+
+        map_pages();
     }
 
     bool is_io_reg(uint16_t addr)
@@ -38,11 +69,11 @@ public :
 
     uint8_t get_byte(uint16_t addr)
     {
-        redirect_addr(addr);
-        if (is_io_reg(addr))
-            return read_io_reg(addr);
+        uint8_t *page = _read_pages[addr >> MEMORY_PAGE_SHIFT];
+        if (page)
+            return page[addr & (MEMORY_PAGE_SIZE - 1)];
 
-        return _ram[addr];
+        return read_page_handler(addr);
     }
 
     uint16_t get_word(uint16_t addr)
@@ -51,22 +82,60 @@ public :
         return get_byte(addr) + (uint16_t(get_byte(addr + 1)) << 8);
     }
 
-    void set_byte(uint16_t addr, uint8_t val);
+    void set_byte(uint16_t addr, uint8_t val)
+    {
+        uint8_t *page = _write_pages[addr >> MEMORY_PAGE_SHIFT];
+        if (page)
+        {
+            page[addr & (MEMORY_PAGE_SIZE - 1)] = val;
+            return;
+        }
+
+        write_page_handler(addr, val);
+    }
 
     void set_bytes(uint16_t addr, uint8_t *data, size_t size)
     {
         assert(size + addr <= RAM_SIZE);
         redirect_addr(addr);
         memcpy_s(&_ram[0] + addr, RAM_SIZE - addr, data, size);
+        invalidate_prg(addr, size);
+
+        // Whatever PRG ROM bank was mapped there is replaced
+        if (addr + size > PRG_WINDOW_START)
+            map_ram_pages(max<uint32_t>(addr, PRG_WINDOW_START), addr + size);
     }
 
     void get_bytes(uint8_t *dest, uint16_t dest_size, uint16_t src_addr, size_t src_size)
     {
         assert(src_addr + src_size <= RAM_SIZE);
+        assert(src_size <= dest_size);
         redirect_addr(src_addr);
-        memcpy_s(dest, dest_size, &_ram[0] + src_addr, src_size);
+
+        // Source could be (partially) in a PRG ROM bank
+        while (src_size > 0)
+        {
+            uint32_t page_offset = src_addr & (MEMORY_PAGE_SIZE - 1);
+            size_t size = min<size_t>(src_size, MEMORY_PAGE_SIZE - page_offset);
+            uint8_t *page = _read_pages[src_addr >> MEMORY_PAGE_SHIFT];
+            if (page)
+                memcpy(dest, page + page_offset, size);
+            else
+                memcpy(dest, &_ram[0] + src_addr, size);
+
+            dest += size;
+            src_addr += size;
+            src_size -= size;
+        }
     }
 
+    //
+    // Maps [offset, offset + size) of PRG ROM to addr without copying - used by mappers for bank
+    // switching. Both addr and size are in whole PRG windows. prg_rom needs to stay alive until 
+    // it is unmapped by another map_prg, set_bytes, load_mapper or power_on
+    //
+    void map_prg(uint16_t addr, vector<uint8_t> &prg_rom, uint32_t offset, uint32_t size);
+
     void set_word(uint16_t addr, uint16_t value)
     {
         // NES 6502 CPU is little endian
@@ -88,6 +157,34 @@ public :
         }
     }
 
+    // Version of the PRG window that addr ($8000~$FFFF) is in
+    uint32_t get_prg_version(uint16_t addr)
+    {
+        return _prg_version[(addr >> PRG_WINDOW_SHIFT) & (PRG_WINDOW_COUNT - 1)];
+    }
+
+    // Give all PRG windows overlapping [addr, addr + size) a new version
+    void invalidate_prg(uint32_t addr, size_t size)
+    {
+        if (addr + size <= PRG_WINDOW_START)
+            return;
+
+        if (addr < PRG_WINDOW_START)
+        {
+            size -= PRG_WINDOW_START - addr;
+            addr = PRG_WINDOW_START;
+        }
+
+        for (uint32_t window = addr & ~(PRG_WINDOW_SIZE - 1); window < addr + size; window += PRG_WINDOW_SIZE)
+            _prg_version[(window >> PRG_WINDOW_SHIFT) & (PRG_WINDOW_COUNT - 1)] = ++_prg_version_count;
+    }
+
+    // For code that does the page lookup itself (see nes_jit). None of these pointers ever change
+    uint8_t *ram() { return _ram.data(); }
+    uint8_t *const *read_pages() { return _read_pages; }
+    uint8_t *const *write_pages() { return _write_pages; }
+    const uint32_t *prg_versions() { return _prg_version; }
+
     void load_mapper(shared_ptr<nes_mapper> &mapper);
 
     nes_mapper& get_mapper() { return *_mapper; }
@@ -107,14 +204,38 @@ public :
         // Do nothing
     }
 
+private :
+    // Builds _read_pages/_write_pages from the current mapper
+    void map_pages();
+
+    // Points read pages in [start, end) back to _ram
+    void map_ram_pages(uint32_t start, uint32_t end)
+    {
+        for (uint32_t addr = start & ~(MEMORY_PAGE_SIZE - 1); addr < end; addr += MEMORY_PAGE_SIZE)
+            _read_pages[addr >> MEMORY_PAGE_SHIFT] = _ram.data() + addr;
+    }
+
+    // Accesses to pages that aren't mapped directly
+    uint8_t read_page_handler(uint16_t addr);
+    void write_page_handler(uint16_t addr, uint8_t val);
+
 private :
     vector<uint8_t>        _ram;
     shared_ptr<nes_mapper> _mapper;
 
     nes_system *_system;
+    nes_cpu *_cpu;
     nes_ppu *_ppu;
+    nes_apu *_apu;
     nes_input *_input;
 
     nes_mapper_info _mapper_info;
+
+    uint32_t _prg_version[PRG_WINDOW_COUNT];    // see get_prg_version
+    uint32_t _prg_version_count;                // never reused so a stale version can't match again
+    uint32_t _prg_rom_version;                  // version of the first PRG ROM bank of current mapper
+
+    uint8_t *_read_pages[MEMORY_PAGE_COUNT];    // see MEMORY_PAGE_SHIFT
+    uint8_t *_write_pages[MEMORY_PAGE_COUNT];
 };
 
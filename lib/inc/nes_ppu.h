@@ -2,6 +2,10 @@
 
 #include <cstdint>
 #include <memory>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include <nes_component.h>
 #include <nes_cycle.h>
@@ -12,10 +16,58 @@
 // http://wiki.nesdev.com/w/index.php/PPU_memory_map
 #define PPU_VRAM_SIZE 0x4000
 
+// Pattern tables ($0000~$1FFF) are mapped in 1KB CHR pages - either into CHR RAM (the start of 
+// _vram) or directly into the mapper's CHR ROM, so that mappers can switch CHR banks without copying
+#define PPU_PATTERN_TABLE_SIZE 0x2000
+#define PPU_CHR_PAGE_SHIFT 10
+#define PPU_CHR_PAGE_SIZE 0x400
+#define PPU_CHR_PAGE_COUNT 8
+
+// Name tables ($2000~$2FFF, mirrored at $3000~$3EFF) are 4 1KB logical tables pointing into the 
+// physical tables in _vram - which ones depend on the mirroring mode (see set_mirroring)
+#define PPU_NAME_TBL_ADDR 0x2000
+#define PPU_NAME_TBL_SHIFT 10
+#define PPU_NAME_TBL_SIZE 0x400
+#define PPU_NAME_TBL_COUNT 4
+
+// Palette ($3F00~$3F1F, mirrored up to $3FFF) lives in its own 32 bytes rather than in _vram
+// $3F10/$3F14/$3F18/$3F1C share the same byte as $3F00/$3F04/$3F08/$3F0C and are kept in sync
+#define PPU_PALETTE_ADDR 0x3f00
+#define PPU_PALETTE_SIZE 0x20
+
+// Each 16-byte tile has 8 rows, and each row is kept pre-expanded in a nes_chr_row (see decode_chr_row)
+// Pixel in bit i of both bitplanes goes to bit 2i (bitplane 0) and 2i + 1 (bitplane 1)
+#define PPU_CHR_PAGE_ROWS (PPU_CHR_PAGE_SIZE / 2)
+#define PPU_CHR_ROW_BITPLANE0_MASK 0x5555
+#define PPU_CHR_ROW_BITPLANE1_MASK 0xaaaa
+
+// Scanline line buffers have 4-bit palette index of each pixel (see composite_scanline)
+// Background pixels fetched in the current scanline have PPU_BG_LINE_FETCHED, and sprite pixels have
+// PPU_SPRITE_LINE_PALETTE so that 0 means no sprite. Either way bit 1/0 is 0 for transparent pixels
+#define PPU_BG_LINE_INDEX_MASK 0xf
+#define PPU_BG_LINE_OPAQUE_MASK 0x3
+#define PPU_BG_LINE_FETCHED 0x80
+#define PPU_SPRITE_LINE_PALETTE 0x10
+#define PPU_COMPOSITE_KEEP 0xff
+
+// Scanline compositing goes 16 pixels at a time with SSE2 where it is available (always on x64)
+// Everything else uses the plain loop
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NES_PPU_SSE2
+#endif
+
 // OAM (Object Attribute Memory) - internal memory inside PPU for 64 sprites of 4 bytes each
 // wiki.nesdev.com/w/index.php/PPU_OAM
 #define PPU_OAM_SIZE 0x100
 
+// Frame buffer has 6-bit color of each pixel, turned into ARGB with a lookup table of all 64 colors
+// for each of the 8 color emphasis combinations (see get_frame_argb). Grayscale only keeps the 
+// column of gray colors (0x00, 0x10, 0x20, 0x30)
+#define PPU_COLOR_COUNT 0x40
+#define PPU_COLOR_MASK 0x3f
+#define PPU_GRAYSCALE_COLOR_MASK 0x30
+#define PPU_ARGB_PALETTE_SIZE (PPU_COLOR_COUNT * 8)
+
 //
 // All registe masks
 // http://wiki.nesdev.com/w/index.php/PPU_registers
@@ -61,6 +113,8 @@
 #define PPUMASK_EMPHASIZE_RED 0x20
 #define PPUMASK_EMPHASIZE_GREEN 0x40
 #define PPUMASK_EMPHASIZE_BLUE 0x80
+#define PPUMASK_EMPHASIZE_MASK 0xe0
+#define PPUMASK_EMPHASIZE_SHIFT 5
 
 // Previously written to a PPU register (due to not being updated for this address)
 #define PPUSTATUS_LATCH_MASK 0x1f
@@ -94,11 +148,52 @@
 #define PPU_SPRITE_ATTR_HORIZONTAL_FLIP 0x40
 #define PPU_SPRITE_ATTR_VERTICAL_FLIP 0x80
 
+// Max scanline bands a deferred frame is rendered in parallel (see enable_parallel_render)
+#define PPU_RENDER_BAND_MAX 16
+
 class nes_system;
 class nes_mapper;
 
 using namespace std;
 
+struct nes_chr_row
+{
+    uint16_t pixels;
+    uint16_t flipped_pixels;        // horizontally flipped
+};
+
+//
+// Deferred rendering (see enable_deferred_render) - everything the CPU does to PPU state during a 
+// frame is logged with the PPU cycle it happens at, and replayed against a copy of the PPU taken at
+// the start of the frame
+//
+enum nes_ppu_log_op : uint8_t
+{
+    nes_ppu_log_op_write_PPUCTRL,
+    nes_ppu_log_op_write_PPUMASK,
+    nes_ppu_log_op_read_PPUSTATUS,
+    nes_ppu_log_op_write_OAMADDR,
+    nes_ppu_log_op_write_OAMDATA,
+    nes_ppu_log_op_write_PPUSCROLL,
+    nes_ppu_log_op_write_PPUADDR,
+    nes_ppu_log_op_write_PPUDATA,
+    nes_ppu_log_op_read_PPUDATA,
+    nes_ppu_log_op_oam_dma,             // OAM after DMA is in log data at offset
+    nes_ppu_log_op_map_chr,
+    nes_ppu_log_op_set_mirroring,
+};
+
+struct nes_ppu_log_entry
+{
+    nes_cycle_t cycle;                  // PPU master cycle
+    nes_ppu_log_op op;
+    uint8_t val;                        // register value / mirroring flags
+    uint16_t addr;                      // map_chr
+    vector<uint8_t> *chr_rom;           // map_chr
+    uint32_t offset;                    // map_chr / oam_dma
+    uint32_t size;                      // map_chr
+};
+
 enum nes_ppu_state
 {
     nes_ppu_state_power_on,     // initial
@@ -127,6 +222,25 @@ public :
     {
         _vram = make_unique<uint8_t[]>(PPU_VRAM_SIZE);
         _oam = make_unique<uint8_t[]>(PPU_OAM_SIZE);
+        _chr_ram_rows = make_unique<nes_chr_row[]>(PPU_PATTERN_TABLE_SIZE / 2);
+        _chr_rom_rows_src = nullptr;
+
+        map_chr_ram(0, PPU_PATTERN_TABLE_SIZE);
+        set_mirroring(nes_mapper_flags_vertical_mirroring);
+        memset(_palette, 0, sizeof(_palette));
+
+        _scanline_renderer_enabled = true;
+        _frame_render_enabled = true;
+        _deferred_render_enabled = false;
+        _render_band_count = 1;
+        _render_generation = 0;
+        _render_pending = 0;
+        _render_threads_exit = false;
+        _render_job = nullptr;
+        _log_valid = false;
+        _log_rendered = false;
+
+        init_argb_palette();
     }
     
     ~nes_ppu();
@@ -146,9 +260,66 @@ public :
 
     void step_ppu(nes_ppu_cycle_t cycle);
     void fetch_tile();
+    void fetch_tile(int scanline_render_cycle, uint16_t cur_scanline);
     void fetch_tile_pipeline();
     void fetch_sprite_pipeline();
     void fetch_sprite(uint8_t sprite_id);
+    void evaluate_sprite(uint8_t sprite_id);
+    void increment_scroll_y();
+    void reset_scroll_x();
+    void render_scanline();
+    void init_argb_palette();
+    void create_deferred_frames();
+    void step_deferred_render();
+    void start_deferred_frame();
+    void discard_deferred_frames();
+    void copy_frame_state(const nes_ppu &ppu);
+    void replay_frame_log(const nes_ppu &frame, int end_line);
+    void render_deferred_frame(nes_ppu &frame);
+    nes_ppu *completed_frame();
+    void start_render_threads(uint32_t count);
+    void stop_render_threads();
+    void render_thread(uint32_t band, uint32_t generation);
+    int band_first_line(uint32_t band) { return int(band * PPU_SCREEN_Y / _render_band_count); }
+    void bucket_sprites();
+    void composite_scanline();
+    void update_line_palette();
+    void resolve_line_colors();
+    void composite_line_colors(uint8_t *frame_line);
+
+    // Merges the line buffers of one scanline into frame_line through palette - see composite_scanline
+    static void composite_line(const uint8_t *bg_line, const uint8_t *sprite_line, const uint8_t *sprite_front_line, const uint8_t *palette, uint8_t *frame_line);
+#ifdef NES_PPU_SSE2
+    static void composite_line_sse2(const uint8_t *bg_line, const uint8_t *sprite_line, const uint8_t *sprite_front_line, const uint8_t *palette, uint8_t *frame_line);
+#endif
+
+    // Render whole scanlines at a time whenever step_to covers them - otherwise go cycle by cycle
+    void enable_scanline_renderer(bool enable) { _scanline_renderer_enabled = enable; }
+    bool is_scanline_renderer_enabled() { return _scanline_renderer_enabled; }
+
+    // Turning off frame rendering keeps everything the CPU can see exact (timing, scrolling, sprite 
+    // evaluation, sprite 0 hit) but doesn't produce any pixels - frame_buffer is left as is. Useful 
+    // for fast forwarding. Takes effect from the next frame so that a frame is never half rendered
+    void enable_frame_render(bool enable) { _frame_render_enabled = enable; }
+    bool is_frame_render_enabled() { return _frame_render_enabled; }
+
+    //
+    // Deferred rendering runs the frame without rendering (as enable_frame_render(false)) and logs
+    // every PPU state change from the CPU and the mapper instead. The frame is rendered from the
+    // log in one go the first time frame_buffer / get_frame_argb asks for it - or never. Starts 
+    // from the next frame
+    //
+    void enable_deferred_render(bool enable);
+    bool is_deferred_render_enabled() { return _deferred_render_enabled; }
+
+    //
+    // Splits each deferred frame into bands of scanlines rendered on thread_count threads (0 = one 
+    // per core) at the same time. Each band starts from a copy of the PPU taken one scanline before
+    // the band - that scanline is rendered again only to prefetch the first tiles and sprites of 
+    // the band. Only has effect with deferred rendering
+    //
+    void enable_parallel_render(bool enable, uint32_t thread_count = 0);
+    bool is_parallel_render_enabled() { return _render_band_count > 1; }
 
     bool is_ready() { return _master_cycle > nes_ppu_cycle_t(29658); }
 
@@ -160,6 +331,49 @@ public :
 
     bool is_render_off() { return !_show_bg && !_show_sprites; }
 
+    nes_cycle_t master_cycle() { return _master_cycle; }
+    uint32_t frame_count() { return _frame_count; }
+    int scanline() { return _cur_scanline; }
+    nes_ppu_cycle_t scanline_cycle() { return _scanline_cycle; }
+
+    // 
+    // Amount of PPU cycles until PPU reaches <scanline, cycle> - either later in this frame or in the next
+    // Always counts the full 341 cycles of the pre-render scanline - the skipped cycle in odd frames is still
+    // accounted for in _master_cycle (see step_to)
+    //
+    nes_ppu_cycle_t cycles_until(int scanline, int cycle)
+    {
+        int64_t frame_cycles = PPU_SCANLINE_CYCLE.count() * PPU_SCANLINE_COUNT;
+        int64_t target = PPU_SCANLINE_CYCLE.count() * scanline + cycle;
+        int64_t cur = PPU_SCANLINE_CYCLE.count() * _cur_scanline + _scanline_cycle.count();
+        int64_t cycles = (target - cur + frame_cycles) % frame_cycles;
+        if (cycles == 0)
+            cycles = frame_cycles;
+        return nes_ppu_cycle_t(cycles);
+    }
+
+    //
+    // Amount of PPU cycles until the next point where CPU could observe a change - VBlank start (and
+    // NMI) and end of frame. With watch_status it also includes PPUSTATUS flag changes. Sprite 0 hit and
+    // sprite overflow can happen anywhere in a visible scanline when rendering is on, so that's 0 there
+    //
+    nes_ppu_cycle_t cycles_until_event(bool watch_status)
+    {
+        nes_ppu_cycle_t cycles = min(cycles_until(241, 1), cycles_until(0, 0));
+        if (watch_status)
+        {
+            if (!is_render_off() && _cur_scanline < PPU_SCREEN_Y)
+                return nes_ppu_cycle_t(0);
+
+            // See the VBlank end @HACK in step_to
+            cycles = min(cycles, cycles_until(260, 341 - 11));
+            cycles = min(cycles, cycles_until(261, 0));
+            cycles = min(cycles, cycles_until(261, 1));
+        }
+
+        return cycles;
+    }
+
     void load_mapper(shared_ptr<nes_mapper> &mapper);
 
     void set_mirroring(nes_mapper_flags flags);
@@ -167,18 +381,38 @@ public :
     uint8_t *frame_buffer()
     {
         // Return the completed buffer
-        if (_frame_buffer == _frame_buffer_1)
-            return _frame_buffer_2;
+        nes_ppu *frame = completed_frame();
+        if (frame->_frame_buffer == frame->_frame_buffer_1)
+            return frame->_frame_buffer_2;
         else
-            return _frame_buffer_1;
+            return frame->_frame_buffer_1;
     }
 
     void swap_buffer()
     {
         if (_frame_buffer == _frame_buffer_1)
+        {
             _frame_buffer = _frame_buffer_2;
+            _frame_color_mode = _frame_color_mode_2;
+        }
         else
+        {
             _frame_buffer = _frame_buffer_1;
+            _frame_color_mode = _frame_color_mode_1;
+        }
+    }
+
+    //
+    // Writes the completed frame (the same one as frame_buffer) as ARGB8888 into pixels, with each 
+    // scanline's grayscale / color emphasis applied. pitch is in bytes so that pixels can be a locked
+    // texture directly
+    //
+    void get_frame_argb(uint32_t *pixels, int pitch);
+
+    uint32_t get_argb_color(uint8_t color, uint8_t color_mode)
+    {
+        uint8_t color_mask = (color_mode & PPUMASK_GRAYSCALE) ? PPU_GRAYSCALE_COLOR_MASK : PPU_COLOR_MASK;
+        return _argb_palette[((color_mode & PPUMASK_EMPHASIZE_MASK) >> PPUMASK_EMPHASIZE_SHIFT) * PPU_COLOR_COUNT + (color & color_mask)];
     }
 
 public :
@@ -188,22 +422,53 @@ public :
     //
     uint8_t read_byte(uint16_t addr)
     {
-        redirect_addr(addr);
+        if (addr < PPU_PATTERN_TABLE_SIZE)
+            return read_chr(addr);
+
+        if (addr < PPU_PALETTE_ADDR)
+            return read_name_tbl(addr);
 
         if (addr >= PPU_VRAM_SIZE)
             return 0xff;
 
-        return _vram[addr];
+        return _palette[addr & (PPU_PALETTE_SIZE - 1)];
     }
 
     void write_byte(uint16_t addr, uint8_t val)
     {
-        redirect_addr(addr);
-        
+        if (addr < PPU_PATTERN_TABLE_SIZE)
+        {
+            // Writes to CHR ROM are ignored
+            uint8_t *page = _chr_write_pages[addr >> PPU_CHR_PAGE_SHIFT];
+            if (page)
+            {
+                page[addr & (PPU_CHR_PAGE_SIZE - 1)] = val;
+                decode_chr_row(_chr_row_pages[addr >> PPU_CHR_PAGE_SHIFT], page, addr & (PPU_CHR_PAGE_SIZE - 1));
+            }
+            return;
+        }
+
+        if (addr < PPU_PALETTE_ADDR)
+        {
+            _name_tbl_pages[(addr >> PPU_NAME_TBL_SHIFT) & (PPU_NAME_TBL_COUNT - 1)][addr & (PPU_NAME_TBL_SIZE - 1)] = val;
+            return;
+        }
+
         if (addr >= PPU_VRAM_SIZE)
             return;
 
-        _vram[addr] = val;
+        // Pixels already fetched keep the colors they have now - see resolve_line_colors
+        if (_line_has_pixels && _render_frame && !_line_colors_resolved)
+            resolve_line_colors();
+
+        uint8_t palette_addr = addr & (PPU_PALETTE_SIZE - 1);
+        _palette[palette_addr] = val;
+
+        // mirror special case 0x3f10 = 0x3f00, 0x3f14 = 0x3f04, ...
+        if ((palette_addr & 0x3) == 0)
+            _palette[palette_addr ^ 0x10] = val;
+
+        _line_palette_dirty = true;
     }
 
     void write_bytes(uint16_t addr, uint8_t *src, size_t src_size)
@@ -211,41 +476,139 @@ public :
         if (addr + src_size > PPU_VRAM_SIZE)
             return;
 
-        redirect_addr(addr);
-        memcpy_s(_vram.get() + addr, PPU_VRAM_SIZE - addr, src, src_size);
+        // Whatever CHR ROM bank was mapped there is replaced
+        if (addr < PPU_PATTERN_TABLE_SIZE)
+        {
+            uint32_t end = (uint32_t)min<size_t>(addr + src_size, PPU_PATTERN_TABLE_SIZE);
+            memcpy_s(_vram.get() + addr, PPU_PATTERN_TABLE_SIZE - addr, src, end - addr);
+            map_chr_ram(addr, end);
+
+            for (uint32_t chr_addr = addr; chr_addr < end; ++chr_addr)
+                decode_chr_row(_chr_ram_rows.get(), _vram.get(), chr_addr);
+
+            src += end - addr;
+            src_size -= end - addr;
+            addr = end;
+        }
+
+        // name tables and palette need to go through mirroring
+        for (size_t i = 0; i < src_size; ++i)
+            write_byte(uint16_t(addr + i), src[i]);
+    }
+
+    // $2000~$3EFF - name tables and their mirror
+    uint8_t read_name_tbl(uint16_t addr)
+    {
+        return _name_tbl_pages[(addr >> PPU_NAME_TBL_SHIFT) & (PPU_NAME_TBL_COUNT - 1)][addr & (PPU_NAME_TBL_SIZE - 1)];
+    }
+
+    uint8_t read_chr(uint16_t addr)
+    {
+        return _chr_pages[addr >> PPU_CHR_PAGE_SHIFT][addr & (PPU_CHR_PAGE_SIZE - 1)];
+    }
+
+    // Decoded row of the tile at addr (bitplane bit is ignored)
+    const nes_chr_row &read_chr_row(uint16_t addr)
+    {
+        return _chr_row_pages[addr >> PPU_CHR_PAGE_SHIFT][get_chr_row_index(addr & (PPU_CHR_PAGE_SIZE - 1))];
     }
 
-    void redirect_addr(uint16_t &addr)
+    // tile (addr bit 4~) and row (addr bit 0~2) within the page - bit 3 (bitplane) is dropped
+    static uint32_t get_chr_row_index(uint32_t addr)
     {
-        if ((addr & 0xff00) == 0x3f00)
+        return ((addr >> 1) & ~0x7) | (addr & 0x7);
+    }
+
+    // Re-decodes the row containing the byte at addr from CHR bytes in chr
+    static void decode_chr_row(nes_chr_row *rows, const uint8_t *chr, uint32_t addr)
+    {
+        uint32_t row_addr = addr & ~0x8;
+        uint8_t bitplane0 = chr[row_addr];
+        uint8_t bitplane1 = chr[row_addr | 0x8];
+
+        nes_chr_row &row = rows[get_chr_row_index(addr)];
+        row.pixels = spread_bits(bitplane0) | (spread_bits(bitplane1) << 1);
+        row.flipped_pixels = spread_bits(reverse_bits(bitplane0)) | (spread_bits(reverse_bits(bitplane1)) << 1);
+    }
+
+    // bit i -> bit 2i
+    static uint16_t spread_bits(uint8_t val)
+    {
+        uint16_t bits = val;
+        bits = (bits | (bits << 4)) & 0x0f0f;
+        bits = (bits | (bits << 2)) & 0x3333;
+        bits = (bits | (bits << 1)) & 0x5555;
+        return bits;
+    }
+
+    static uint8_t reverse_bits(uint8_t val)
+    {
+        val = uint8_t((val & 0xf0) >> 4 | (val & 0x0f) << 4);
+        val = uint8_t((val & 0xcc) >> 2 | (val & 0x33) << 2);
+        val = uint8_t((val & 0xaa) >> 1 | (val & 0x55) << 1);
+        return val;
+    }
+
+    //
+    // Maps [offset, offset + size) of CHR ROM to PPU addr without copying - used by mappers for CHR
+    // bank switching. Both addr and size are in whole 1KB CHR pages. chr_rom needs to stay alive
+    // until it is unmapped by another map_chr, write_bytes or load_mapper
+    //
+    void map_chr(uint16_t addr, vector<uint8_t> &chr_rom, uint32_t offset, uint32_t size)
+    {
+        assert(addr % PPU_CHR_PAGE_SIZE == 0 && size % PPU_CHR_PAGE_SIZE == 0);
+        assert(addr + size <= PPU_PATTERN_TABLE_SIZE && offset + size <= chr_rom.size());
+
+        if (nes_ppu_log_entry *entry = log_op(nes_ppu_log_op_map_chr, 0))
         {
-            // mirror of palette table every 0x20 bytes
-            addr &= 0xff1f;
+            entry->addr = addr;
+            entry->chr_rom = &chr_rom;
+            entry->offset = offset;
+            entry->size = size;
+        }
 
-            // mirror special case 0x3f10 = 0x3f00, 0x3f14 = 0x3f04, ...
-            if ((addr & 0xfff3) == 0x3f10)
-                addr &= 0x3f0f;
+        // CHR ROM never changes so it is decoded in one go the first time we see it
+        if (_chr_rom_rows_src != chr_rom.data() || _chr_rom_rows.size() != chr_rom.size() / 2)
+        {
+            _chr_rom_rows.resize(chr_rom.size() / 2);
+            for (uint32_t chr_addr = 0; chr_addr < chr_rom.size(); ++chr_addr)
+                decode_chr_row(_chr_rom_rows.data(), chr_rom.data(), chr_addr);
+            _chr_rom_rows_src = chr_rom.data();
         }
-        else if ((addr & 0xf000) == 0x2000)
+
+        for (uint32_t page = 0; page < size; page += PPU_CHR_PAGE_SIZE)
         {
-            // name table mirroring
-            if (_mirroring_flags == nes_mapper_flags_vertical_mirroring)
-                addr &= 0xf7ff;     // $2000=$2800, $2400=$2c00
-            else if (_mirroring_flags == nes_mapper_flags_horizontal_mirroring)
-                addr &= 0xfbff;     // $2000=$2400, $2800=$2c00
-            else if (_mirroring_flags == nes_mapper_flags_one_screen_lower_bank)
-                addr &= 0xf3ff;     // $2000 mapped to all the other 3
-            else if (_mirroring_flags == nes_mapper_flags_one_screen_upper_bank)
-                addr = (addr & 0xf3ff) | 0x400; // $2400 mapped to all the other 3
-            else assert(!"Unsupported mirroring modes");
-        } 
-        else if (addr >= 0x3000)
+            _chr_pages[(addr + page) >> PPU_CHR_PAGE_SHIFT] = chr_rom.data() + offset + page;
+            _chr_write_pages[(addr + page) >> PPU_CHR_PAGE_SHIFT] = nullptr;
+            _chr_row_pages[(addr + page) >> PPU_CHR_PAGE_SHIFT] = _chr_rom_rows.data() + (offset + page) / 2;
+        }
+    }
+
+    // Points CHR pages in [start, end) back to CHR RAM
+    void map_chr_ram(uint32_t start, uint32_t end)
+    {
+        for (uint32_t addr = start & ~(PPU_CHR_PAGE_SIZE - 1); addr < end; addr += PPU_CHR_PAGE_SIZE)
         {
-            // 0x3000~0x3f00 mirrors to 0x2000~0x2f00
-            addr -= 0x1000;
+            _chr_pages[addr >> PPU_CHR_PAGE_SHIFT] = _vram.get() + addr;
+            _chr_write_pages[addr >> PPU_CHR_PAGE_SHIFT] = _vram.get() + addr;
+            _chr_row_pages[addr >> PPU_CHR_PAGE_SHIFT] = _chr_ram_rows.get() + addr / 2;
         }
     }
 
+    // Records op in the log of the frame being recorded (if any) - see enable_deferred_render
+    nes_ppu_log_entry *log_op(nes_ppu_log_op op, uint8_t val)
+    {
+        if (!_recording_frame || !_recording_frame->_log_valid)
+            return nullptr;
+
+        _recording_frame->_log.push_back(nes_ppu_log_entry());
+        nes_ppu_log_entry &entry = _recording_frame->_log.back();
+        entry.cycle = _master_cycle;
+        entry.op = op;
+        entry.val = val;
+        return &entry;
+    }
+
     // Avoid destructive reads for PPU registers
     // Useful in logging code
     // See nes_ppu_protect
@@ -278,6 +641,7 @@ public :
         // Ignore write before PPU is ready
         if (!is_ready()) return;
 
+        log_op(nes_ppu_log_op_write_PPUCTRL, val);
         write_latch(val);
 
         uint8_t name_table_addr_bit = val & PPUCTRL_BASE_NAME_TABLE_ADDR_MASK;
@@ -305,11 +669,13 @@ public :
         // Ignore write before PPU is ready
         if (!is_ready()) return;
 
+        log_op(nes_ppu_log_op_write_PPUMASK, val);
         write_latch(val);
 
         _show_bg = val & PPUMASK_SHOW_BACKGROUND;
         _show_sprites = val & PPUMASK_SHOW_SPRITES;
         _gray_scale_mode = val & PPUMASK_GRAYSCALE;
+        _color_mode = val & (PPUMASK_GRAYSCALE | PPUMASK_EMPHASIZE_MASK);
     }
 
     uint8_t read_PPUSTATUS()
@@ -325,6 +691,8 @@ public :
         // Don't clear flags
         if (!_protect_register)
         {
+            log_op(nes_ppu_log_op_read_PPUSTATUS, 0);
+
             // clear various flags after reading
             _vblank_started = false;
             _addr_toggle = false;
@@ -337,6 +705,7 @@ public :
 
     void write_OAMADDR(uint8_t val)
     {
+        log_op(nes_ppu_log_op_write_OAMADDR, val);
         write_latch(val);
 
         _oam_addr = val;
@@ -344,10 +713,13 @@ public :
 
     void write_OAMDATA(uint8_t val)
     {
+        log_op(nes_ppu_log_op_write_OAMDATA, val);
         write_latch(val);
 
         _oam[_oam_addr] = val;
         _oam_addr++;
+
+        _sprite_buckets_dirty = true;
     }
 
     uint8_t read_OAMDATA()
@@ -368,6 +740,7 @@ public :
         // Ignore write before PPU is ready
         if (!is_ready()) return;
 
+        log_op(nes_ppu_log_op_write_PPUSCROLL, val);
         write_latch(val);
 
         _addr_toggle = !_addr_toggle;
@@ -388,6 +761,7 @@ public :
     void write_PPUADDR(uint8_t val)
     {
         NES_TRACE4("[NES_PPU] write_PPUADDR(Val=" << std::hex << (uint32_t)val << ")");
+        log_op(nes_ppu_log_op_write_PPUADDR, val);
         write_latch(val);
 
         _addr_toggle = !_addr_toggle;
@@ -409,6 +783,7 @@ public :
     void write_PPUDATA(uint8_t val)
     {
         NES_TRACE4("[NES_PPU] write_PPUDATA(Addr=" << std::hex << _ppu_addr << ", Val=" << (uint32_t)val << ")");
+        log_op(nes_ppu_log_op_write_PPUDATA, val);
         write_latch(val);
         write_byte(_ppu_addr, val);
         _ppu_addr += _ppu_addr_inc;
@@ -425,6 +800,8 @@ public :
         bool is_palette = ((_ppu_addr & 0xff00) == 0x3f00);
         if (!_protect_register)
         {
+            log_op(nes_ppu_log_op_read_PPUDATA, 0);
+
             // for palette - the read buf is updated with the mirrored nametable address
             if (is_palette)
                 _vram_read_buf = read_byte(_ppu_addr - 0x1000);
@@ -467,21 +844,20 @@ private :
     {
         // There is only one universal backdrop color doesn't matter which background it is
         if ((palette_index_4_bit & 0x3) == 0)
-            return read_byte(0x3f00);
+            return _palette[0];
 
-        uint16_t palette_addr = (is_background ? 0x3f00 : 0x3f10) | palette_index_4_bit;
-        return read_byte(palette_addr);
+        return _palette[(is_background ? 0 : 0x10) | palette_index_4_bit];
     }
 
-    uint8_t read_pattern_table_column(bool sprite, uint8_t tile_index, uint8_t bitplane, uint8_t tile_row_index)
+    const nes_chr_row &read_pattern_table_row(bool sprite, uint8_t tile_index, uint8_t tile_row_index)
     {
         uint16_t tile_addr = sprite ? _sprite_pattern_tbl_addr : _bg_pattern_tbl_addr;
         tile_addr |= (tile_index << 4);
 
-        return read_byte(tile_addr | (bitplane << 3) | tile_row_index);
+        return read_chr_row(tile_addr | tile_row_index);
     }
    
-    uint8_t read_pattern_table_column_8x16_sprite(uint8_t tile_index, uint8_t bitplane, uint8_t tile_row_index)
+    const nes_chr_row &read_pattern_table_row_8x16_sprite(uint8_t tile_index, uint8_t tile_row_index)
     {
         // TTTTTTB - T is tile number and B is tile pattern table select $0000 or $1000
         uint16_t tile_addr = ((uint16_t(tile_index) & 0x1) << 12) | ((uint16_t(tile_index) & ~0x1) << 4);
@@ -491,14 +867,22 @@ private :
         // 8-f: bitplane 1 for top tile       --> tile row index 0-7
         // 10-17: bitplane 0 for bottom tile  --> tile row index 8-f
         // 18-1f: bitplane 1 for bottom tile  --> tile row index 8-f
-        return read_byte(tile_addr | (bitplane << 3) | (tile_row_index & 0x7) | ((tile_row_index & 0x8) << 1));
+        return read_chr_row(tile_addr | (tile_row_index & 0x7) | ((tile_row_index & 0x8) << 1));
     }
 
  private :
     nes_system *_system;
 
     unique_ptr<uint8_t[]> _vram;
+    uint8_t *_chr_pages[PPU_CHR_PAGE_COUNT];        // see PPU_CHR_PAGE_SHIFT
+    uint8_t *_chr_write_pages[PPU_CHR_PAGE_COUNT];  // null for CHR ROM
+    nes_chr_row *_chr_row_pages[PPU_CHR_PAGE_COUNT]; // decoded rows of _chr_pages
+    unique_ptr<nes_chr_row[]> _chr_ram_rows;        // decoded CHR RAM
+    vector<nes_chr_row> _chr_rom_rows;              // decoded CHR ROM last mapped with map_chr
+    const uint8_t *_chr_rom_rows_src;               // CHR ROM _chr_rom_rows is decoded from
     unique_ptr<uint8_t[]> _oam;
+    uint8_t *_name_tbl_pages[PPU_NAME_TBL_COUNT];   // physical name table in _vram for $2000/$2400/$2800/$2C00
+    uint8_t _palette[PPU_PALETTE_SIZE];             // see PPU_PALETTE_ADDR
 
     // PPUCTRL data
     uint16_t _name_tbl_addr;
@@ -513,6 +897,7 @@ private :
     bool _show_bg;
     bool _show_sprites;
     bool _gray_scale_mode;
+    uint8_t _color_mode;                // grayscale and color emphasis bits
 
     // PPUSTATUS
     uint8_t _latch;
@@ -552,12 +937,26 @@ private :
     // rendering states
     uint8_t _tile_index;                // tile index from name table - it consists of 
     uint8_t _tile_palette_bit32;        // palette index bit 3/2 from attribute table
-    uint8_t _bitplane0;                 // bitplane0 of current tile from pattern table
+    uint16_t _tile_row;                 // decoded row of current tile - only bitplane 0 is used
     uint8_t *_frame_buffer;             // entire frame buffer - only 4 bit is used
     uint8_t _frame_buffer_1[PPU_SCREEN_Y * PPU_SCREEN_X];   // frame buffer 1 - used for double buffering
-    uint8_t _frame_buffer_bg[PPU_SCREEN_Y * PPU_SCREEN_X];  // sprite 0 hit detection
     uint8_t _frame_buffer_2[PPU_SCREEN_Y * PPU_SCREEN_X];   // frame buffer 2 - used for double buffering
-    uint8_t _pixel_cycle[8];            // pixels in each cycle
+    uint8_t *_frame_color_mode;                     // _color_mode of each scanline in _frame_buffer
+    uint8_t _frame_color_mode_1[PPU_SCREEN_Y];      // for _frame_buffer_1
+    uint8_t _frame_color_mode_2[PPU_SCREEN_Y];      // for _frame_buffer_2
+    uint32_t _argb_palette[PPU_ARGB_PALETTE_SIZE];  // see PPU_ARGB_PALETTE_SIZE
+
+    // Current scanline is fetched into these and composited into _frame_buffer at cycle 320 
+    uint8_t _bg_line_index[PPU_SCREEN_X];           // background
+    uint8_t _sprite_line[PPU_SCREEN_X];             // last opaque sprite
+    uint8_t _sprite_front_line[PPU_SCREEN_X];       // last opaque sprite in front of background
+    bool _line_has_pixels;                          // anything in the line buffers at all
+    uint8_t _line_palette[0x20];                    // colors of background palettes followed by sprite palettes
+    bool _line_palette_dirty;                       // palette is written since _line_palette is updated
+    bool _line_colors_resolved;                     // palette is written mid-line - colors are in the ones below
+    uint8_t _bg_line_color[PPU_SCREEN_X];           // color of each pixel in _bg_line_index when it is fetched
+    uint8_t _sprite_line_color[PPU_SCREEN_X];       // ... _sprite_line
+    uint8_t _sprite_front_line_color[PPU_SCREEN_X]; // ... _sprite_front_line
     uint8_t _shift_reg;                 // which bit do we care about
     uint8_t _x_offset;                  // current X offset
 
@@ -568,7 +967,39 @@ private :
     bool _mask_oam_read;                // OAM read is masked at certain sprite evaluation stage to always return FF
     uint8_t _sprite_pos_y;              // last sprite Y read
 
+    bool _scanline_renderer_enabled;    // render a scanline in one go if nothing can happen in the middle
+    bool _frame_render_enabled;         // produce pixels from next frame on
+    bool _render_frame;                 // produce pixels for the current frame
+
+    // Deferred rendering - the frames are copies of this PPU at the start of the frame, with the log
+    // of everything happened since
+    bool _deferred_render_enabled;
+    unique_ptr<nes_ppu> _recording_frame;           // current frame
+    unique_ptr<nes_ppu> _completed_frame;           // last frame - what frame_buffer returns
+    vector<nes_ppu_log_entry> _log;                 // only used in the copies
+    vector<uint8_t> _log_data;                      // OAM for nes_ppu_log_op_oam_dma
+    bool _log_valid;                                // has the state at frame start and a complete log
+    bool _log_rendered;                             // frame is already rendered from the log
+    vector<unique_ptr<nes_ppu>> _bands;             // copies at the start of band 1, 2, ... - band 0 is the frame itself
+
+    // parallel rendering - band N (N > 0) is always rendered by _render_threads[N - 1]
+    uint32_t _render_band_count;
+    vector<thread> _render_threads;
+    mutex _render_mutex;
+    condition_variable _render_start;
+    condition_variable _render_done;
+    uint32_t _render_generation;                    // bumped for every frame handed to _render_threads
+    uint32_t _render_pending;                       // bands not rendered yet
+    bool _render_threads_exit;
+    nes_ppu *_render_job;                           // frame being rendered
+
     shared_ptr<nes_mapper> _mapper;
 
-    nes_mapper_flags _mirroring_flags;  // mapper flags masked by mirroring flags
+    // Sprites in range of each scanline (in OAM order) and whether there are more than 8 of them
+    // Only used when evaluating the entire scanline in one go - see bucket_sprites
+    uint8_t _sprite_bucket[PPU_SCREEN_Y][PPU_ACTIVE_SPRITE_MAX];
+    uint8_t _sprite_bucket_count[PPU_SCREEN_Y];
+    bool _sprite_bucket_overflow[PPU_SCREEN_Y];
+    bool _sprite_buckets_dirty;         // OAM is written since the last bucket_sprites
+    uint8_t _sprite_bucket_height;      // sprite height the buckets are for
 };
\ No newline at end of file
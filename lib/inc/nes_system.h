@@ -52,6 +52,7 @@ public :
     nes_cpu     *cpu()      { return _cpu.get();   }
     nes_memory  *ram()      { return _ram.get();   }
     nes_ppu     *ppu()      { return _ppu.get();   } 
+    nes_apu     *apu()      { return _apu.get();   }
     nes_input   *input()    { return _input.get(); }
 
 public :
@@ -65,14 +66,36 @@ public :
     // I think option #1 will produce the most accurate timing without subjecting too much to OS resource
     // management.
     //
+    // CPU catches PPU up whenever it could notice the difference (register accesses, PPU events - see
+    // nes_cpu::sync_ppu), so <count> can be arbitrarily large and the result is still identical to
+    // stepping one cycle at a time
+    //
     void step(nes_cycle_t count);
 
+    //
+    // Bulk stepping - prefer these over step(1) in a loop
+    //
+
+    // Run <count> master cycles
+    void run_cycles(nes_cycle_t count) { step(count); }
+
+    // Run until PPU finishes current frame and starts the next one (scanline 0, cycle 0)
+    void run_frame();
+
+    // Run until PPU enters the next vertical blank (scanline 241, cycle 1)
+    void run_until_vblank();
+
+    nes_cycle_t master_cycle() { return _master_cycle; }
+
     bool stop_requested() { return _stop_requested; }
 
 private :
     // Emulation loop that is only intended for tests 
     void test_loop();
 
+    // Run until the given master cycle
+    void run_until(nes_cycle_t target);
+
     void init();
 
 private :
@@ -81,6 +104,7 @@ private :
     unique_ptr<nes_cpu> _cpu;
     unique_ptr<nes_memory> _ram;
     unique_ptr<nes_ppu> _ppu;
+    unique_ptr<nes_apu> _apu;
     unique_ptr<nes_input> _input;
 
     vector<nes_component *> _components;
@@ -6,9 +6,9 @@
 //
 void nes_mapper_mmc1::on_load_ram(nes_memory &mem)
 {
-    mem.set_bytes(0x8000, _prg_rom->data() + _prg_rom->size() - 0x8000, 0x8000);
-
     _mem = &mem;
+
+    map_prg(0x8000, _prg_rom->size() - 0x8000, 0x8000);
 }
 
 //
@@ -120,7 +120,7 @@ void nes_mapper_mmc1::write_chr_bank_0(uint8_t val)
     if (_chr_rom->size() < addr + size)
         return;
 
-    _ppu->write_bytes(0x0000, _chr_rom->data() + addr, size);
+    _ppu->map_chr(0x0000, *_chr_rom, addr, size);
 }
 
 /*
@@ -142,7 +142,7 @@ void nes_mapper_mmc1::write_chr_bank_1(uint8_t val)
         if (_chr_rom->size() < addr + size)
             return;
 
-        _ppu->write_bytes(0x1000, _chr_rom->data() + addr, size);
+        _ppu->map_chr(0x1000, *_chr_rom, addr, size);
     }
 }
 
@@ -163,19 +163,32 @@ void nes_mapper_mmc1::write_prg_bank(uint8_t val)
         if (_control & 0x4)
         {
             // fix last bank at $C000 and switch 16KB bank at $8000
-            _mem->set_bytes(0x8000, _prg_rom->data() + (val & 0xf) * 0x4000, 0x4000);
-            _mem->set_bytes(0xc000, _prg_rom->data() + _prg_rom->size() - 0x4000, 0x4000);
+            map_prg(0x8000, (val & 0xf) * 0x4000, 0x4000);
+            map_prg(0xc000, _prg_rom->size() - 0x4000, 0x4000);
         }
         else
         {
             // fix first bank at $8000 and switch 16KB bank at $C000
-            _mem->set_bytes(0x8000, _prg_rom->data(), 0x4000);
-            _mem->set_bytes(0xc000, _prg_rom->data() + (val & 0xf) * 0x4000, 0x4000);
+            map_prg(0x8000, 0, 0x4000);
+            map_prg(0xc000, (val & 0xf) * 0x4000, 0x4000);
         }
     }
     else
     {
         // 32KB mode at $8000
-        _mem->set_bytes(0x8000, _prg_rom->data() + (val & 0xe) * 0x4000, 0x8000);
+        map_prg(0x8000, (val & 0xe) * 0x4000, 0x8000);
     }
-}
\ No newline at end of file
+}
+
+//
+// Maps a PRG ROM bank into CPU memory, ignoring banks the PRG ROM doesn't have
+//
+void nes_mapper_mmc1::map_prg(uint16_t addr, uint32_t offset, uint32_t size)
+{
+    // Bank numbers wrap around in smaller PRG ROMs
+    offset %= _prg_rom->size();
+    if (offset + size > _prg_rom->size())
+        return;
+
+    _mem->map_prg(addr, *_prg_rom, offset, size);
+}
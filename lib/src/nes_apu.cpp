@@ -1,6 +1,32 @@
 #include "stdafx.h"
 
 #include <nes_apu.h>
+#include <nes_cpu.h>
+#include <nes_memory.h>
+#include <blip_buf.h>
+#include <cmath>
+
+nes_apu_mixer::nes_apu_mixer()
+{
+    _pulse_table_float[0] = 0;
+    for (int i = 1; i < APU_PULSE_TABLE_SIZE; ++i)
+        _pulse_table_float[i] = float(95.52 / (8128.0 / i + 100));
+
+    _tnd_table_float[0] = 0;
+    for (int i = 1; i < APU_TND_TABLE_SIZE; ++i)
+        _tnd_table_float[i] = float(163.67 / (24329.0 / i + 100));
+
+    for (int i = 0; i < APU_PULSE_TABLE_SIZE; ++i)
+        _pulse_table[i] = int32_t(lround(_pulse_table_float[i] * APU_AMPLITUDE));
+
+    for (int i = 0; i < APU_TND_TABLE_SIZE; ++i)
+        _tnd_table[i] = int32_t(lround(_tnd_table_float[i] * APU_AMPLITUDE));
+}
+
+uint8_t nes_apu_length_counter::s_length_table[32] = {
+    10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+    12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
 
 uint8_t nes_apu_pulse_channel::s_duty_cycle[4][8] = {
     { 0, 0, 0, 0, 0, 0, 0, 1 },
@@ -13,4 +39,268 @@ uint8_t nes_apu_pulse_channel::s_duty_cycle[4][8] = {
     { 0, 1, 1, 1, 1, 0, 0, 0 },         // 50%
     { 1, 0, 0, 1, 1, 1, 1, 1 }          // 25% negated
     */
-};
\ No newline at end of file
+};
+
+uint8_t nes_apu_triangle_channel::s_sequence[32] = {
+    15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15
+};
+
+// NTSC
+int32_t nes_apu_noise_channel::s_timer_period[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+
+// NTSC
+int32_t nes_apu_dmc_channel::s_timer_period[16] = {
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54
+};
+
+// Step 0 and 2 are quarter frames, step 1 and 3 are quarter + half frames
+int32_t nes_apu::s_frame_step_cycles[2][4] = {
+    { 7457, 14913, 22371, 29829 },      // 4-step
+    { 7457, 14913, 22371, 37281 },      // 5-step - the 4th step does nothing
+};
+
+int32_t nes_apu::s_frame_period[2] = { 29830, 37282 };
+
+void nes_apu_dmc_channel::fill_buffer()
+{
+    if (!_buffer_empty || _bytes_remaining == 0)
+        return;
+
+    _buffer = _mem->get_byte(_cur_addr);
+    _buffer_empty = false;
+
+    // wraps around to $8000
+    _cur_addr = (_cur_addr == 0xffff) ? 0x8000 : _cur_addr + 1;
+    if (--_bytes_remaining == 0)
+    {
+        if (_loop)
+            restart();
+        else if (_irq_enabled)
+            _irq_flag = true;
+    }
+}
+
+nes_apu::nes_apu()
+{
+    _system = nullptr;
+    _cpu = nullptr;
+    _blip = nullptr;
+    _sample_rate = 0;
+    _resample_ratio = 1.0;
+
+    set_sample_rate(APU_SAMPLE_RATE_DEFAULT);
+}
+
+nes_apu::~nes_apu()
+{
+    blip_delete(_blip);
+    _blip = nullptr;
+}
+
+void nes_apu::power_on(nes_system *system)
+{
+    _system = system;
+    _cpu = system->cpu();
+    init();
+}
+
+void nes_apu::init()
+{
+    _cpu_cycle = 0;
+    _time = 0;
+
+    _pulse_1.init(/* ones_complement = */ true);
+    _pulse_2.init(/* ones_complement = */ false);
+    _triangle.init();
+    _noise.init();
+    _dmc.init(_system ? _system->ram() : nullptr);
+
+    // frame counter
+    _frame_counter_mode = 0;
+    _irq_inhibit = true;
+    _frame_irq_flag = false;
+    _frame_step = 0;
+    _frame_seq_start = 0;
+
+    blip_clear(_blip);
+    _amplitude = 0;
+}
+
+void nes_apu::set_sample_rate(int sample_rate)
+{
+    if (sample_rate == _sample_rate)
+        return;
+
+    // room for a full time frame on top of what we keep
+    int frame_samples = int(APU_FRAME_MAX_CYCLES * sample_rate * APU_RESAMPLE_RATIO_MAX / APU_CPU_CLOCK_HZ) + 16;
+    blip_delete(_blip);
+    _blip = blip_new(sample_rate * APU_BUFFER_MS / 1000 + frame_samples);
+    assert(_blip);
+    blip_set_rates(_blip, APU_CPU_CLOCK_HZ, sample_rate * _resample_ratio);
+    _sample_rate = sample_rate;
+    _amplitude = 0;
+}
+
+void nes_apu::set_resample_ratio(double ratio)
+{
+    ratio = max(APU_RESAMPLE_RATIO_MIN, min(APU_RESAMPLE_RATIO_MAX, ratio));
+    if (ratio == _resample_ratio)
+        return;
+
+    // Deltas in the current time frame are already placed with the old ratio
+    if (_time > 0)
+        end_frame();
+
+    blip_set_rates(_blip, APU_CPU_CLOCK_HZ, _sample_rate * ratio);
+    _resample_ratio = ratio;
+}
+
+int nes_apu::samples_avail()
+{
+    // blip_buf can't have deltas of the current time frame too far ahead when reading
+    if (_time > 0)
+        end_frame();
+    return blip_samples_avail(_blip);
+}
+
+int nes_apu::read_samples(int16_t *buf, int count)
+{
+    if (_time > 0)
+        end_frame();
+    return blip_read_samples(_blip, buf, count, /* stereo = */ 0);
+}
+
+void nes_apu::sync()
+{
+    step_to(_cpu->instruction_cycle());
+}
+
+void nes_apu::step_to(nes_cycle_t count)
+{
+    int64_t target = duration_cast<nes_cpu_cycle_t>(count).count();
+    while (_cpu_cycle < target)
+    {
+        int32_t end = int32_t(min<int64_t>(_time + (target - _cpu_cycle), APU_FRAME_MAX_CYCLES));
+        _cpu_cycle += end - _time;
+        run_to(end);
+
+        if (_time >= APU_FRAME_MAX_CYCLES)
+            end_frame();
+    }
+}
+
+void nes_apu::run_to(int32_t end)
+{
+    for (;;)
+    {
+        // Next time anything can happen - idle channels don't have anything to say
+        int32_t time = min(end, frame_step_time());
+        if (!_pulse_1.is_idle()) time = min(time, _pulse_1.next_clock());
+        if (!_pulse_2.is_idle()) time = min(time, _pulse_2.next_clock());
+        if (!_triangle.is_idle()) time = min(time, _triangle.next_clock());
+        if (!_noise.is_idle()) time = min(time, _noise.next_clock());
+        if (!_dmc.is_idle()) time = min(time, _dmc.next_clock());
+        if (time >= end)
+            break;
+
+        _time = time;
+        if (!_pulse_1.is_idle() && _pulse_1.next_clock() == time) _pulse_1.clock();
+        if (!_pulse_2.is_idle() && _pulse_2.next_clock() == time) _pulse_2.clock();
+        if (!_triangle.is_idle() && _triangle.next_clock() == time) _triangle.clock();
+        if (!_noise.is_idle() && _noise.next_clock() == time) _noise.clock();
+        if (!_dmc.is_idle() && _dmc.next_clock() == time) _dmc.clock();
+
+        if (frame_step_time() == time)
+            clock_frame_counter();
+
+        update_output(time);
+    }
+
+    _time = end;
+
+    // Anything may change from here on (register writes)
+    skip_idle_channels(_time);
+}
+
+void nes_apu::end_frame()
+{
+    skip_idle_channels(_time);
+    blip_end_frame(_blip, _time);
+
+    // Nobody is reading (fast enough) - drop the oldest samples so that the next time frame fits
+    int max_samples = _sample_rate * APU_BUFFER_MS / 1000;
+    int16_t discard[1024];
+    while (blip_samples_avail(_blip) > max_samples)
+        blip_read_samples(_blip, discard, min(blip_samples_avail(_blip) - max_samples, int(sizeof(discard) / sizeof(discard[0]))), 0);
+
+    // time restarts from 0 in the new time frame
+    _pulse_1.rebase(_time);
+    _pulse_2.rebase(_time);
+    _triangle.rebase(_time);
+    _noise.rebase(_time);
+    _dmc.rebase(_time);
+    _frame_seq_start -= _time;
+    _time = 0;
+}
+
+void nes_apu::skip_idle_channels(int32_t time)
+{
+    // No-op for the channels that aren't idle - they are never behind
+    _pulse_1.skip_to(time);
+    _pulse_2.skip_to(time);
+    _triangle.skip_to(time);
+    _noise.skip_to(time);
+    _dmc.skip_to(time);
+}
+
+void nes_apu::update_output(int32_t time)
+{
+    int amplitude = _mixer.mix(_pulse_1.output(), _pulse_2.output(), _triangle.output(), _noise.output(), _dmc.output());
+    if (amplitude != _amplitude)
+    {
+        blip_add_delta(_blip, uint32_t(time), amplitude - _amplitude);
+        _amplitude = amplitude;
+    }
+}
+
+void nes_apu::clock_frame_counter()
+{
+    // Channels that become audible start from here
+    skip_idle_channels(_time);
+
+    clock_quarter_frame();
+    if (_frame_step & 1)
+        clock_half_frame();
+
+    if (_frame_step == 3)
+    {
+        if (_frame_counter_mode == 0 && !_irq_inhibit)
+            _frame_irq_flag = true;
+
+        _frame_seq_start += s_frame_period[_frame_counter_mode];
+        _frame_step = 0;
+    }
+    else
+    {
+        _frame_step++;
+    }
+}
+
+void nes_apu::clock_quarter_frame()
+{
+    _pulse_1.clock_quarter_frame();
+    _pulse_2.clock_quarter_frame();
+    _triangle.clock_quarter_frame();
+    _noise.clock_quarter_frame();
+}
+
+void nes_apu::clock_half_frame()
+{
+    _pulse_1.clock_half_frame();
+    _pulse_2.clock_half_frame();
+    _triangle.clock_half_frame();
+    _noise.clock_half_frame();
+}
@@ -9,15 +9,22 @@ void nes_cpu::power_on(nes_system *system)
     _mem = system->ram();
     _ppu = system->ppu();
     _cycle = nes_cycle_t(0);
+    _instruction_cycle = nes_cycle_t(0);
+    _ppu_sync_cycle = nes_cycle_t(0);
     _nmi_pending = false;
     _dma_pending = false;
+    _operand = 0;
+    _idle_loop = nes_idle_loop();
+    _decoded_ops.assign(PRG_WINDOW_COUNT * PRG_WINDOW_SIZE, nes_decoded_op());
+    if (_jit)
+        _jit->reset();
 
     _is_stop_at_addr = false;
     _stop_at_infinite_loop = false;
 
     // @TODO - Simulate full power-on state
     // http://wiki.nesdev.com/w/index.php/CPU_power_up_state
-    _context.P = 0x24;          // @TODO - Should be 0x34 - but temporarily set to 0x24 to match nintendulator baseline 
+    set_P(0x24);                // @TODO - Should be 0x34 - but temporarily set to 0x24 to match nintendulator baseline 
     _context.A = _context.X = _context.Y = 0;
     _context.S = 0xfd;
     _context.PC = 0;
@@ -33,46 +40,365 @@ void nes_cpu::poke(uint16_t addr, uint8_t value)
     _mem->set_byte(addr, value); 
 }
 
+//
+// GCC and clang support labels as values (&&label / goto *ptr). With that every handler jumps 
+// directly to the next handler (threaded code) rather than going back to one shared indirect 
+// jump, which is a lot friendlier to the branch predictor. Other compilers go through the 
+// handler table instead.
+//
+#if defined(__GNUC__) || defined(__clang__)
+#define NES_CPU_THREADED_DISPATCH
+#endif
+
+constexpr nes_cpu::op_code_info nes_cpu::s_op_code_info[0x100];
+
+#define OP_CODE_HANDLER(op_code, op, mode, cycles, page_cross_cycles, official) &nes_cpu::op<op_code>,
+const nes_cpu::op_code_handler nes_cpu::s_op_code_handlers[0x100] =
+{
+    NES_OP_CODE_TABLE(OP_CODE_HANDLER)
+};
+#undef OP_CODE_HANDLER
+
 void nes_cpu::step_to(nes_cycle_t new_count)
 {
     // we are asked to proceed to new_count - keep executing one instruction
+    // PPU is caught up lazily rather than before every instruction - only when the CPU touches I/O or
+    // mapper registers (which sync it to the instruction's starting cycle), or when the instruction
+    // reaches _ppu_sync_cycle (the PPU's next event, checked in begin_instruction). Nothing the CPU can
+    // observe happens in between, so the caller is free to step in large quanta (such as an entire
+    // frame) without losing accuracy
+    // Tracing is only checked once here so the untraced loop doesn't pay for it in every instruction
+    // Tracing always goes through the interpreter
+    _step_target = new_count;
+    if (nes_tracer::get().is_enabled(nes_tracer_level_diag))
+        dispatch<true>(new_count);
+    else if (_jit_enabled)
+        jit_dispatch(new_count);
+    else
+        dispatch<false>(new_count);
+}
+
+void nes_cpu::sync_ppu()
+{
+    _ppu->step_to(_instruction_cycle);
+
+    // Nothing the CPU can observe without touching PPU registers happens until then
+    _ppu_sync_cycle = _ppu->master_cycle() + _ppu->cycles_until_event(/* watch_status = */ false);
+}
+
+bool nes_cpu::begin_instruction(nes_cycle_t new_count)
+{
     while (_cycle < new_count && !_system->stop_requested())
-        exec_one_instruction();    
-}
-
-#define IS_ALU_OP_CODE_(op, offset, mode) case nes_op_code::op##_base + offset : NES_TRACE4(get_op_str(#op, nes_addr_mode::nes_addr_mode_##mode)); op(nes_addr_mode::nes_addr_mode_##mode); break; 
-#define IS_ALU_OP_CODE(op) \
-    IS_ALU_OP_CODE_(op, 0x9, imm) \
-    IS_ALU_OP_CODE_(op, 0x5, zp) \
-    IS_ALU_OP_CODE_(op, 0x15, zp_ind_x) \
-    IS_ALU_OP_CODE_(op, 0xd, abs) \
-    IS_ALU_OP_CODE_(op, 0x1d, abs_x) \
-    IS_ALU_OP_CODE_(op, 0x19, abs_y) \
-    IS_ALU_OP_CODE_(op, 0x1, ind_x) \
-    IS_ALU_OP_CODE_(op, 0x11, ind_y)
-
-#define IS_ALU_OP_CODE_NO_IMM(op) \
-    IS_ALU_OP_CODE_(op, 0x5, zp) \
-    IS_ALU_OP_CODE_(op, 0x15, zp_ind_x) \
-    IS_ALU_OP_CODE_(op, 0xd, abs) \
-    IS_ALU_OP_CODE_(op, 0x1d, abs_x) \
-    IS_ALU_OP_CODE_(op, 0x19, abs_y) \
-    IS_ALU_OP_CODE_(op, 0x1, ind_x) \
-    IS_ALU_OP_CODE_(op, 0x11, ind_y)
-
-#define IS_RMW_OP_CODE_(op, opcode, offset, mode) case opcode + offset : NES_TRACE4(get_op_str(#op, nes_addr_mode::nes_addr_mode_##mode)); op(nes_addr_mode::nes_addr_mode_##mode); break; 
-#define IS_RMW_OP_CODE(op, opcode) \
-    IS_RMW_OP_CODE_(op, opcode, 0x6, zp) \
-    IS_RMW_OP_CODE_(op, opcode, 0xa, acc) \
-    IS_RMW_OP_CODE_(op, opcode, 0x16, zp_ind_x) \
-    IS_RMW_OP_CODE_(op, opcode, 0xe, abs) \
-    IS_RMW_OP_CODE_(op, opcode, 0x1e, abs_x)
-
-#define IS_OP_CODE(op, opcode) case opcode : NES_TRACE4(get_op_str(#op, nes_addr_mode_imp)); op(nes_addr_mode_imp); break;
-#define IS_OP_CODE_MODE(op, opcode, mode) case opcode : NES_TRACE4(get_op_str(#op, nes_addr_mode_##mode)); op(nes_addr_mode_##mode); break;
-
-#define IS_UNOFFICIAL_OP_CODE(op, opcode) case opcode : NES_TRACE4(get_op_str(#op, nes_addr_mode_imp, false)); op(nes_addr_mode_imp); break;
-#define IS_UNOFFICIAL_OP_CODE_MODE(op, opcode, mode) case opcode : NES_TRACE4(get_op_str(#op, nes_addr_mode_##mode, false)); op(nes_addr_mode_##mode); break;
+    {
+        // PPU is left behind until it has something for us (NMI, end of frame) or we access PPU 
+        // registers / mapper registers - see sync_ppu
+        _instruction_cycle = _cycle;
+        if (_cycle >= _ppu_sync_cycle)
+        {
+            sync_ppu();
+            if (_system->stop_requested())
+                break;
+        }
+
+        if (_is_stop_at_addr && _stop_at_addr == PC())
+        {
+            _system->stop();
+            _is_stop_at_addr = false;
+        }
+
+        if (_nmi_pending)
+        {
+            // generate NMI
+            NMI();
+
+            _nmi_pending = false;
+        }
+        else if (_dma_pending)
+        {
+            sync_ppu();
+            OAMDMA();
+
+            _dma_pending = false;
+        }
+        else
+        {
+            // next op
+            return true;
+        }
+    }
+
+    return false;
+}
+
+template <bool trace>
+void nes_cpu::dispatch(nes_cycle_t new_count)
+{
+#ifdef NES_CPU_THREADED_DISPATCH
+    #define OP_CODE_LABEL(op_code, op, mode, cycles, page_cross_cycles, official) &&op_##op_code,
+    static const void *const s_op_code_labels[0x100] = { NES_OP_CODE_TABLE(OP_CODE_LABEL) };
+    #undef OP_CODE_LABEL
+
+    #define NEXT_OP_CODE() \
+        if (!begin_instruction(new_count)) return; \
+        { \
+            uint8_t op_code = fetch_op_code(); \
+            if (trace) trace_op_code(op_code); \
+            goto *s_op_code_labels[op_code]; \
+        }
+
+    NEXT_OP_CODE()
+
+    #define OP_CODE_HANDLER(op_code, op, mode, cycles, page_cross_cycles, official) \
+        op_##op_code: op<op_code>(); step_cpu(nes_cpu_cycle_t(cycles)); NEXT_OP_CODE()
+    NES_OP_CODE_TABLE(OP_CODE_HANDLER)
+    #undef OP_CODE_HANDLER
+    #undef NEXT_OP_CODE
+#else
+    while (begin_instruction(new_count))
+    {
+        uint8_t op_code = fetch_op_code();
+        if (trace) trace_op_code(op_code);
+
+        (this->*s_op_code_handlers[op_code])();
+        step_cpu(nes_cpu_cycle_t(s_op_code_info[op_code].cycles));
+    }
+#endif
+}
+
+void nes_cpu::enable_jit(bool enable)
+{
+    if (enable && !_jit)
+        _jit = make_unique<nes_jit>();
+
+    _jit_enabled = enable && _jit->is_available();
+}
+
+void nes_cpu::jit_dispatch(nes_cycle_t new_count)
+{
+    while (begin_instruction(new_count))
+    {
+        // Stopping at an address needs to see every instruction
+        if (PC() >= NES_JIT_BLOCK_START && !_is_stop_at_addr)
+        {
+            uint32_t version = _mem->get_prg_version(PC());
+            const uint8_t *block = _jit->get_block(PC(), version);
+            if (!block)
+                block = _jit->translate(this, PC(), version);
+
+            if (block)
+            {
+                // A block doesn't start at all if its instructions could get past the next PPU 
+                // catch up - in which case the interpreter needs to get us there
+                nes_cycle_t cycle = _cycle;
+                uint16_t pc = PC();
+                _jit->run(this, block);
+                if (_cycle != cycle || PC() != pc)
+                    continue;
+            }
+        }
+
+        // RAM code (which could very well be modifying itself) - interpret one instruction
+        uint8_t op_code = fetch_op_code();
+        (this->*s_op_code_handlers[op_code])();
+        step_cpu(nes_cpu_cycle_t(s_op_code_info[op_code].cycles));
+    }
+}
+
+uint32_t nes_cpu::jit_read(nes_cpu *cpu, uint32_t addr, int64_t limit)
+{
+    uint8_t val = cpu->peek(addr);
+    cpu->_jit_exit = cpu->jit_must_exit(nes_cycle_t(limit));
+    return val;
+}
+
+void nes_cpu::jit_write(nes_cpu *cpu, uint32_t addr, uint32_t val, int64_t limit)
+{
+    cpu->poke(addr, val);
+    cpu->_jit_exit = cpu->jit_must_exit(nes_cycle_t(limit));
+}
+
+void nes_cpu::jit_interpret(nes_cpu *cpu, uint32_t pc, int64_t limit)
+{
+    cpu->PC() = pc;
+    cpu->_instruction_cycle = cpu->_cycle;
+
+    uint8_t op_code = cpu->fetch_op_code();
+    (cpu->*s_op_code_handlers[op_code])();
+    cpu->step_cpu(nes_cpu_cycle_t(s_op_code_info[op_code].cycles));
+
+    cpu->_jit_exit = cpu->jit_must_exit(nes_cycle_t(limit));
+}
+
+void nes_cpu::trace_op_code(uint8_t op_code)
+{
+    // Trace shows PPU register values as of this instruction
+    sync_ppu();
+
+    NES_LOG(get_op_str(op_code));
+}
+
+bool nes_cpu::decode_op(nes_decoded_op &decoded)
+{
+    uint16_t pc = PC();
+    uint8_t op_code = peek(pc);
+    int size = 1 + get_operand_size(s_op_code_info[op_code].addr_mode);
+
+    // An instruction that straddles two windows (or wraps around to $0000) depends on more than 
+    // one window - just go through the bus for those
+    if ((pc & ~(PRG_WINDOW_SIZE - 1)) != ((pc + size - 1) & ~(PRG_WINDOW_SIZE - 1)))
+        return false;
+
+    decoded.version = _mem->get_prg_version(pc);
+    decoded.op_code = op_code;
+    decoded.size = size;
+    if (size == 3)
+        decoded.operand = peek_word(pc + 1);
+    else if (size == 2)
+        decoded.operand = peek(pc + 1);
+    else
+        decoded.operand = 0;
+
+    return true;
+}
+
+static constexpr bool str_equal(const char *a, const char *b)
+{
+    return *a == *b && (*a == 0 || str_equal(a + 1, b + 1));
+}
+
+// Reads that leave the same registers/flags no matter how many times they run in a row
+static constexpr bool is_idle_loop_op(const char *op)
+{
+    return str_equal(op, "LDA") || str_equal(op, "LDX") || str_equal(op, "LDY") ||
+        str_equal(op, "CMP") || str_equal(op, "CPX") || str_equal(op, "CPY") ||
+        str_equal(op, "BIT") || str_equal(op, "AND") || str_equal(op, "ORA") || str_equal(op, "NOP");
+}
+
+#define IDLE_LOOP_OP_CODE(op_code, op, mode, cycles, page_cross_cycles, official) is_idle_loop_op(#op),
+const bool nes_cpu::s_idle_loop_op_codes[0x100] = { NES_OP_CODE_TABLE(IDLE_LOOP_OP_CODE) };
+#undef IDLE_LOOP_OP_CODE
+
+// Longest loop (in bytes from the loop start to the back edge) we'd consider
+#define IDLE_LOOP_MAX_SIZE 0x10
+
+void nes_cpu::analyze_idle_loop(uint16_t loop_pc, uint16_t back_edge_pc, nes_idle_loop &loop)
+{
+    loop = nes_idle_loop();
+    loop.pc = loop_pc;
+    loop.back_edge_pc = back_edge_pc;
+    loop.version = _mem->get_prg_version(loop_pc);
+
+    // Needs to be in one PRG window so that the version covers the entire loop
+    if (loop_pc < PRG_WINDOW_START || back_edge_pc - loop_pc > IDLE_LOOP_MAX_SIZE ||
+        (loop_pc >> PRG_WINDOW_SHIFT) != ((back_edge_pc + 2) >> PRG_WINDOW_SHIFT))
+        return;
+
+    int max_cycles = 0;
+    uint16_t pc = loop_pc;
+    while (pc < back_edge_pc)
+    {
+        uint8_t op_code = peek(pc);
+        const op_code_info &info = s_op_code_info[op_code];
+        switch (info.addr_mode)
+        {
+        case nes_addr_mode_rel:
+            // Only going forward - either out of the loop or skipping part of it
+            if ((int8_t)peek(pc + 1) < 0)
+                return;
+            max_cycles++;
+            break;
+        case nes_addr_mode_imp:
+        case nes_addr_mode_imm:
+        case nes_addr_mode_zp:
+            // zero page is always RAM
+            if (!s_idle_loop_op_codes[op_code])
+                return;
+            break;
+        case nes_addr_mode_abs:
+        {
+            if (!s_idle_loop_op_codes[op_code])
+                return;
+
+            // RAM and cartridge space are fine, and so is PPUSTATUS as long as its flags stay the same
+            // Everything else in $2000~$401F has side effects
+            uint16_t addr = peek_word(pc + 1);
+            if ((addr & 0xe007) == 0x2002)
+                loop.reads_ppu_status = true;
+            else if (addr >= 0x2000 && addr < 0x4020)
+                return;
+            break;
+        }
+        default:
+            return;
+        }
+
+        max_cycles += info.cycles + info.page_cross_cycles;
+        pc += 1 + get_operand_size(info.addr_mode);
+    }
+
+    // The back edge itself
+    if (pc != back_edge_pc)
+        return;
+
+    const op_code_info &info = s_op_code_info[peek(pc)];
+    max_cycles += info.cycles + info.page_cross_cycles + 1;
+
+    loop.max_cycles = max_cycles;
+    loop.is_idle = true;
+}
+
+void nes_cpu::skip_idle_loop(uint16_t loop_pc, uint16_t back_edge_pc, nes_cpu_cycle_t pending_cycles)
+{
+    nes_idle_loop &loop = _idle_loop;
+    if (loop.pc != loop_pc || loop.back_edge_pc != back_edge_pc || loop.version != _mem->get_prg_version(loop_pc))
+        analyze_idle_loop(loop_pc, back_edge_pc, loop);
+
+    if (!loop.is_idle || _system->stop_requested() || _is_stop_at_addr)
+        return;
+
+    // Trace should have every instruction
+    if (nes_tracer::get().is_enabled(nes_tracer_level_diag))
+        return;
+
+    // Bring PPU to the start of the back edge instruction - next_event only changes once the PPU gets past it
+    sync_ppu();
+    nes_cycle_t loop_cycle = _cycle + pending_cycles;
+    nes_cycle_t next_event = _ppu->master_cycle() + _ppu->cycles_until_event(loop.reads_ppu_status);
+    uint8_t p = P();
+
+    //
+    // If we've come back with the same registers after one iteration with nothing changed in between 
+    // (NMI, PPU event), the loop is at a fixed point: every op is a read that gives the same result when
+    // repeated, and what it reads stays the same until the next event. So all iterations from here on 
+    // are identical and take exactly as long as this one did
+    //
+    if (!loop.is_armed || loop.next_event != next_event || loop_cycle <= loop.cycle ||
+        loop_cycle - loop.cycle > nes_cpu_cycle_t(loop.max_cycles) ||
+        loop.A != A() || loop.X != X() || loop.Y != Y() || loop.P != p)
+    {
+        loop.is_armed = true;
+        loop.cycle = loop_cycle;
+        loop.next_event = next_event;
+        loop.A = A();
+        loop.X = X();
+        loop.Y = Y();
+        loop.P = p;
+        return;
+    }
+
+    // Stop at the last loop start before the event - PPU could be up to 1 cycle past the instruction 
+    // start due to odd frame skip. Also never past where we are asked to step to
+    nes_cycle_t iteration = loop_cycle - loop.cycle;
+    nes_cycle_t limit = min(nes_cycle_t(next_event - nes_cpu_cycle_t(1)), _step_target);
+    if (limit > loop_cycle)
+    {
+        int64_t count = (limit - loop_cycle) / iteration;
+        _cycle += iteration * count;
+        loop_cycle += iteration * count;
+    }
+
+    loop.cycle = loop_cycle;
+}
 
 void nes_cpu::NMI()
 {
@@ -83,6 +409,9 @@ void nes_cpu::NMI()
     push_word(PC());
     push_byte(P() | 0x20);
 
+    // Whatever loop we were in is going to see a different world when we're back
+    _idle_loop.is_armed = false;
+
     step_cpu(7);
     PC() = peek_word(NMI_HANDLER);
 }
@@ -101,266 +430,6 @@ void nes_cpu::OAMDMA()
         step_cpu(513);
 }
 
-void nes_cpu::exec_one_instruction()
-{
-    if (_is_stop_at_addr && _stop_at_addr == PC())
-    {
-        _system->stop();
-        _is_stop_at_addr = false;
-    }
-
-    if (_nmi_pending)
-    {
-        // generate NMI
-        NMI();
-
-        _nmi_pending = false;
-    }
-    else if (_dma_pending)
-    {
-        OAMDMA();
-
-        _dma_pending = false;
-    }
-    else
-    {
-        // next op
-        auto op_code = decode_byte();
-
-        // Let's start with a switch / case
-        // Compiler should do good enough job to create a jump table
-        // The problem with starting with my own table is that it get massive with lots of empty entries before I code
-        // up any instructions.
-        switch (op_code)
-        {
-        IS_ALU_OP_CODE(ADC)
-        IS_ALU_OP_CODE(AND)
-        IS_ALU_OP_CODE(CMP)
-        IS_ALU_OP_CODE(EOR)
-        IS_ALU_OP_CODE(ORA)
-        IS_ALU_OP_CODE(SBC)
-        IS_ALU_OP_CODE_NO_IMM(STA)
-        IS_ALU_OP_CODE(LDA)
-
-        IS_RMW_OP_CODE(ASL, 0x0)
-        IS_RMW_OP_CODE(ROL, 0x20)
-        IS_RMW_OP_CODE(LSR, 0x40)
-        IS_RMW_OP_CODE(ROR, 0x60)
-
-        IS_OP_CODE_MODE(LDX, 0xa2, imm)
-        IS_OP_CODE_MODE(LDX, 0xa6, zp)
-        IS_OP_CODE_MODE(LDX, 0xb6, zp_ind_y)
-        IS_OP_CODE_MODE(LDX, 0xae, abs)
-        IS_OP_CODE_MODE(LDX, 0xbe, abs_y)
-        IS_OP_CODE_MODE(LDY, 0xa0, imm)
-        IS_OP_CODE_MODE(LDY, 0xa4, zp)
-        IS_OP_CODE_MODE(LDY, 0xb4, zp_ind_x)
-        IS_OP_CODE_MODE(LDY, 0xac, abs)
-        IS_OP_CODE_MODE(LDY, 0xbc, abs_x)
-
-        IS_OP_CODE_MODE(STX, 0x86, zp)
-        IS_OP_CODE_MODE(STX, 0x96, zp_ind_y)
-        IS_OP_CODE_MODE(STX, 0x8e, abs)
-        IS_OP_CODE_MODE(STY, 0x84, zp)
-        IS_OP_CODE_MODE(STY, 0x94, zp_ind_x)
-        IS_OP_CODE_MODE(STY, 0x8c, abs)
-
-        IS_OP_CODE_MODE(CPX, 0xe0, imm)
-        IS_OP_CODE_MODE(CPX, 0xe4, zp)
-        IS_OP_CODE_MODE(CPX, 0xec, abs)
-        IS_OP_CODE_MODE(CPY, 0xc0, imm)
-        IS_OP_CODE_MODE(CPY, 0xc4, zp)
-        IS_OP_CODE_MODE(CPY, 0xcc, abs)
-
-        IS_OP_CODE(TAX, 0xaa)
-        IS_OP_CODE(TAY, 0xa8)
-        IS_OP_CODE(TSX, 0xba)
-        IS_OP_CODE(TXA, 0x8a)
-        IS_OP_CODE(TXS, 0x9a)
-        IS_OP_CODE(TYA, 0x98)
-
-        IS_OP_CODE_MODE(INC, 0xe6, zp)
-        IS_OP_CODE_MODE(INC, 0xf6, zp_ind_x)
-        IS_OP_CODE_MODE(INC, 0xee, abs)
-        IS_OP_CODE_MODE(INC, 0xfe, abs_x)
-        IS_OP_CODE(INX, 0xe8)
-        IS_OP_CODE(INY, 0xc8)
-        IS_OP_CODE_MODE(DEC, 0xc6, zp)
-        IS_OP_CODE_MODE(DEC, 0xd6, zp_ind_x)
-        IS_OP_CODE_MODE(DEC, 0xce, abs)
-        IS_OP_CODE_MODE(DEC, 0xde, abs_x)
-        IS_OP_CODE(DEX, 0xca)
-        IS_OP_CODE(DEY, 0x88)
-
-        IS_OP_CODE(SEC, 0x38)
-        IS_OP_CODE(SED, 0xf8)
-        IS_OP_CODE(SEI, 0x78)
-        IS_OP_CODE(CLC, 0x18)
-        IS_OP_CODE(CLD, 0xd8)
-        IS_OP_CODE(CLI, 0x58)
-        IS_OP_CODE(CLV, 0xB8)
-
-        IS_OP_CODE_MODE(JMP, 0x4c, abs_jmp)
-        IS_OP_CODE_MODE(JMP, 0x6c, ind_jmp)
-        
-        IS_OP_CODE_MODE(BCC, 0x90, rel)
-        IS_OP_CODE_MODE(BCS, 0xb0, rel)
-        IS_OP_CODE_MODE(BEQ, 0xf0, rel)
-        IS_OP_CODE_MODE(BMI, 0x30, rel)
-        IS_OP_CODE_MODE(BNE, 0xd0, rel)
-        IS_OP_CODE_MODE(BPL, 0x10, rel)
-        IS_OP_CODE_MODE(BVC, 0x50, rel)
-        IS_OP_CODE_MODE(BVS, 0x70, rel)
-
-        IS_OP_CODE_MODE(BIT, 0x24, zp)
-        IS_OP_CODE_MODE(BIT, 0x2c, abs)
-
-        IS_OP_CODE(PHA, 0x48)
-        IS_OP_CODE(PHP, 0x08)
-        IS_OP_CODE(PLA, 0x68)
-        IS_OP_CODE(PLP, 0x28)
-
-        IS_OP_CODE(RTI, 0x40)
-        IS_OP_CODE_MODE(JSR, 0x20, abs_jmp)
-
-        IS_OP_CODE(RTS, 0x60)
-
-        IS_OP_CODE(KIL, 0x02)
-        IS_OP_CODE(KIL, 0x12)
-        IS_OP_CODE(KIL, 0x22)
-        IS_OP_CODE(KIL, 0x32)
-        IS_OP_CODE(KIL, 0x42)
-        IS_OP_CODE(KIL, 0x52)
-        IS_OP_CODE(KIL, 0x62)
-        IS_OP_CODE(KIL, 0x72)
-        IS_OP_CODE(KIL, 0x92)
-        IS_OP_CODE(KIL, 0xB2)
-        IS_OP_CODE(KIL, 0xd2)
-        IS_OP_CODE(KIL, 0xf2)
-
-        IS_OP_CODE(BRK, 0x00)
-
-        // The real NOP
-        IS_OP_CODE_MODE(NOP, 0xea, imp)
-
-        //===============================================================================
-        // Unofficial instructions
-        //===============================================================================
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x80, imm)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x04, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x44, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x64, zp)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x0c, abs)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x14, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x34, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x54, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x74, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xd4, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xf4, zp_ind_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x1c, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x3c, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x5c, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x7c, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xdc, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xfc, abs_x)
-       
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x89, imm)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x82, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xc2, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xe2, imm)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x1a, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x3a, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x5a, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x7a, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xda, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xfa, imp)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x03, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x07, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(ANC, 0x0b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x0f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x13, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x17, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x1b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x1f, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x23, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x27, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(ANC, 0x2b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x2f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x33, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x37, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x3b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x3f, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x43, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x47, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(ALR, 0x4b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x4f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x53, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x57, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x5b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x5f, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x63, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x67, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(ARR, 0x6b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x6f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x73, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x77, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x7b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x7f, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x83, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x87, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(XAA, 0x8b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x8f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(AHX, 0x93, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x97, zp_ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(TAS, 0x9b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(AHX, 0x9f, abs_y)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xa3, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xa7, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xab, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xaf, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xb3, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xb7, zp_ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAS, 0xbb, zp_ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xbf, abs_y)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xc3, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xc7, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(AXS, 0xcb, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xcf, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xd3, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xd7, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xdb, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xdf, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xe3, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xe7, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(SBC, 0xeb, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xef, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xf3, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xf7, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xfb, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xff, abs_x)
-
-        default:
-            NES_TRACE0("[NES_CPU] Unrecognized instruction or illegal instruction!");
-            assert(false);
-            break;
-        }
-    }
-}
-
 static void append_space(string &str)
 {
     str.append(1, ' ');
@@ -397,38 +466,17 @@ static void align(string &str, int loc)
 // 0         1         2         3         4         5         6         7         8
 // 012345678901234567890123456789012345678901234567890123456789012345678901234567890
 // C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD CYC:  0
-string nes_cpu::get_op_str(const char *op, nes_addr_mode addr_mode, bool is_official)
+string nes_cpu::get_op_str(uint8_t op_code)
 {
     nes_ppu_protect protect(_ppu);
 
-    int operand_size = 0;
-    switch (addr_mode)
-    {
-        case nes_addr_mode::nes_addr_mode_imp: 
-        case nes_addr_mode::nes_addr_mode_acc:
-            break;
-
-        case nes_addr_mode::nes_addr_mode_rel: 
-        case nes_addr_mode::nes_addr_mode_imm:
-        case nes_addr_mode::nes_addr_mode_zp:
-        case nes_addr_mode::nes_addr_mode_zp_ind_x:
-        case nes_addr_mode::nes_addr_mode_zp_ind_y:
-        case nes_addr_mode::nes_addr_mode_ind_x:
-        case nes_addr_mode::nes_addr_mode_ind_y:
-            operand_size = 1;
-            break;
-
-        case nes_addr_mode::nes_addr_mode_ind_jmp:
-        case nes_addr_mode::nes_addr_mode_abs:
-        case nes_addr_mode::nes_addr_mode_abs_jmp:
-        case nes_addr_mode::nes_addr_mode_abs_x:
-        case nes_addr_mode::nes_addr_mode_abs_y:
-            operand_size = 2;
-            break;
+    const op_code_info &info = s_op_code_info[op_code];
+    nes_addr_mode addr_mode = info.addr_mode;
+    int operand_size = get_operand_size(addr_mode);
 
-        default:
-            assert(false);
-    }
+    // We've already fetched the entire instruction so PC is at the next one
+    uint16_t op_addr = PC() - 1 - operand_size;
+    uint16_t operand_addr = op_addr + 1;
 
     string msg;
 
@@ -437,18 +485,17 @@ string nes_cpu::get_op_str(const char *op, nes_addr_mode addr_mode, bool is_offi
     // C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD CYC:  0
 
     // Opcode
-    // We've already decoded the op code so it's PC - 1
-    append_word(msg, PC() - 1);
+    append_word(msg, op_addr);
     align(msg, 6);
 
     // Dump instruction bytes
     for (int i = 0; i < operand_size + 1; ++i)
     {
-        append_byte(msg, peek(PC() - 1 + i));
+        append_byte(msg, peek(op_addr + i));
         append_space(msg);
     }
 
-    if (is_official)
+    if (info.is_official)
     {
         align(msg, 16);
     }
@@ -458,8 +505,8 @@ string nes_cpu::get_op_str(const char *op, nes_addr_mode addr_mode, bool is_offi
         msg.append("*");
     }
 
-    msg.append(op);
-    append_operand_str(msg, addr_mode);
+    msg.append(info.name);
+    append_operand_str(msg, addr_mode, operand_addr);
 
     align(msg, 48);
 
@@ -497,7 +544,7 @@ string nes_cpu::get_op_str(const char *op, nes_addr_mode addr_mode, bool is_offi
     return msg;
 }
 
-void nes_cpu::append_operand_str(string &str, nes_addr_mode addr_mode)
+void nes_cpu::append_operand_str(string &str, nes_addr_mode addr_mode, uint16_t operand_addr)
 {
     append_space(str);
     switch (addr_mode)
@@ -511,13 +558,13 @@ void nes_cpu::append_operand_str(string &str, nes_addr_mode addr_mode)
 
     case nes_addr_mode::nes_addr_mode_imm:
         str.append("#$");
-        append_byte(str, peek(PC()));
+        append_byte(str, peek(operand_addr));
         break;
 
     case nes_addr_mode::nes_addr_mode_rel:
         // display the real address directly after accounting for offset
         str.append("$");
-        append_word(str, int8_t(peek(PC())) + PC() + 1);
+        append_word(str, int8_t(peek(operand_addr)) + operand_addr + 1);
         break;
 
     case nes_addr_mode::nes_addr_mode_zp:
@@ -525,7 +572,7 @@ void nes_cpu::append_operand_str(string &str, nes_addr_mode addr_mode)
     case nes_addr_mode::nes_addr_mode_zp_ind_y:
     {
         str.append("$");
-        uint8_t addr = peek(PC());
+        uint8_t addr = peek(operand_addr);
         append_byte(str, addr);
         if (addr_mode == nes_addr_mode_zp_ind_x)
         {
@@ -550,7 +597,7 @@ void nes_cpu::append_operand_str(string &str, nes_addr_mode addr_mode)
     case nes_addr_mode::nes_addr_mode_abs_y:
     {
         str.append("$");
-        uint16_t addr = peek_word(PC());
+        uint16_t addr = peek_word(operand_addr);
         append_word(str, addr);
         if (addr_mode != nes_addr_mode_abs_jmp)
         {
@@ -574,7 +621,7 @@ void nes_cpu::append_operand_str(string &str, nes_addr_mode addr_mode)
     }
     case nes_addr_mode::nes_addr_mode_ind_jmp:
     {
-        uint16_t addr = peek_word(PC());
+        uint16_t addr = peek_word(operand_addr);
         str.append("($");
         append_word(str, addr);
         str.append(") = ");
@@ -595,7 +642,7 @@ void nes_cpu::append_operand_str(string &str, nes_addr_mode addr_mode)
 
     case nes_addr_mode::nes_addr_mode_ind_x:
     {
-        uint8_t addr = peek(PC());
+        uint8_t addr = peek(operand_addr);
         str.append("($");
         append_byte(str, addr);
         str.append(",X) @ ");
@@ -609,7 +656,7 @@ void nes_cpu::append_operand_str(string &str, nes_addr_mode addr_mode)
     }
     case nes_addr_mode::nes_addr_mode_ind_y:
     {
-        uint8_t addr = peek(PC());
+        uint8_t addr = peek(operand_addr);
         str.append("($");
         append_byte(str, addr);
         str.append("),Y = ");
@@ -628,75 +675,6 @@ void nes_cpu::append_operand_str(string &str, nes_addr_mode addr_mode)
     }
 }
 
-nes_cpu_cycle_t nes_cpu::get_cpu_cycle(operand_t operand, nes_addr_mode mode)
-{
-    switch (mode)
-    {
-    case nes_addr_mode_acc:
-    case nes_addr_mode_imm:
-        return nes_cpu_cycle_t(2);
-
-    case nes_addr_mode_zp:
-        return nes_cpu_cycle_t(3);
-
-    case nes_addr_mode_zp_ind_x:
-    case nes_addr_mode_zp_ind_y:
-    case nes_addr_mode_abs:
-        return nes_cpu_cycle_t(4);
-
-    case nes_addr_mode_abs_x:
-    case nes_addr_mode_abs_y:
-        return nes_cpu_cycle_t(operand.is_page_crossing ? 5 : 4);
-
-    case nes_addr_mode_ind_x:
-        return nes_cpu_cycle_t(6);
-        
-    case nes_addr_mode_ind_y:
-        return nes_cpu_cycle_t(operand.is_page_crossing ? 6 : 5);
-
-    default:
-        assert(false);
-        return nes_cpu_cycle_t(0);
-    }
-}
-
-nes_cpu_cycle_t nes_cpu::get_branch_cycle(bool cond, uint16_t new_addr, int8_t rel)
-{
-    int cycle = 2;
-
-    if (cond)
-    {
-        // if branch succeeds ++
-        cycle++;
-
-        // if crossing to a new page ++
-        // @DOCBUG 
-        // http://obelisk.me.uk/6502/reference.html#BEQ says +2
-        // http://nesdev.com/6502_cpu.txt says +1 and so does nintendulator
-        if (((new_addr) & 0xff00) != ((new_addr - rel) & 0xff00)) cycle += 1;
-    }
-
-    return nes_cpu_cycle_t(cycle);
-}
-
-#define BEGIN_CYCLE() { nes_cpu_cycle_t __cycle_count(0);
-#define IS_CYCLE(mode, cycle) if (addr_mode == nes_addr_mode_##mode) __cycle_count = nes_cpu_cycle_t(cycle);
-#define END_CYCLE() step_cpu(__cycle_count); }
-#define END_CYCLE_RETURN() return __cycle_count; }
-
-nes_cpu_cycle_t nes_cpu::get_shift_cycle(nes_addr_mode addr_mode)
-{
-    BEGIN_CYCLE()
-    {
-        IS_CYCLE(acc, 2);
-        IS_CYCLE(zp, 5);
-        IS_CYCLE(zp_ind_x, 6);
-        IS_CYCLE(abs, 6);
-        IS_CYCLE(abs_x, 7);
-    }
-    END_CYCLE_RETURN()
-}
-
 void nes_cpu::step_cpu(int64_t cpu_cycle)
 {
     _cycle += nes_cpu_cycle_t(cpu_cycle);
@@ -708,14 +686,15 @@ void nes_cpu::step_cpu(nes_cpu_cycle_t cpu_cycle)
 }
 
 // Add with carry
-void nes_cpu::ADC(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::ADC()
 {
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
     _ADC(val);
 
     // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    step_page_crossing<op_code>(op);
 }
 
 void nes_cpu::_ADC(uint8_t val)
@@ -736,47 +715,49 @@ void nes_cpu::_ADC(uint8_t val)
     A() = new_val;
 
     // flags
-    set_overflow_flag(is_sign_overflow(old_val, val, new_val));
+    calc_overflow_flag(old_val, val, new_val);
     set_carry_flag(bit7_overflow);
     calc_alu_flag(A());
 }
 
 // Logical AND
-void nes_cpu::AND(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::AND()
 {
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
     A() &= val;
 
     // flags    
     calc_alu_flag(A());
     
     // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    step_page_crossing<op_code>(op);
 }
 
 // Compare 
-void nes_cpu::CMP(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::CMP()
 {
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);;
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);;
 
     // flags
     uint8_t diff = A() - val;
 
     set_carry_flag(A() >= val);
-    set_zero_flag(diff == 0);
-    set_negative_flag(diff & 0x80);
+    calc_alu_flag(diff);
 
     // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    step_page_crossing<op_code>(op);
 }
 
 // Exclusive OR 
-void nes_cpu::EOR(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::EOR()
 {
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
 
     A() ^= val;
 
@@ -784,33 +765,35 @@ void nes_cpu::EOR(nes_addr_mode addr_mode)
     calc_alu_flag(A());
 
     // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    step_page_crossing<op_code>(op);
 }
 
 // Logical Inclusive OR
-void nes_cpu::ORA(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::ORA()
 {
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
 
     A() |= val;
 
     calc_alu_flag(A());
 
     // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    step_page_crossing<op_code>(op);
 }
 
 // Subtract with carry
-void nes_cpu::SBC(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::SBC()
 {
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
 
     _SBC(val);
 
     // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    step_page_crossing<op_code>(op);
 }
 
 void nes_cpu::_SBC(uint8_t val)
@@ -819,10 +802,11 @@ void nes_cpu::_SBC(uint8_t val)
 }
 
 // Load Accumulator
-void nes_cpu::LDA(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::LDA()
 {
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
 
     A() = val;
 
@@ -830,33 +814,31 @@ void nes_cpu::LDA(nes_addr_mode addr_mode)
     calc_alu_flag(A());
 
     // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    step_page_crossing<op_code>(op);
 }
 
 // ASL - Arithmetic shift left
-void nes_cpu::ASL(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::ASL() 
 {
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
     uint8_t new_val = val << 1;
-    write_operand(op, new_val);
+    write_operand<op_code>(op, new_val);
 
     // flags
     set_carry_flag(val & 0x80);
 
     // @DOCBUG: 
     // http://obelisk.me.uk/6502/reference.html#ASL incorrectly states ASL detects A == 0
-    set_zero_flag(new_val == 0); 
-    set_negative_flag(new_val & 0x80);
-
-    // cycle count
-    step_cpu(get_shift_cycle(addr_mode));
+    calc_alu_flag(new_val);
 }
 
-void nes_cpu::branch(bool cond, nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::branch(bool cond)
 {
-    assert(addr_mode == nes_addr_mode_rel);
-    int8_t rel = (int8_t) decode_byte();
+    static_assert(s_op_code_info[op_code].addr_mode == nes_addr_mode_rel, "branch requires relative addressing");
+    int8_t rel = (int8_t) _operand;
     if (cond)
     {
         PC() += rel;
@@ -865,332 +847,327 @@ void nes_cpu::branch(bool cond, nes_addr_mode addr_mode)
             _system->stop();
             _stop_at_infinite_loop = false;
         }
-    }
 
-    // cycle count
-    step_cpu(get_branch_cycle(cond, PC(), rel));
+        // if branch succeeds ++
+        step_cpu(1);
+
+        // if crossing to a new page ++
+        // @DOCBUG 
+        // http://obelisk.me.uk/6502/reference.html#BEQ says +2
+        // http://nesdev.com/6502_cpu.txt says +1 and so does nintendulator
+        if ((PC() & 0xff00) != ((PC() - rel) & 0xff00)) 
+            step_cpu(s_op_code_info[op_code].page_cross_cycles);
+
+        if (rel < 0 && _idle_loop_skip_enabled)
+            skip_idle_loop(PC(), PC() - rel - 2, nes_cpu_cycle_t(s_op_code_info[op_code].cycles));
+    }
 }
 
 // BCC - Branch if Carry Clear
-void nes_cpu::BCC(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::BCC() 
 {
-    branch(!get_carry(), addr_mode);
+    branch<op_code>(!get_carry());
 }
 
 // BCS - Branch if Carry Set 
-void nes_cpu::BCS(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::BCS() 
 {
-    branch(get_carry(), addr_mode);
+    branch<op_code>(get_carry());
 }
 
 // BEQ - Branch if Equal
-void nes_cpu::BEQ(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::BEQ() 
 {
-    branch(is_zero(), addr_mode);
+    branch<op_code>(is_zero());
 }
 
 // BIT - Bit test
-void nes_cpu::BIT(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::BIT() 
 {
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
     uint8_t new_val = val & A();
 
     // flags
-    set_zero_flag(new_val == 0);
-    set_overflow_flag(val & 0x40);
-    set_negative_flag(val & 0x80);
+    _z_result = new_val;
+    _n_result = val;
+    _v_result = val << 1;
 
     // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    step_page_crossing<op_code>(op);
 }
 
 // BMI - Branch if minus
-void nes_cpu::BMI(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::BMI() 
 {
-    branch(is_negative(), addr_mode);
+    branch<op_code>(is_negative());
 }
 
 // BNE - Branch if not equal
-void nes_cpu::BNE(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::BNE() 
 {
-    branch(!is_zero(), addr_mode);
+    branch<op_code>(!is_zero());
 }
 
 // BPL - Branch if positive 
-void nes_cpu::BPL(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::BPL() 
 {
-    branch(!is_negative(), addr_mode);
+    branch<op_code>(!is_negative());
 }
 
 // BRK - Force interrupt
-void nes_cpu::BRK(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::BRK() 
 {
-    // cycle count
-    step_cpu(7);
-
     _system->stop();
 }
 
 // BVC - Branch if overflow clear
-void nes_cpu::BVC(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::BVC() 
 {
-    branch(!is_overflow(), addr_mode);
+    branch<op_code>(!is_overflow());
 }
 
 // BVS - Branch if overflow set
-void nes_cpu::BVS(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::BVS() 
 {
-    branch(is_overflow(), addr_mode);
+    branch<op_code>(is_overflow());
 }
 
 // CLC - Clear carry flag
-void nes_cpu::CLC(nes_addr_mode addr_mode) { set_carry_flag(false); step_cpu(nes_cpu_cycle_t(2)); }
+template <uint8_t op_code>
+void nes_cpu::CLC() { set_carry_flag(false); }
 
 // CLD - Clear decimal mode
-void nes_cpu::CLD(nes_addr_mode addr_mode) { set_decimal_flag(false); step_cpu(nes_cpu_cycle_t(2)); }
+template <uint8_t op_code>
+void nes_cpu::CLD() { set_decimal_flag(false); }
 
 // CLI - Clear interrupt disable
-void nes_cpu::CLI(nes_addr_mode addr_mode) { set_interrupt_flag(false); step_cpu(nes_cpu_cycle_t(2)); }
+template <uint8_t op_code>
+void nes_cpu::CLI() { set_interrupt_flag(false); }
 
 // CLV - Clear overflow flag
-void nes_cpu::CLV(nes_addr_mode addr_mode) { set_overflow_flag(false); step_cpu(nes_cpu_cycle_t(2)); }
+template <uint8_t op_code>
+void nes_cpu::CLV() { set_overflow_flag(false); }
 
 // CPX - Compare X register
-void nes_cpu::CPX(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::CPX() 
 {
-    auto op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    auto op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
 
     // flags
     uint8_t diff = X() - val;
 
     set_carry_flag(X() >= val);
-    set_zero_flag(diff == 0);
-    set_negative_flag(diff & 0x80);
+    calc_alu_flag(diff);
 
     // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    step_page_crossing<op_code>(op);
 }
 
 // CPY - Compare Y register
-void nes_cpu::CPY(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::CPY() 
 {
-    auto op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);;
+    auto op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);;
 
     // flags
     uint8_t diff = Y() - val;
 
     set_carry_flag(Y() >= val);
-    set_zero_flag(diff == 0);
-    set_negative_flag(diff & 0x80);
+    calc_alu_flag(diff);
 
     // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    step_page_crossing<op_code>(op);
 }
 
 // DEC - Decrement memory
-void nes_cpu::DEC(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::DEC() 
 {
-    uint16_t addr = decode_operand_addr(addr_mode);
+    uint16_t addr = decode_operand_addr<op_code>();
     uint8_t new_val = peek(addr) - 1;
     poke(addr, new_val);
 
     calc_alu_flag(new_val);
-
-    BEGIN_CYCLE() 
-    {
-        IS_CYCLE(zp, 5);
-        IS_CYCLE(zp_ind_x, 6);
-        IS_CYCLE(abs, 6);
-        IS_CYCLE(abs_x, 7);
-    } 
-    END_CYCLE()
 }
 
 // DEX - Decrement X register
-void nes_cpu::DEX(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::DEX() 
 { 
     X()--; 
     calc_alu_flag(X());
-
-    // cycle count
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // DEY - Decrement Y register
-void nes_cpu::DEY(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::DEY() 
 { 
     Y()--; 
     calc_alu_flag(Y());
-    
-    // cycle count
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // INC - Increment memory
-void nes_cpu::INC(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::INC() 
 {
-    uint16_t addr = decode_operand_addr(addr_mode);
+    uint16_t addr = decode_operand_addr<op_code>();
     uint8_t new_val = peek(addr) + 1;
     poke(addr, new_val);
 
     // flags
     calc_alu_flag(new_val);
-
-    BEGIN_CYCLE() 
-    {
-        IS_CYCLE(zp, 5);
-        IS_CYCLE(zp_ind_x, 6);
-        IS_CYCLE(abs, 6);
-        IS_CYCLE(abs_x, 7);
-    } 
-    END_CYCLE()
 }
 
 // INX - Increment X
-void nes_cpu::INX(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::INX() 
 {
     X() = X() + 1;
 
     calc_alu_flag(X());
-
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // INY - Increment Y
-void nes_cpu::INY(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::INY() 
 {
     Y() = Y() + 1;
 
     calc_alu_flag(Y());
-    
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // JMP - Jump 
-void nes_cpu::JMP(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::JMP() 
 {
-    assert(addr_mode == nes_addr_mode_abs_jmp || addr_mode == nes_addr_mode_ind_jmp);
+    static_assert(s_op_code_info[op_code].addr_mode == nes_addr_mode_abs_jmp || 
+                  s_op_code_info[op_code].addr_mode == nes_addr_mode_ind_jmp, "JMP is either absolute or indirect");
 
     uint16_t old_pc = PC();
-    auto addr = decode_operand_addr(addr_mode);
+    auto addr = decode_operand_addr<op_code>();
     if (addr == PC() - 1 && _stop_at_infinite_loop)
     {
         _system->stop();
     }
 
+    if (s_op_code_info[op_code].addr_mode == nes_addr_mode_abs_jmp && addr < PC() && _idle_loop_skip_enabled)
+        skip_idle_loop(addr, PC() - 3, nes_cpu_cycle_t(s_op_code_info[op_code].cycles));
+
     PC() = addr;
     
     // No impact to flags
-    step_cpu(addr_mode == nes_addr_mode_abs_jmp ? 3 : 5);
 }
 
 // JSR - Jump to subroutine
-void nes_cpu::JSR(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::JSR() 
 {
-    // note: we push the actual return address -1, which is the current place (before decoding the 16-bit addr) + 1
-    push_word(PC() + 1);
+    // note: we push the actual return address -1, which is the last byte of the 16-bit addr
+    push_word(PC() - 1);
 
-    PC() = decode_operand_addr(addr_mode);
-
-    step_cpu(6);
+    PC() = decode_operand_addr<op_code>();
 }
 
 // LDX - Load X register
-void nes_cpu::LDX(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::LDX() 
 {
-    operand_t op = decode_operand(addr_mode);
-    X() = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    X() = read_operand<op_code>(op);
 
     calc_alu_flag(X());
 
     // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    step_page_crossing<op_code>(op);
 }
 
 // LDY - Load Y register
-void nes_cpu::LDY(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::LDY() 
 {
-    operand_t op = decode_operand(addr_mode);
-    Y() = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    Y() = read_operand<op_code>(op);
 
     calc_alu_flag(Y());
 
     // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    step_page_crossing<op_code>(op);
 }
 
 // LSR - Logical shift right
-void nes_cpu::LSR(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::LSR()
 {
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
     uint8_t new_val = (val >> 1);
-    write_operand(op, new_val);
+    write_operand<op_code>(op, new_val);
 
     // flags
     set_carry_flag(val & 0x1);
 
     // @DOCBUG: 
     // http://obelisk.me.uk/6502/reference.html#LSR incorrectly states ASL detects A == 0
-    set_zero_flag(new_val == 0);
-    set_negative_flag(new_val & 0x80);
-
-    // cycle count
-    step_cpu(get_shift_cycle(addr_mode));
+    calc_alu_flag(new_val);
 }
 
 // NOP - NOP
-void nes_cpu::NOP(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::NOP() 
 {
     // For effective NOP (op codes that are "effectively" no-op but not the real NOP 0xea)
     // We always needed to decode the parameter
-    if (addr_mode != nes_addr_mode::nes_addr_mode_imp)
+    if (s_op_code_info[op_code].addr_mode != nes_addr_mode::nes_addr_mode_imp)
     {
-        operand_t op = decode_operand(addr_mode);
-        step_cpu(get_cpu_cycle(op, addr_mode));
-    }
-    else
-    {
-        step_cpu(nes_cpu_cycle_t(2));
+        operand_t op = decode_operand<op_code>();
+        step_page_crossing<op_code>(op);
     }
 }
 
 // PHA - Push accumulator
-void nes_cpu::PHA(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::PHA() 
 {
     push_byte(A());
-
-    step_cpu(3);
 }
 
 // PHP - Push processor status
-void nes_cpu::PHP(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::PHP() 
 {
     // http://wiki.nesdev.com/w/index.php/CPU_status_flag_behavior
     // Set bit 5 and 4 to 1 when copy status into from PHP
     push_byte(P() | 0x30);
-    
-    step_cpu(3);
 }
 
 // PLA - Pull accumulator
-void nes_cpu::PLA(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::PLA() 
 {
     A() = pop_byte();
 
     calc_alu_flag(A());
-
-    step_cpu(4);
 }
 
 // PLP - Pull processor status
-void nes_cpu::PLP(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::PLP() 
 {
     _PLP();
-    step_cpu(4);
 }
 
 void nes_cpu::_PLP()
@@ -1199,183 +1176,164 @@ void nes_cpu::_PLP()
     // Bit 5 and 4 are ignored when pulled from stack - which means they are preserved
     // @TODO - Nintendulator actually always sets bit 5, not sure which one is correct
     // I'm setting bit 5 to make testing easier
-    P() = (pop_byte() & 0xef) | (P() & 0x10) | 0x20;
+    set_P((pop_byte() & 0xef) | (P() & 0x10) | 0x20);
 }
 
 // ROL - Rotate left
-void nes_cpu::ROL(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::ROL()
 {
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
     uint8_t new_val = (val << 1) | get_carry();
-    write_operand(op, new_val);
+    write_operand<op_code>(op, new_val);
 
     // flags
     set_carry_flag(val & 0x80);
     // @DOCBUG
     // http://obelisk.me.uk/6502/reference.html#ROL incorrectly states zero is set if A == 0
-    set_zero_flag(new_val == 0);
-    set_negative_flag(new_val & 0x80);
-
-    // cycle count
-    step_cpu(get_shift_cycle(addr_mode));
+    calc_alu_flag(new_val);
 }
 
 // ROR - Rotate right
-void nes_cpu::ROR(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::ROR()
 {
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
     uint8_t new_val = (val >> 1) | (get_carry() << 7);
-    write_operand(op, new_val);
+    write_operand<op_code>(op, new_val);
 
     // flags
     set_carry_flag(val & 0x1);
 
     // @DOCBUG
     // http://obelisk.me.uk/6502/reference.html#ROR incorrectly states zero is set if A == 0
-    set_zero_flag(new_val == 0);
-    set_negative_flag(new_val & 0x80);
-
-    // cycle count
-    step_cpu(get_shift_cycle(addr_mode));
+    calc_alu_flag(new_val);
 }
 
 // RTI - Return from interrupt
-void nes_cpu::RTI(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::RTI() 
 {
     _PLP();
 
     uint16_t addr = pop_word();
     PC() = addr;
-
-    step_cpu(6);
 }
 
 // RTS - Return from subroutine
-void nes_cpu::RTS(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::RTS() 
 {
     // See JSR - we pushed actual return address - 1
     uint16_t addr = pop_word() + 1;
     PC() = addr;
-
-    step_cpu(6);
 }
 
 // SEC - Set carry flag
-void nes_cpu::SEC(nes_addr_mode addr_mode) { set_carry_flag(true); step_cpu(nes_cpu_cycle_t(2));  }
+template <uint8_t op_code>
+void nes_cpu::SEC() { set_carry_flag(true); }
 
 // SED - Set decimal flag
-void nes_cpu::SED(nes_addr_mode addr_mode) { set_decimal_flag(true); step_cpu(nes_cpu_cycle_t(2)); }
+template <uint8_t op_code>
+void nes_cpu::SED() { set_decimal_flag(true); }
 
 // SEI - Set interrupt disable
-void nes_cpu::SEI(nes_addr_mode addr_mode) { set_interrupt_flag(true); step_cpu(nes_cpu_cycle_t(2)); }
+template <uint8_t op_code>
+void nes_cpu::SEI() { set_interrupt_flag(true); }
 
 // Store Accumulator  
-void nes_cpu::STA(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::STA()
 {
-    operand_t op = decode_operand(addr_mode);
-    assert(op.kind == operand_kind::operand_kind_addr);;
+    operand_t op = decode_operand<op_code>();
 
     poke(op.addr_or_value, A());
 
     // Doesn't impact any flags
-
-    // this instruction forces page-crossing timing
-    op.is_page_crossing = true;
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    // this instruction always takes page-crossing timing which is part of base cycles
 }
 
 // STX - Store X
-void nes_cpu::STX(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::STX() 
 {
-    operand_t op = decode_operand(addr_mode);
-    assert(op.kind == operand_kind::operand_kind_addr);
+    operand_t op = decode_operand<op_code>();
 
     poke(op.addr_or_value, X());
 
     // Doesn't impact any flags
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // STY- Store Y
-void nes_cpu::STY(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::STY()
 {
-    operand_t op = decode_operand(addr_mode);
-    assert(op.kind == operand_kind::operand_kind_addr);
+    operand_t op = decode_operand<op_code>();
 
     poke(op.addr_or_value, Y());;
 
     // Doesn't impact any flags
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // TAX - Transfer accumulator to X 
-void nes_cpu::TAX(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::TAX() 
 {
     X() = A();
 
     calc_alu_flag(X());
-
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // TAY - Transfer accumulator to Y
-void nes_cpu::TAY(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::TAY()
 {
     Y() = A();
 
     calc_alu_flag(Y());
-
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // TSX - Transfer stack pointer to X 
-void nes_cpu::TSX(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::TSX() 
 {
     X() = S();
 
     calc_alu_flag(X());
-
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // TXA - Transfer X to acc
-void nes_cpu::TXA(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::TXA()
 {
     A() = X();
 
     calc_alu_flag(A());
-
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // TXS - Transfer X to stack pointer
-void nes_cpu::TXS(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::TXS()
 {
     S() = X();
 
     // Doesn't impact flags
-
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // TYA - Transfer Y to accumulator
-void nes_cpu::TYA(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::TYA() 
 {
     A() = Y();
 
     calc_alu_flag(A());
-
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // KIL - Kill?
-void nes_cpu::KIL(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::KIL()
 {
     _system->stop();
 }
@@ -1384,82 +1342,75 @@ void nes_cpu::KIL(nes_addr_mode addr_mode)
 // Unofficial OP codes
 //===================================================================================
 
-void nes_cpu::ALR(nes_addr_mode addr_mode) { assert(false); }
-void nes_cpu::ANC(nes_addr_mode addr_mode) { assert(false); }
-void nes_cpu::ARR(nes_addr_mode addr_mode) { assert(false); }
-void nes_cpu::AXS(nes_addr_mode addr_mode) { assert(false); }
+template <uint8_t op_code> void nes_cpu::ALR() { assert(false); }
+template <uint8_t op_code> void nes_cpu::ANC() { assert(false); }
+template <uint8_t op_code> void nes_cpu::ARR() { assert(false); }
+template <uint8_t op_code> void nes_cpu::AXS() { assert(false); }
 
 // LAX - LDA value then TAX
-void nes_cpu::LAX(nes_addr_mode addr_mode)
+template <uint8_t op_code>
+void nes_cpu::LAX()
 {
     // LDA + TAX
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
     X() = A() = val;
 
     // flags
     calc_alu_flag(X());
 
     // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    step_page_crossing<op_code>(op);
 }
 
 // SAX - AND A X
-void nes_cpu::SAX(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::SAX() 
 {
-    operand_t op = decode_operand(addr_mode);
-    write_operand(op, A() & X());
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    operand_t op = decode_operand<op_code>();
+    write_operand<op_code>(op, A() & X());
 }
 
 // DCP - DEC value then CMP value
-void nes_cpu::DCP(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::DCP() 
 {
     // DEC
-    auto op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    auto op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
     val--;
-    write_operand(op, val);
+    write_operand<op_code>(op, val);
 
     // CMP
     uint8_t diff = A() - val;
 
     set_carry_flag(A() >= val);
-    set_zero_flag(diff == 0);
-    set_negative_flag(diff & 0x80);
-
-    // cycle count forces page crossing behavior (then +2)
-    op.is_page_crossing = true;
-    step_cpu(get_cpu_cycle(op, addr_mode) + nes_cpu_cycle_t(2));
+    calc_alu_flag(diff);
 }
 
 // ISC - INC value then SBC value 
-void nes_cpu::ISC(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::ISC() 
 {
     // INC
-    auto op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    auto op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
     val++;
-    write_operand(op, val);
+    write_operand<op_code>(op, val);
 
     // SBC
     _SBC(val);
-
-    // cycle count forces page crossing behavior (then +2)
-    op.is_page_crossing = true;
-    step_cpu(get_cpu_cycle(op, addr_mode) + nes_cpu_cycle_t(2));
 }
 
 // RLA - ROL value then AND value
-void nes_cpu::RLA(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::RLA() 
 {
     // ROL
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
     uint8_t new_val = (val << 1) | get_carry();
-    write_operand(op, new_val);
+    write_operand<op_code>(op, new_val);
 
     set_carry_flag(val & 0x80);
 
@@ -1468,38 +1419,32 @@ void nes_cpu::RLA(nes_addr_mode addr_mode)
 
     // flags    
     calc_alu_flag(A());
-
-    // cycle count forces page crossing behavior (then +2)
-    op.is_page_crossing = true;
-    step_cpu(get_cpu_cycle(op, addr_mode) + nes_cpu_cycle_t(2));
 }
 
-void nes_cpu::RRA(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::RRA() 
 { 
     // ROR
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
     uint8_t new_val = (val >> 1) | (get_carry() << 7);
-    write_operand(op, new_val);
+    write_operand<op_code>(op, new_val);
 
     set_carry_flag(val & 0x1);
 
     // ADC
     _ADC(new_val);
-
-    // cycle count forces page crossing behavior (then +2)
-    op.is_page_crossing = true;
-    step_cpu(get_cpu_cycle(op, addr_mode) + nes_cpu_cycle_t(2));
 }
 
 // SLO - ASL value then ORA value
-void nes_cpu::SLO(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::SLO() 
 { 
     // ASL
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
     uint8_t new_val = val << 1;
-    write_operand(op, new_val);
+    write_operand<op_code>(op, new_val);
 
     set_carry_flag(val & 0x80);
 
@@ -1507,20 +1452,17 @@ void nes_cpu::SLO(nes_addr_mode addr_mode)
     A() |= new_val;
 
     calc_alu_flag(A());
-
-    // cycle count forces page crossing behavior (then +2)
-    op.is_page_crossing = true;
-    step_cpu(get_cpu_cycle(op, addr_mode) + nes_cpu_cycle_t(2));
 }
 
 // SRE - LSR value then EOR value
-void nes_cpu::SRE(nes_addr_mode addr_mode) 
+template <uint8_t op_code>
+void nes_cpu::SRE() 
 {
     // LSR
-    operand_t op = decode_operand(addr_mode);
-    uint8_t val = read_operand(op);
+    operand_t op = decode_operand<op_code>();
+    uint8_t val = read_operand<op_code>(op);
     uint8_t new_val = (val >> 1);
-    write_operand(op, new_val);
+    write_operand<op_code>(op, new_val);
 
     // flags
     set_carry_flag(val & 0x1);
@@ -1530,13 +1472,17 @@ void nes_cpu::SRE(nes_addr_mode addr_mode)
 
     // flags
     calc_alu_flag(A());
-
-    // cycle count forces page crossing behavior (then +2)
-    op.is_page_crossing = true;
-    step_cpu(get_cpu_cycle(op, addr_mode) + nes_cpu_cycle_t(2));
 }
 
-void nes_cpu::XAA(nes_addr_mode addr_mode) { assert(false); }
-void nes_cpu::AHX(nes_addr_mode addr_mode) { assert(false); }
-void nes_cpu::TAS(nes_addr_mode addr_mode) { assert(false); }
-void nes_cpu::LAS(nes_addr_mode addr_mode) { assert(false); }
\ No newline at end of file
+template <uint8_t op_code> void nes_cpu::XAA() { assert(false); }
+template <uint8_t op_code> void nes_cpu::AHX() { assert(false); }
+template <uint8_t op_code> void nes_cpu::TAS() { assert(false); }
+template <uint8_t op_code> void nes_cpu::LAS() { assert(false); }
+
+// Unrecognized instruction or illegal instruction
+template <uint8_t op_code>
+void nes_cpu::ILL()
+{
+    NES_TRACE0("[NES_CPU] Unrecognized instruction or illegal instruction!");
+    assert(false);
+}
\ No newline at end of file
@@ -0,0 +1,1286 @@
+#include "stdafx.h"
+#include "nes_jit.h"
+#include "nes_cpu.h"
+#include "nes_memory.h"
+
+#ifdef NES_JIT_X64
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#endif
+
+//
+// x86-64 registers. While a block runs:
+//   rbx - nes_cpu *      rbp - RAM ($0000~$07FF)
+//   r12d/r13d/r14d - A/X/Y (zero extended)   r15 - _cycle
+// All of them are callee-saved in both Win64 and System V, so helper calls leave them alone.
+// rax/rcx/rdx/r8 are scratch.
+//
+enum
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15,
+    NO_REG = -1
+};
+
+#define REG_CPU     RBX
+#define REG_RAM     RBP
+#define REG_A       R12
+#define REG_X       R13
+#define REG_Y       R14
+#define REG_CYCLE   R15
+
+// Win64 needs 32 bytes of shadow space on top of keeping rsp 16-byte aligned
+#ifdef _WIN32
+static const int s_arg_regs[] = { RCX, RDX, R8, R9 };
+#define NES_JIT_FRAME_SIZE 40
+#else
+static const int s_arg_regs[] = { RDI, RSI, RDX, RCX };
+#define NES_JIT_FRAME_SIZE 8
+#endif
+
+// Condition codes (the low nibble of jcc / setcc / cmovcc)
+#define CC_B    0x2
+#define CC_AE   0x3
+#define CC_E    0x4
+#define CC_NE   0x5
+#define CC_A    0x7
+#define CC_GE   0xd
+
+// Op codes - two byte op codes have 0x0f in the high byte. ALU op codes are the "r/m, reg" form
+#define X86_ADD         0x01
+#define X86_OR          0x09
+#define X86_AND         0x21
+#define X86_SUB         0x29
+#define X86_XOR         0x31
+#define X86_CMP         0x39
+#define X86_CMP_LOAD    0x3b
+#define X86_TEST        0x85
+#define X86_MOV_STORE   0x89
+#define X86_MOV_LOAD    0x8b
+#define X86_LEA         0x8d
+#define X86_MOVZX8      0x0fb6
+#define X86_MOVZX16     0x0fb7
+#define X86_CMOV(cc)    (0x0f40 | (cc))
+#define X86_SETCC(cc)   (0x0f90 | (cc))
+
+// ALU / shift op code extensions for the immediate forms
+#define EXT_ADD 0
+#define EXT_OR  1
+#define EXT_AND 4
+#define EXT_SUB 5
+#define EXT_XOR 6
+#define EXT_CMP 7
+#define EXT_SHL 4
+#define EXT_SHR 5
+
+// Upper bound of the code for one instruction, exits included
+#define NES_JIT_MAX_OP_SIZE 384
+
+#define CPU_FIELD(field) cpu_mem(&_cpu->field)
+
+static int64_t ppu_cycles(int64_t cpu_cycles)
+{
+    return nes_cycle_t(nes_cpu_cycle_t(cpu_cycles)).count();
+}
+
+static bool is_op(const char *name, const char *op)
+{
+    return strcmp(name, op) == 0;
+}
+
+nes_jit::nes_jit()
+{
+    _code = nullptr;
+    _code_size = 0;
+    _cpu = nullptr;
+    _enter = _exit = _chain = nullptr;
+
+#ifdef NES_JIT_X64
+#ifdef _WIN32
+    _code = (uint8_t *)VirtualAlloc(nullptr, NES_JIT_CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    void *code = mmap(nullptr, NES_JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED)
+        _code = (uint8_t *)code;
+#endif
+#endif
+
+    if (_code)
+        _blocks.resize(NES_JIT_BLOCK_COUNT);
+}
+
+nes_jit::~nes_jit()
+{
+#ifdef NES_JIT_X64
+    if (_code)
+    {
+#ifdef _WIN32
+        VirtualFree(_code, 0, MEM_RELEASE);
+#else
+        munmap(_code, NES_JIT_CODE_SIZE);
+#endif
+    }
+#endif
+}
+
+void nes_jit::reset()
+{
+    _code_size = 0;
+    for (auto &entry : _blocks)
+        entry = { nullptr, 0 };
+}
+
+bool nes_jit::protect(size_t start, size_t end, bool writable)
+{
+#ifdef NES_JIT_X64
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    size_t page_size = info.dwPageSize;
+#else
+    size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+#endif
+    start &= ~(page_size - 1);
+    end = min<size_t>((end + page_size - 1) & ~(page_size - 1), NES_JIT_CODE_SIZE);
+
+#ifdef _WIN32
+    DWORD old_protect;
+    if (!VirtualProtect(_code + start, end - start, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old_protect))
+        return false;
+    if (!writable)
+        FlushInstructionCache(GetCurrentProcess(), _code + start, end - start);
+    return true;
+#else
+    return mprotect(_code + start, end - start, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+#endif
+#else
+    return false;
+#endif
+}
+
+bool nes_jit::emit_stubs(nes_cpu *cpu)
+{
+    _cpu = cpu;
+    if (!protect(0, NES_JIT_MAX_OP_SIZE, true))
+        return false;
+
+    //
+    // enter(cpu, block)
+    //
+    _enter = _code + _code_size;
+    for (int reg : { RBX, RBP, R12, R13, R14, R15 })
+        emit_push(reg);
+    emit_alu_imm(64, EXT_SUB, RSP, NES_JIT_FRAME_SIZE);
+    emit_rr(64, X86_MOV_STORE, s_arg_regs[0], REG_CPU);
+    emit_mov_mem_imm(8, CPU_FIELD(_jit_exit), 0);
+    emit_mov_imm(REG_RAM, (uint64_t)cpu->_mem->ram());
+    emit_rm(8, X86_MOVZX8, REG_A, CPU_FIELD(_context.A));
+    emit_rm(8, X86_MOVZX8, REG_X, CPU_FIELD(_context.X));
+    emit_rm(8, X86_MOVZX8, REG_Y, CPU_FIELD(_context.Y));
+    emit_rm(64, X86_MOV_LOAD, REG_CYCLE, CPU_FIELD(_cycle));
+    emit_jmp_reg(s_arg_regs[1]);
+
+    //
+    // exit - PC is already written back
+    //
+    _exit = _code + _code_size;
+    emit_store_regs();
+    emit_alu_imm(64, EXT_ADD, RSP, NES_JIT_FRAME_SIZE);
+    for (int reg : { R15, R14, R13, R12, RBP, RBX })
+        emit_pop(reg);
+    emit_byte(0xc3);                                                    // ret
+
+    //
+    // chain - ecx is the PC to continue at
+    //
+    _chain = _code + _code_size;
+    emit_alu_imm(32, EXT_CMP, RCX, NES_JIT_BLOCK_START);
+    fixup_t not_prg = emit_jcc(CC_B);
+
+    // Live version of the PRG window at ecx
+    emit_rr(32, X86_MOV_STORE, RCX, RAX);
+    emit_shift_imm(32, EXT_SHR, RAX, PRG_WINDOW_SHIFT);
+    emit_alu_imm(32, EXT_AND, RAX, PRG_WINDOW_COUNT - 1);
+    emit_mov_imm(RDX, (uint64_t)cpu->_mem->prg_versions());
+    emit_rm(32, X86_MOV_LOAD, RAX, mem(RDX, 0, RAX, 4));
+
+    // &_blocks[ecx - NES_JIT_BLOCK_START]
+    static_assert(sizeof(block_entry) == 16, "block_entry is indexed with a shift");
+    emit_mov_imm(RDX, (uint64_t)(_blocks.data()) - NES_JIT_BLOCK_START * sizeof(block_entry));
+    emit_rr(32, X86_MOV_STORE, RCX, R8);
+    emit_shift_imm(64, EXT_SHL, R8, 4);
+    emit_rr(64, X86_ADD, R8, RDX);
+    emit_rm(32, X86_CMP, RAX, mem(RDX, offsetof(block_entry, version)));
+    fixup_t stale = emit_jcc(CC_NE);
+    emit_rm(64, X86_MOV_LOAD, RAX, mem(RDX, offsetof(block_entry, code)));
+    emit_rr(64, X86_TEST, RAX, RAX);
+    fixup_t no_block = emit_jcc(CC_E);
+    emit_jmp_reg(RAX);
+
+    bind(not_prg);
+    bind(stale);
+    bind(no_block);
+    emit_rm(16, X86_MOV_STORE, RCX, CPU_FIELD(_context.PC));
+    emit_jmp_to(_exit);
+
+    assert(_code_size <= NES_JIT_MAX_OP_SIZE);
+    return protect(0, _code_size, false);
+}
+
+const uint8_t *nes_jit::translate(nes_cpu *cpu, uint16_t pc, uint32_t version)
+{
+    assert(is_available());
+
+    block_op ops[NES_JIT_MAX_BLOCK_OPS];
+    int count = decode_block(cpu, pc, ops);
+    if (count == 0)
+        return nullptr;
+
+    // Running out of space throws away everything so the second try always fits
+    size_t max_size = count * NES_JIT_MAX_OP_SIZE + NES_JIT_MAX_OP_SIZE;
+    if (_code_size == 0 || _cpu != cpu || _code_size + max_size > NES_JIT_CODE_SIZE)
+    {
+        reset();
+        if (!emit_stubs(cpu))
+            return nullptr;
+    }
+
+    size_t start = _code_size;
+    if (!protect(start, start + max_size, true))
+        return nullptr;
+
+    const uint8_t *block = _code + start;
+    _exits.clear();
+    _exit_pcs.clear();
+    _block_pc = pc;
+    _block_version = version;
+
+    //
+    // Every instruction but the last needs to start before the PPU needs to catch up (and before
+    // the end of the step) - otherwise leave right away and let the interpreter get there
+    //
+    int64_t rest_cycles = 0;
+    for (int i = 0; i < count - 1; ++i)
+        rest_cycles += ppu_cycles(ops[i].max_cycles);
+    emit_rm(64, X86_LEA, RAX, mem(REG_CYCLE, int32_t(rest_cycles)));
+    emit_rm(64, X86_CMP_LOAD, RAX, CPU_FIELD(_ppu_sync_cycle));
+    emit_exit_jcc(CC_GE, pc);
+    emit_rm(64, X86_CMP_LOAD, RAX, CPU_FIELD(_step_target));
+    emit_exit_jcc(CC_GE, pc);
+
+    bool falls_through = true;
+    for (int i = 0; i < count; ++i)
+    {
+        falls_through = emit_op(ops[i], rest_cycles, block);
+        if (i < count - 1)
+            rest_cycles -= ppu_cycles(ops[i].max_cycles);
+    }
+
+    // Ran out of instructions (or into the next window)
+    if (falls_through)
+        emit_jump_to(ops[count - 1].next_pc, block);
+
+    for (size_t i = 0; i < _exits.size(); ++i)
+    {
+        bind(_exits[i]);
+        emit_mov_mem_imm(16, CPU_FIELD(_context.PC), _exit_pcs[i]);
+        emit_jmp_to(_exit);
+    }
+
+    assert(_code_size - start <= max_size);
+    if (!protect(start, _code_size, false))
+        return nullptr;
+
+    _blocks[pc - NES_JIT_BLOCK_START] = { block, version };
+    return block;
+}
+
+int nes_jit::decode_block(nes_cpu *cpu, uint16_t pc, block_op *ops)
+{
+    // A block is straight line code within one PRG window, up to and including the first instruction
+    // that changes PC
+    uint32_t window = pc & ~(PRG_WINDOW_SIZE - 1);
+    uint32_t addr = pc;
+    int count = 0;
+    while (count < NES_JIT_MAX_BLOCK_OPS)
+    {
+        uint8_t op_code = cpu->peek(addr);
+        const nes_cpu::op_code_info &info = nes_cpu::s_op_code_info[op_code];
+        int size = 1 + get_operand_size(info.addr_mode);
+        if (((addr + size - 1) & ~(PRG_WINDOW_SIZE - 1)) != window)
+            break;
+
+        block_op &op = ops[count++];
+        op.pc = addr;
+        op.op_code = op_code;
+        if (size == 3)
+            op.operand = cpu->peek_word(addr + 1);
+        else if (size == 2)
+            op.operand = cpu->peek(addr + 1);
+        else
+            op.operand = 0;
+        op.next_pc = addr + size;
+        op.max_cycles = info.cycles + info.page_cross_cycles;
+        if (info.addr_mode == nes_addr_mode_rel)
+            op.max_cycles++;
+        addr += size;
+
+        if (is_block_end(op))
+            break;
+    }
+
+    return count;
+}
+
+
+bool nes_jit::emit_op(const block_op &op, int64_t rest_cycles, const uint8_t *block)
+{
+    _bus_access = false;
+    _bus_write = false;
+
+    native_op result = emit_native_op(op, rest_cycles, block);
+    if (result == native_op_none)
+    {
+        emit_interpret(op, rest_cycles);
+        return !is_block_end(op);
+    }
+
+    if (result == native_op_jump)
+        return false;
+
+    emit_alu_imm(64, EXT_ADD, REG_CYCLE, int32_t(ppu_cycles(nes_cpu::s_op_code_info[op.op_code].cycles)));
+    if (_bus_access)
+        emit_exit_check(op.next_pc, _bus_write);
+
+    return true;
+}
+
+bool nes_jit::is_block_end(const block_op &op)
+{
+    // branches, JMP, JSR, RTI, RTS, BRK, KIL
+    const nes_cpu::op_code_info &info = nes_cpu::s_op_code_info[op.op_code];
+    return info.addr_mode == nes_addr_mode_rel || info.addr_mode == nes_addr_mode_abs_jmp ||
+        info.addr_mode == nes_addr_mode_ind_jmp || op.op_code == 0x40 || op.op_code == 0x60 || op.op_code == 0x00 ||
+        is_op(info.name, "KIL");
+}
+
+void nes_jit::emit_interpret(const block_op &op, int64_t rest_cycles)
+{
+    emit_store_regs();
+    emit_rr(64, X86_MOV_STORE, REG_CPU, s_arg_regs[0]);
+    emit_mov_imm(s_arg_regs[1], op.pc);
+    emit_rm(64, X86_LEA, s_arg_regs[2], mem(REG_CYCLE, int32_t(rest_cycles)));
+    emit_call((const void *)&nes_cpu::jit_interpret);
+    emit_load_regs();
+
+    if (!is_block_end(op))
+    {
+        // Could have been a register write
+        emit_exit_check(op.next_pc, true);
+        return;
+    }
+
+    // The handler has already moved PC
+    emit_alu_mem_imm(8, EXT_CMP, CPU_FIELD(_jit_exit), 0);
+    emit_jcc_to(CC_NE, _exit);
+    emit_rm(32, X86_MOVZX16, RCX, CPU_FIELD(_context.PC));
+    emit_jmp_to(_chain);
+}
+
+void nes_jit::emit_exit_jcc(int cc, uint16_t pc)
+{
+    _exits.push_back(emit_jcc(cc));
+    _exit_pcs.push_back(pc);
+}
+
+void nes_jit::emit_exit_check(uint16_t pc, bool check_version)
+{
+    // Something nes_cpu needs to look at between instructions - see nes_cpu::jit_must_exit
+    emit_alu_mem_imm(8, EXT_CMP, CPU_FIELD(_jit_exit), 0);
+    emit_exit_jcc(CC_NE, pc);
+
+    // Rest of the block could be gone (mapper register / PRG write)
+    if (check_version)
+    {
+        const uint32_t *version = _cpu->_mem->prg_versions() + ((_block_pc >> PRG_WINDOW_SHIFT) & (PRG_WINDOW_COUNT - 1));
+        emit_mov_imm(RAX, (uint64_t)version);
+        emit_alu_mem_imm(32, EXT_CMP, mem(RAX, 0), int32_t(_block_version));
+        emit_exit_jcc(CC_NE, pc);
+    }
+}
+
+void nes_jit::emit_jump_to(uint16_t pc, const uint8_t *block)
+{
+    // Looping back to ourselves - the check at the top of the block still applies
+    if (pc == _block_pc)
+    {
+        emit_jmp_to(block);
+        return;
+    }
+
+    emit_mov_imm(RCX, pc);
+    emit_jmp_to(_chain);
+}
+
+void nes_jit::emit_store_regs()
+{
+    emit_rm(8, X86_MOV_STORE, REG_A, CPU_FIELD(_context.A));
+    emit_rm(8, X86_MOV_STORE, REG_X, CPU_FIELD(_context.X));
+    emit_rm(8, X86_MOV_STORE, REG_Y, CPU_FIELD(_context.Y));
+    emit_rm(64, X86_MOV_STORE, REG_CYCLE, CPU_FIELD(_cycle));
+}
+
+void nes_jit::emit_load_regs()
+{
+    emit_rm(8, X86_MOVZX8, REG_A, CPU_FIELD(_context.A));
+    emit_rm(8, X86_MOVZX8, REG_X, CPU_FIELD(_context.X));
+    emit_rm(8, X86_MOVZX8, REG_Y, CPU_FIELD(_context.Y));
+    emit_rm(64, X86_MOV_LOAD, REG_CYCLE, CPU_FIELD(_cycle));
+}
+
+// Whether the operand is always in RAM ($0000~$1FFF) no matter what X is
+static bool is_ram_operand(nes_addr_mode mode, uint16_t operand)
+{
+    switch (mode)
+    {
+    case nes_addr_mode_zp:
+    case nes_addr_mode_zp_ind_x:
+    case nes_addr_mode_zp_ind_y:
+        return true;
+    case nes_addr_mode_abs:
+        return operand < 0x2000;
+    case nes_addr_mode_abs_x:
+    case nes_addr_mode_abs_y:
+        return operand + 0xff < 0x2000;
+    default:
+        return false;
+    }
+}
+
+nes_jit::native_op nes_jit::emit_native_op(const block_op &op, int64_t rest_cycles, const uint8_t *block)
+{
+    const nes_cpu::op_code_info &info = nes_cpu::s_op_code_info[op.op_code];
+    const char *name = info.name;
+    nes_addr_mode mode = info.addr_mode;
+
+    //
+    // Loads / ALU
+    //
+    if (is_op(name, "LDA") || is_op(name, "LDX") || is_op(name, "LDY") || is_op(name, "LAX"))
+    {
+        emit_read_operand(op, rest_cycles);
+        if (name[2] != 'X' && name[2] != 'Y')
+            emit_rr(32, X86_MOV_STORE, RAX, REG_A);
+        if (name[2] == 'X')
+            emit_rr(32, X86_MOV_STORE, RAX, REG_X);
+        if (name[2] == 'Y')
+            emit_rr(32, X86_MOV_STORE, RAX, REG_Y);
+        if (is_op(name, "LAX"))
+            emit_rr(32, X86_MOV_STORE, RAX, REG_A);
+        emit_set_nz(RAX);
+        return native_op_done;
+    }
+
+    if (is_op(name, "AND") || is_op(name, "ORA") || is_op(name, "EOR"))
+    {
+        emit_read_operand(op, rest_cycles);
+        emit_rr(32, is_op(name, "AND") ? X86_AND : is_op(name, "ORA") ? X86_OR : X86_XOR, RAX, REG_A);
+        emit_set_nz(REG_A);
+        return native_op_done;
+    }
+
+    if (is_op(name, "ADC") || is_op(name, "SBC"))
+    {
+        // SBC is ADC of the complement - see nes_cpu::_SBC
+        emit_read_operand(op, rest_cycles);
+        if (is_op(name, "SBC"))
+            emit_alu_imm(32, EXT_XOR, RAX, 0xff);
+
+        // 9-bit sum in ecx
+        emit_load_carry(RCX);
+        emit_rr(32, X86_ADD, RAX, RCX);
+        emit_rr(32, X86_ADD, REG_A, RCX);
+
+        // V - see nes_cpu::calc_overflow_flag
+        emit_rr(32, X86_MOV_STORE, REG_A, RDX);
+        emit_rr(32, X86_XOR, RCX, RDX);
+        emit_rr(32, X86_XOR, RCX, RAX);
+        emit_rr(32, X86_AND, RAX, RDX);
+        emit_rm(8, X86_MOV_STORE, RDX, CPU_FIELD(_v_result));
+
+        emit_rr(32, X86_MOV_STORE, RCX, RAX);
+        emit_shift_imm(32, EXT_SHR, RAX, 8);
+        emit_set_carry(RAX);
+        emit_rr(8, X86_MOVZX8, REG_A, RCX);
+        emit_set_nz(REG_A);
+        return native_op_done;
+    }
+
+    if (is_op(name, "CMP") || is_op(name, "CPX") || is_op(name, "CPY"))
+    {
+        emit_read_operand(op, rest_cycles);
+        int reg = (name[2] == 'X') ? REG_X : (name[2] == 'Y') ? REG_Y : REG_A;
+        emit_rr(32, X86_MOV_STORE, reg, RCX);
+        emit_rr(32, X86_SUB, RAX, RCX);
+        emit_rr(8, X86_SETCC(CC_AE), 0, RDX);
+        emit_set_carry(RDX);
+        emit_set_nz(RCX);
+        return native_op_done;
+    }
+
+    if (is_op(name, "BIT"))
+    {
+        emit_read_operand(op, rest_cycles);
+        emit_rm(8, X86_MOV_STORE, RAX, CPU_FIELD(_n_result));
+        emit_rr(32, X86_MOV_STORE, RAX, RCX);
+        emit_rr(32, X86_AND, REG_A, RCX);
+        emit_rm(8, X86_MOV_STORE, RCX, CPU_FIELD(_z_result));
+        emit_rr(32, X86_ADD, RAX, RAX);
+        emit_rm(8, X86_MOV_STORE, RAX, CPU_FIELD(_v_result));
+        return native_op_done;
+    }
+
+    //
+    // Stores
+    //
+    if (is_op(name, "STA") || is_op(name, "STX") || is_op(name, "STY") || is_op(name, "SAX"))
+    {
+        operand_loc loc;
+        emit_operand_addr(op, loc);
+
+        int val_reg = REG_A;
+        if (is_op(name, "STX"))
+            val_reg = REG_X;
+        else if (is_op(name, "STY"))
+            val_reg = REG_Y;
+        else if (is_op(name, "SAX"))
+        {
+            emit_rr(32, X86_MOV_STORE, REG_A, RAX);
+            emit_rr(32, X86_AND, REG_X, RAX);
+            val_reg = RAX;
+        }
+
+        emit_write(loc, val_reg, rest_cycles);
+        return native_op_done;
+    }
+
+    //
+    // Read-modify-write - only RAM, as writing back to a register has side effects
+    //
+    bool is_shift = is_op(name, "ASL") || is_op(name, "LSR") || is_op(name, "ROL") || is_op(name, "ROR");
+    if (is_shift || is_op(name, "INC") || is_op(name, "DEC"))
+    {
+        operand_loc loc;
+        if (mode == nes_addr_mode_acc)
+            emit_rr(32, X86_MOV_STORE, REG_A, RAX);
+        else if (is_ram_operand(mode, op.operand))
+        {
+            emit_operand_addr(op, loc);
+            emit_rm(8, X86_MOVZX8, RAX, loc.ram);
+        }
+        else
+            return native_op_none;
+
+        // New value in eax, carry in edx
+        if (is_op(name, "ROL") || is_op(name, "ROR"))
+            emit_load_carry(R8);
+        if (is_op(name, "ASL") || is_op(name, "ROL"))
+        {
+            emit_rr(32, X86_MOV_STORE, RAX, RDX);
+            emit_shift_imm(32, EXT_SHR, RDX, 7);
+            emit_rr(32, X86_ADD, RAX, RAX);
+        }
+        else if (is_shift)
+        {
+            emit_rr(32, X86_MOV_STORE, RAX, RDX);
+            emit_alu_imm(32, EXT_AND, RDX, 1);
+            emit_shift_imm(32, EXT_SHR, RAX, 1);
+        }
+        else
+            emit_alu_imm(32, is_op(name, "INC") ? EXT_ADD : EXT_SUB, RAX, 1);
+
+        if (is_op(name, "ROL"))
+            emit_rr(32, X86_OR, R8, RAX);
+        else if (is_op(name, "ROR"))
+        {
+            emit_shift_imm(32, EXT_SHL, R8, 7);
+            emit_rr(32, X86_OR, R8, RAX);
+        }
+        emit_rr(8, X86_MOVZX8, RAX, RAX);
+
+        if (mode == nes_addr_mode_acc)
+            emit_rr(32, X86_MOV_STORE, RAX, REG_A);
+        else
+            emit_rm(8, X86_MOV_STORE, RAX, loc.ram);
+
+        if (is_shift)
+            emit_set_carry(RDX);
+        emit_set_nz(RAX);
+        return native_op_done;
+    }
+
+    //
+    // Registers / flags
+    //
+    if (is_op(name, "INX") || is_op(name, "INY") || is_op(name, "DEX") || is_op(name, "DEY"))
+    {
+        int reg = (name[2] == 'X') ? REG_X : REG_Y;
+        emit_alu_imm(32, (name[0] == 'I') ? EXT_ADD : EXT_SUB, reg, 1);
+        emit_rr(8, X86_MOVZX8, reg, reg);
+        emit_set_nz(reg);
+        return native_op_done;
+    }
+
+    static const struct { const char *name; int src; int dest; } s_transfers[] =
+    {
+        { "TAX", REG_A, REG_X }, { "TAY", REG_A, REG_Y }, { "TXA", REG_X, REG_A }, { "TYA", REG_Y, REG_A },
+    };
+    for (auto &transfer : s_transfers)
+    {
+        if (is_op(name, transfer.name))
+        {
+            emit_rr(32, X86_MOV_STORE, transfer.src, transfer.dest);
+            emit_set_nz(transfer.dest);
+            return native_op_done;
+        }
+    }
+
+    if (is_op(name, "TSX"))
+    {
+        emit_rm(8, X86_MOVZX8, REG_X, CPU_FIELD(_context.S));
+        emit_set_nz(REG_X);
+        return native_op_done;
+    }
+
+    if (is_op(name, "TXS"))
+    {
+        emit_rm(8, X86_MOV_STORE, REG_X, CPU_FIELD(_context.S));
+        return native_op_done;
+    }
+
+    static const struct { const char *name; uint8_t mask; bool set; } s_flag_ops[] =
+    {
+        { "CLC", PROCESSOR_STATUS_CARRY_MASK, false }, { "SEC", PROCESSOR_STATUS_CARRY_MASK, true },
+        { "CLI", PROCESSOR_STATUS_INTERRUPT_MASK, false }, { "SEI", PROCESSOR_STATUS_INTERRUPT_MASK, true },
+        { "CLD", PROCESSOR_STATUS_DECIMAL_MASK, false }, { "SED", PROCESSOR_STATUS_DECIMAL_MASK, true },
+    };
+    for (auto &flag_op : s_flag_ops)
+    {
+        if (is_op(name, flag_op.name))
+        {
+            if (flag_op.set)
+                emit_alu_mem_imm(8, EXT_OR, CPU_FIELD(_context.P), flag_op.mask);
+            else
+                emit_alu_mem_imm(8, EXT_AND, CPU_FIELD(_context.P), uint8_t(~flag_op.mask));
+            return native_op_done;
+        }
+    }
+
+    if (is_op(name, "CLV"))
+    {
+        emit_mov_mem_imm(8, CPU_FIELD(_v_result), 0);
+        return native_op_done;
+    }
+
+    if (is_op(name, "NOP"))
+    {
+        // Decodes the operand without reading it - see nes_cpu::NOP
+        if (info.page_cross_cycles)
+            emit_page_crossing(op);
+        return native_op_done;
+    }
+
+    //
+    // Stack - always RAM ($0100~$01FF)
+    //
+    if (is_op(name, "PHA"))
+    {
+        emit_rm(8, X86_MOVZX8, RAX, CPU_FIELD(_context.S));
+        emit_rm(8, X86_MOV_STORE, REG_A, mem(REG_RAM, STACK_OFFSET, RAX));
+        emit_alu_imm(32, EXT_SUB, RAX, 1);
+        emit_rm(8, X86_MOV_STORE, RAX, CPU_FIELD(_context.S));
+        return native_op_done;
+    }
+
+    if (is_op(name, "PLA"))
+    {
+        emit_rm(8, X86_MOVZX8, RAX, CPU_FIELD(_context.S));
+        emit_alu_imm(32, EXT_ADD, RAX, 1);
+        emit_rm(8, X86_MOV_STORE, RAX, CPU_FIELD(_context.S));
+        emit_rr(8, X86_MOVZX8, RAX, RAX);
+        emit_rm(8, X86_MOVZX8, REG_A, mem(REG_RAM, STACK_OFFSET, RAX));
+        emit_set_nz(REG_A);
+        return native_op_done;
+    }
+
+    //
+    // Control flow - leaves the block, so cycles are added here
+    //
+    int64_t cycles = ppu_cycles(info.cycles);
+    if (is_op(name, "JSR"))
+    {
+        // Return address - 1, see nes_cpu::JSR
+        uint16_t ret = op.next_pc - 1;
+        emit_rm(8, X86_MOVZX8, RAX, CPU_FIELD(_context.S));
+        emit_mov_mem_imm(8, mem(REG_RAM, STACK_OFFSET, RAX), ret >> 8);
+        emit_alu_imm(32, EXT_SUB, RAX, 1);
+        emit_rr(8, X86_MOVZX8, RAX, RAX);
+        emit_mov_mem_imm(8, mem(REG_RAM, STACK_OFFSET, RAX), ret & 0xff);
+        emit_alu_imm(32, EXT_SUB, RAX, 1);
+        emit_rm(8, X86_MOV_STORE, RAX, CPU_FIELD(_context.S));
+        emit_alu_imm(64, EXT_ADD, REG_CYCLE, int32_t(cycles));
+        emit_jump_to(op.operand, block);
+        return native_op_jump;
+    }
+
+    if (is_op(name, "RTS"))
+    {
+        emit_rm(8, X86_MOVZX8, RAX, CPU_FIELD(_context.S));
+        emit_alu_imm(32, EXT_ADD, RAX, 1);
+        emit_rr(8, X86_MOVZX8, RAX, RAX);
+        emit_rm(8, X86_MOVZX8, RCX, mem(REG_RAM, STACK_OFFSET, RAX));
+        emit_alu_imm(32, EXT_ADD, RAX, 1);
+        emit_rr(8, X86_MOVZX8, RAX, RAX);
+        emit_rm(8, X86_MOVZX8, RDX, mem(REG_RAM, STACK_OFFSET, RAX));
+        emit_rm(8, X86_MOV_STORE, RAX, CPU_FIELD(_context.S));
+        emit_shift_imm(32, EXT_SHL, RDX, 8);
+        emit_rr(32, X86_OR, RDX, RCX);
+        emit_alu_imm(32, EXT_ADD, RCX, 1);
+        emit_rr(32, X86_MOVZX16, RCX, RCX);
+        emit_alu_imm(64, EXT_ADD, REG_CYCLE, int32_t(cycles));
+        emit_jmp_to(_chain);
+        return native_op_jump;
+    }
+
+    //
+    // JMP / branches that could be an infinite loop (see nes_cpu::stop_at_infinite_loop) or an idle
+    // loop (see nes_cpu::skip_idle_loop) are left to the interpreter
+    //
+    bool is_idle_loop = false;
+    if (_cpu->_idle_loop_skip_enabled)
+    {
+        uint16_t target = (mode == nes_addr_mode_rel) ? uint16_t(op.next_pc + int8_t(op.operand)) : op.operand;
+        if (target < op.next_pc)
+        {
+            nes_cpu::nes_idle_loop loop;
+            _cpu->analyze_idle_loop(target, op.pc, loop);
+            is_idle_loop = loop.is_idle;
+        }
+    }
+
+    if (is_op(name, "JMP") && mode == nes_addr_mode_abs_jmp)
+    {
+        if (op.operand == op.pc + 2 || is_idle_loop)
+            return native_op_none;
+
+        emit_alu_imm(64, EXT_ADD, REG_CYCLE, int32_t(cycles));
+        emit_jump_to(op.operand, block);
+        return native_op_jump;
+    }
+
+    if (mode == nes_addr_mode_rel)
+    {
+        int8_t rel = int8_t(op.operand);
+        if (rel == -2 || is_idle_loop)
+            return native_op_none;
+
+        // Whether the branch is taken if ZF is set
+        int taken_cc;
+        switch (op.op_code)
+        {
+        case 0x10: /* BPL */ emit_test_mem_imm(CPU_FIELD(_n_result), 0x80); taken_cc = CC_E; break;
+        case 0x30: /* BMI */ emit_test_mem_imm(CPU_FIELD(_n_result), 0x80); taken_cc = CC_NE; break;
+        case 0x50: /* BVC */ emit_test_mem_imm(CPU_FIELD(_v_result), 0x80); taken_cc = CC_E; break;
+        case 0x70: /* BVS */ emit_test_mem_imm(CPU_FIELD(_v_result), 0x80); taken_cc = CC_NE; break;
+        case 0x90: /* BCC */ emit_test_mem_imm(CPU_FIELD(_context.P), PROCESSOR_STATUS_CARRY_MASK); taken_cc = CC_E; break;
+        case 0xb0: /* BCS */ emit_test_mem_imm(CPU_FIELD(_context.P), PROCESSOR_STATUS_CARRY_MASK); taken_cc = CC_NE; break;
+        case 0xd0: /* BNE */ emit_alu_mem_imm(8, EXT_CMP, CPU_FIELD(_z_result), 0); taken_cc = CC_NE; break;
+        case 0xf0: /* BEQ */ emit_alu_mem_imm(8, EXT_CMP, CPU_FIELD(_z_result), 0); taken_cc = CC_E; break;
+        default: return native_op_none;
+        }
+
+        // Taken: +1, and +1 more if crossing to a new page - see nes_cpu::branch
+        uint16_t target = op.next_pc + rel;
+        int64_t taken_cycles = info.cycles + 1;
+        if ((target & 0xff00) != (op.next_pc & 0xff00))
+            taken_cycles += info.page_cross_cycles;
+
+        fixup_t not_taken = emit_jcc(taken_cc ^ 1);
+        emit_alu_imm(64, EXT_ADD, REG_CYCLE, int32_t(ppu_cycles(taken_cycles)));
+        emit_jump_to(target, block);
+        bind(not_taken);
+        emit_alu_imm(64, EXT_ADD, REG_CYCLE, int32_t(cycles));
+        emit_jump_to(op.next_pc, block);
+        return native_op_jump;
+    }
+
+    // PHP, PLP, RTI, BRK, JMP (ind), and the unofficial op codes
+    return native_op_none;
+}
+
+void nes_jit::emit_operand_addr(const block_op &op, operand_loc &loc)
+{
+    nes_addr_mode mode = nes_cpu::s_op_code_info[op.op_code].addr_mode;
+    uint8_t zp = uint8_t(op.operand);
+    switch (mode)
+    {
+    case nes_addr_mode_zp:
+        loc.kind = operand_ram;
+        loc.ram = mem(REG_RAM, zp);
+        break;
+    case nes_addr_mode_zp_ind_x:
+    case nes_addr_mode_zp_ind_y:
+        emit_rm(32, X86_LEA, RCX, mem(mode == nes_addr_mode_zp_ind_x ? REG_X : REG_Y, zp));
+        emit_rr(8, X86_MOVZX8, RCX, RCX);
+        loc.kind = operand_ram;
+        loc.ram = mem(REG_RAM, 0, RCX);
+        break;
+    case nes_addr_mode_abs:
+        if (op.operand < 0x2000)
+        {
+            loc.kind = operand_ram;
+            loc.ram = mem(REG_RAM, op.operand & 0x7ff);
+        }
+        else
+        {
+            loc.kind = operand_static;
+            loc.addr = op.operand;
+        }
+        break;
+    case nes_addr_mode_abs_x:
+    case nes_addr_mode_abs_y:
+        emit_rm(32, X86_LEA, RCX, mem(mode == nes_addr_mode_abs_x ? REG_X : REG_Y, op.operand));
+        if (is_ram_operand(mode, op.operand))
+        {
+            // $0000~$07FF mirrored until $1FFF
+            emit_alu_imm(32, EXT_AND, RCX, 0x7ff);
+            loc.kind = operand_ram;
+            loc.ram = mem(REG_RAM, 0, RCX);
+        }
+        else
+        {
+            emit_rr(32, X86_MOVZX16, RCX, RCX);
+            loc.kind = operand_dynamic;
+        }
+        break;
+    case nes_addr_mode_ind_x:
+        // Pointer at (zp + X) & 0xff, wrapping around within zero page
+        emit_rm(32, X86_LEA, RDX, mem(REG_X, zp));
+        emit_rr(8, X86_MOVZX8, RDX, RDX);
+        emit_rm(8, X86_MOVZX8, RAX, mem(REG_RAM, 0, RDX));
+        emit_alu_imm(32, EXT_ADD, RDX, 1);
+        emit_rr(8, X86_MOVZX8, RDX, RDX);
+        emit_rm(8, X86_MOVZX8, RCX, mem(REG_RAM, 0, RDX));
+        emit_shift_imm(32, EXT_SHL, RCX, 8);
+        emit_rr(32, X86_OR, RAX, RCX);
+        loc.kind = operand_dynamic;
+        break;
+    case nes_addr_mode_ind_y:
+        // Pointer at zp, plus Y
+        emit_rm(8, X86_MOVZX8, RAX, mem(REG_RAM, zp));
+        emit_rm(8, X86_MOVZX8, RCX, mem(REG_RAM, uint8_t(zp + 1)));
+        emit_shift_imm(32, EXT_SHL, RCX, 8);
+        emit_rr(32, X86_OR, RAX, RCX);
+        emit_rr(32, X86_ADD, REG_Y, RCX);
+        emit_rr(32, X86_MOVZX16, RCX, RCX);
+        loc.kind = operand_dynamic;
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
+void nes_jit::emit_read_operand(const block_op &op, int64_t rest_cycles)
+{
+    const nes_cpu::op_code_info &info = nes_cpu::s_op_code_info[op.op_code];
+    if (info.addr_mode == nes_addr_mode_imm)
+    {
+        emit_mov_imm(RAX, uint8_t(op.operand));
+        return;
+    }
+
+    operand_loc loc;
+    emit_operand_addr(op, loc);
+    emit_read(loc, rest_cycles);
+    if (info.page_cross_cycles)
+        emit_page_crossing(op);
+}
+
+void nes_jit::emit_read(const operand_loc &loc, int64_t rest_cycles)
+{
+    if (loc.kind == operand_ram)
+    {
+        emit_rm(8, X86_MOVZX8, RAX, loc.ram);
+        return;
+    }
+
+    if (loc.kind == operand_static)
+    {
+        emit_mov_imm(RCX, loc.addr);
+
+        // PPU / APU / controller registers never have a page
+        if (loc.addr >= 0x2000 && loc.addr < 0x4100)
+        {
+            emit_bus_read(rest_cycles);
+            return;
+        }
+    }
+
+    // Page table lookup - see nes_memory::get_byte
+    emit_rr(32, X86_MOV_STORE, RCX, RAX);
+    emit_shift_imm(32, EXT_SHR, RAX, MEMORY_PAGE_SHIFT);
+    emit_mov_imm(RDX, (uint64_t)_cpu->_mem->read_pages());
+    emit_rm(64, X86_MOV_LOAD, RDX, mem(RDX, 0, RAX, 8));
+    emit_rr(64, X86_TEST, RDX, RDX);
+    fixup_t no_page = emit_jcc(CC_E);
+    emit_rr(8, X86_MOVZX8, RAX, RCX);
+    emit_rm(8, X86_MOVZX8, RAX, mem(RDX, 0, RAX));
+    fixup_t done = emit_jmp();
+    bind(no_page);
+    emit_bus_read(rest_cycles);
+    bind(done);
+}
+
+void nes_jit::emit_write(const operand_loc &loc, int val_reg, int64_t rest_cycles)
+{
+    if (loc.kind == operand_ram)
+    {
+        emit_rm(8, X86_MOV_STORE, val_reg, loc.ram);
+        return;
+    }
+
+    if (loc.kind == operand_static)
+    {
+        emit_mov_imm(RCX, loc.addr);
+
+        // Registers and PRG never have a page
+        if ((loc.addr >= 0x2000 && loc.addr < 0x4100) || loc.addr >= PRG_WINDOW_START)
+        {
+            emit_bus_write(val_reg, rest_cycles);
+            return;
+        }
+    }
+
+    // Page table lookup - see nes_memory::set_byte
+    emit_rr(32, X86_MOV_STORE, RCX, R8);
+    emit_shift_imm(32, EXT_SHR, R8, MEMORY_PAGE_SHIFT);
+    emit_mov_imm(RDX, (uint64_t)_cpu->_mem->write_pages());
+    emit_rm(64, X86_MOV_LOAD, RDX, mem(RDX, 0, R8, 8));
+    emit_rr(64, X86_TEST, RDX, RDX);
+    fixup_t no_page = emit_jcc(CC_E);
+    emit_rr(8, X86_MOVZX8, R8, RCX);
+    emit_rm(8, X86_MOV_STORE, val_reg, mem(RDX, 0, R8));
+    fixup_t done = emit_jmp();
+    bind(no_page);
+    emit_bus_write(val_reg, rest_cycles);
+    bind(done);
+}
+
+void nes_jit::emit_page_crossing(const block_op &op)
+{
+    const nes_cpu::op_code_info &info = nes_cpu::s_op_code_info[op.op_code];
+    uint8_t lo;
+    int index;
+    switch (info.addr_mode)
+    {
+    case nes_addr_mode_abs_x:
+    case nes_addr_mode_abs_y:
+        lo = uint8_t(op.operand);
+        index = (info.addr_mode == nes_addr_mode_abs_x) ? REG_X : REG_Y;
+        break;
+    case nes_addr_mode_ind_y:
+        // Low byte of the pointer - reading the operand can't have changed zero page
+        emit_rm(8, X86_MOVZX8, RDX, mem(REG_RAM, uint8_t(op.operand)));
+        emit_rr(32, X86_ADD, REG_Y, RDX);
+        lo = 0;
+        index = RDX;
+        break;
+    default:
+        return;
+    }
+
+    // Crossing if lo + index > 0xff
+    emit_alu_imm(32, EXT_CMP, index, 0xff - lo);
+    emit_rm(64, X86_LEA, RDX, mem(REG_CYCLE, int32_t(ppu_cycles(info.page_cross_cycles))));
+    emit_rr(64, X86_CMOV(CC_A), REG_CYCLE, RDX);
+}
+
+void nes_jit::emit_bus_read(int64_t rest_cycles)
+{
+    // Register accesses happen at the start of the instruction - see nes_cpu::sync_ppu
+    _bus_access = true;
+    emit_rm(64, X86_MOV_STORE, REG_CYCLE, CPU_FIELD(_cycle));
+    emit_rm(64, X86_MOV_STORE, REG_CYCLE, CPU_FIELD(_instruction_cycle));
+    emit_rr(32, X86_MOV_STORE, RCX, s_arg_regs[1]);
+    emit_rr(64, X86_MOV_STORE, REG_CPU, s_arg_regs[0]);
+    emit_rm(64, X86_LEA, s_arg_regs[2], mem(REG_CYCLE, int32_t(rest_cycles)));
+    emit_call((const void *)&nes_cpu::jit_read);
+}
+
+void nes_jit::emit_bus_write(int val_reg, int64_t rest_cycles)
+{
+    _bus_access = true;
+    _bus_write = true;
+    emit_rm(64, X86_MOV_STORE, REG_CYCLE, CPU_FIELD(_cycle));
+    emit_rm(64, X86_MOV_STORE, REG_CYCLE, CPU_FIELD(_instruction_cycle));
+    emit_rr(32, X86_MOV_STORE, RCX, s_arg_regs[1]);
+    emit_rr(32, X86_MOV_STORE, val_reg, s_arg_regs[2]);
+    emit_rr(64, X86_MOV_STORE, REG_CPU, s_arg_regs[0]);
+    emit_rm(64, X86_LEA, s_arg_regs[3], mem(REG_CYCLE, int32_t(rest_cycles)));
+    emit_call((const void *)&nes_cpu::jit_write);
+}
+
+void nes_jit::emit_set_nz(int reg)
+{
+    emit_rm(8, X86_MOV_STORE, reg, CPU_FIELD(_n_result));
+    emit_rm(8, X86_MOV_STORE, reg, CPU_FIELD(_z_result));
+}
+
+void nes_jit::emit_set_carry(int reg)
+{
+    // reg is 0 or 1
+    emit_alu_mem_imm(8, EXT_AND, CPU_FIELD(_context.P), uint8_t(~PROCESSOR_STATUS_CARRY_MASK));
+    emit_rm(8, X86_OR, reg, CPU_FIELD(_context.P));
+}
+
+void nes_jit::emit_load_carry(int reg)
+{
+    emit_rm(8, X86_MOVZX8, reg, CPU_FIELD(_context.P));
+    emit_alu_imm(32, EXT_AND, reg, PROCESSOR_STATUS_CARRY_MASK);
+}
+
+//
+// x86-64 encoding
+//
+void nes_jit::emit_word(uint16_t val)
+{
+    emit_byte(val & 0xff);
+    emit_byte(val >> 8);
+}
+
+void nes_jit::emit_dword(uint32_t val)
+{
+    for (int i = 0; i < 4; ++i)
+        emit_byte((val >> (i * 8)) & 0xff);
+}
+
+void nes_jit::emit_qword(uint64_t val)
+{
+    for (int i = 0; i < 8; ++i)
+        emit_byte((val >> (i * 8)) & 0xff);
+}
+
+void nes_jit::emit_rex(bool w, int reg, int index, int base, bool byte_reg)
+{
+    uint8_t rex = 0x40;
+    if (w)
+        rex |= 0x08;
+    if (reg >= R8)
+        rex |= 0x04;
+    if (index >= R8)
+        rex |= 0x02;
+    if (base >= R8)
+        rex |= 0x01;
+
+    // An empty REX makes spl/bpl/sil/dil (rather than ah/ch/dh/bh) addressable - harmless otherwise
+    if (rex != 0x40 || byte_reg)
+        emit_byte(rex);
+}
+
+void nes_jit::emit_opcode(uint32_t opcode)
+{
+    if (opcode > 0xff)
+        emit_byte(opcode >> 8);
+    emit_byte(opcode & 0xff);
+}
+
+void nes_jit::emit_modrm(int reg, const mem_t &mem)
+{
+    int mod;
+    if (mem.disp == 0 && (mem.base & 7) != RBP)
+        mod = 0;
+    else if (mem.disp >= -128 && mem.disp <= 127)
+        mod = 1;
+    else
+        mod = 2;
+
+    if (mem.index == NO_REG && (mem.base & 7) != RSP)
+    {
+        emit_byte((mod << 6) | ((reg & 7) << 3) | (mem.base & 7));
+    }
+    else
+    {
+        int scale = (mem.scale == 8) ? 3 : (mem.scale == 4) ? 2 : (mem.scale == 2) ? 1 : 0;
+        int index = (mem.index == NO_REG) ? RSP : mem.index;
+        emit_byte((mod << 6) | ((reg & 7) << 3) | RSP);
+        emit_byte((scale << 6) | ((index & 7) << 3) | (mem.base & 7));
+    }
+
+    if (mod == 1)
+        emit_byte(uint8_t(mem.disp));
+    else if (mod == 2)
+        emit_dword(uint32_t(mem.disp));
+}
+
+// The byte forms of the ALU / TEST / MOV op codes are one less
+static uint32_t byte_opcode(uint32_t opcode)
+{
+    if (opcode < 0x40 || opcode == X86_TEST || opcode == X86_MOV_STORE || opcode == X86_MOV_LOAD)
+        return opcode - 1;
+    return opcode;
+}
+
+void nes_jit::emit_rm(int size, uint32_t opcode, int reg, const mem_t &mem)
+{
+    if (size == 16)
+        emit_byte(0x66);
+    emit_rex(size == 64, reg, mem.index, mem.base, size == 8);
+    emit_opcode(size == 8 ? byte_opcode(opcode) : opcode);
+    emit_modrm(reg, mem);
+}
+
+void nes_jit::emit_rr(int size, uint32_t opcode, int reg, int rm)
+{
+    if (size == 16)
+        emit_byte(0x66);
+    emit_rex(size == 64, reg, NO_REG, rm, size == 8);
+    emit_opcode(size == 8 ? byte_opcode(opcode) : opcode);
+    emit_byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void nes_jit::emit_mov_imm(int reg, uint64_t val)
+{
+    // mov r32, imm32 zero extends
+    bool is_64 = (val > 0xffffffff);
+    emit_rex(is_64, 0, NO_REG, reg, false);
+    emit_byte(0xb8 + (reg & 7));
+    if (is_64)
+        emit_qword(val);
+    else
+        emit_dword(uint32_t(val));
+}
+
+void nes_jit::emit_mov_mem_imm(int size, const mem_t &mem, uint32_t val)
+{
+    emit_rm(size, size == 8 ? 0xc6 : 0xc7, 0, mem);
+    if (size == 8)
+        emit_byte(uint8_t(val));
+    else if (size == 16)
+        emit_word(uint16_t(val));
+    else
+        emit_dword(val);
+}
+
+void nes_jit::emit_alu_imm(int size, int ext, int rm, int32_t val)
+{
+    if (size == 8)
+    {
+        emit_rr(8, 0x80, ext, rm);
+        emit_byte(uint8_t(val));
+    }
+    else if (val >= -128 && val <= 127)
+    {
+        emit_rr(size, 0x83, ext, rm);
+        emit_byte(uint8_t(val));
+    }
+    else
+    {
+        emit_rr(size, 0x81, ext, rm);
+        emit_dword(uint32_t(val));
+    }
+}
+
+void nes_jit::emit_alu_mem_imm(int size, int ext, const mem_t &mem, int32_t val)
+{
+    if (size == 8)
+    {
+        emit_rm(8, 0x80, ext, mem);
+        emit_byte(uint8_t(val));
+    }
+    else if (val >= -128 && val <= 127)
+    {
+        emit_rm(size, 0x83, ext, mem);
+        emit_byte(uint8_t(val));
+    }
+    else
+    {
+        emit_rm(size, 0x81, ext, mem);
+        emit_dword(uint32_t(val));
+    }
+}
+
+void nes_jit::emit_test_mem_imm(const mem_t &mem, uint8_t val)
+{
+    emit_rm(8, 0xf6, 0, mem);
+    emit_byte(val);
+}
+
+void nes_jit::emit_shift_imm(int size, int ext, int reg, uint8_t count)
+{
+    emit_rr(size, 0xc1, ext, reg);
+    emit_byte(count);
+}
+
+void nes_jit::emit_push(int reg)
+{
+    emit_rex(false, 0, NO_REG, reg, false);
+    emit_byte(0x50 + (reg & 7));
+}
+
+void nes_jit::emit_pop(int reg)
+{
+    emit_rex(false, 0, NO_REG, reg, false);
+    emit_byte(0x58 + (reg & 7));
+}
+
+void nes_jit::emit_call(const void *func)
+{
+    emit_mov_imm(RAX, (uint64_t)func);
+    emit_rr(32, 0xff, 2, RAX);
+}
+
+void nes_jit::emit_jmp_reg(int reg)
+{
+    emit_rr(32, 0xff, 4, reg);
+}
+
+nes_jit::fixup_t nes_jit::emit_jcc(int cc)
+{
+    emit_opcode(0x0f80 | cc);
+    emit_dword(0);
+    return _code_size - 4;
+}
+
+nes_jit::fixup_t nes_jit::emit_jmp()
+{
+    emit_byte(0xe9);
+    emit_dword(0);
+    return _code_size - 4;
+}
+
+void nes_jit::emit_jcc_to(int cc, const uint8_t *target)
+{
+    emit_opcode(0x0f80 | cc);
+    emit_dword(uint32_t(target - (_code + _code_size + 4)));
+}
+
+void nes_jit::emit_jmp_to(const uint8_t *target)
+{
+    emit_byte(0xe9);
+    emit_dword(uint32_t(target - (_code + _code_size + 4)));
+}
+
+void nes_jit::bind(fixup_t fixup)
+{
+    int32_t rel = int32_t(_code_size - (fixup + 4));
+    memcpy(_code + fixup, &rel, sizeof(rel));
+}
+
+nes_jit::mem_t nes_jit::cpu_mem(const void *field)
+{
+    return mem(REG_CPU, int32_t((const uint8_t *)field - (const uint8_t *)_cpu));
+}
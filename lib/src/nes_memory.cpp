@@ -3,8 +3,12 @@
 void nes_memory::power_on(nes_system *system)
 {
     memset(&_ram[0], 0, RAM_SIZE);
+    invalidate_prg(0, RAM_SIZE);
+    map_pages();
     _system = system;
+    _cpu = _system->cpu();
     _ppu = _system->ppu();
+    _apu = _system->apu();
     _input = _system->input();
 }
 
@@ -15,6 +19,7 @@ uint8_t nes_memory::read_io_reg(uint16_t addr)
     case 0x2002: return _ppu->read_PPUSTATUS();
     case 0x2004: return _ppu->read_OAMDATA();
     case 0x2007: return _ppu->read_PPUDATA();
+    case 0x4015: return _apu->read_status();
     case 0x4016: return _input->read_CONTROLLER(0);
     case 0x4017: return _input->read_CONTROLLER(1);
     }
@@ -33,9 +38,28 @@ void nes_memory::write_io_reg(uint16_t addr, uint8_t val)
     case 0x2005: _ppu->write_PPUSCROLL(val); return;
     case 0x2006: _ppu->write_PPUADDR(val); return;
     case 0x2007: _ppu->write_PPUDATA(val); return;
+    case 0x4000: _apu->write_pulse_1_duty(val); return;
+    case 0x4001: _apu->write_pulse_1_sweep(val); return;
+    case 0x4002: _apu->write_pulse_1_timer_low(val); return;
+    case 0x4003: _apu->write_pulse_1_length_counter(val); return;
+    case 0x4004: _apu->write_pulse_2_duty(val); return;
+    case 0x4005: _apu->write_pulse_2_sweep(val); return;
+    case 0x4006: _apu->write_pulse_2_timer_low(val); return;
+    case 0x4007: _apu->write_pulse_2_length_counter(val); return;
+    case 0x4008: _apu->write_triangle_linear_counter(val); return;
+    case 0x400a: _apu->write_triangle_timer_low(val); return;
+    case 0x400b: _apu->write_triangle_length_counter(val); return;
+    case 0x400c: _apu->write_noise_volume(val); return;
+    case 0x400e: _apu->write_noise_period(val); return;
+    case 0x400f: _apu->write_noise_length_counter(val); return;
+    case 0x4010: _apu->write_dmc_flags(val); return;
+    case 0x4011: _apu->write_dmc_direct_load(val); return;
+    case 0x4012: _apu->write_dmc_sample_addr(val); return;
+    case 0x4013: _apu->write_dmc_sample_length(val); return;
     case 0x4014: _ppu->write_OAMDMA(val); return;
+    case 0x4015: _apu->write_status(val); return;
     case 0x4016: _input->write_CONTROLLER(val); return;
-    case 0x4017: _input->write_CONTROLLER(val); return;
+    case 0x4017: _apu->write_frame_counter(val); return;
     }
 
     _ppu->write_latch(val);
@@ -43,21 +67,78 @@ void nes_memory::write_io_reg(uint16_t addr, uint8_t val)
 
 void nes_memory::load_mapper(shared_ptr<nes_mapper> &mapper)
 {
-    // unset previous mapper
-    _mapper = nullptr;
+    // replace previous mapper - with everything mapped to RAM until the new mapper maps its PRG
+    _mapper = mapper;
+    _mapper->get_info(_mapper_info);
+    map_pages();
 
-    // Give mapper a chance to copy all the bytes needed
+    // Every PRG ROM bank gets a version of its own so switching back to a bank finds the 
+    // instructions decoded earlier still valid (ROM can't change)
+    _prg_rom_version = _prg_version_count + 1;
+    _prg_version_count += PRG_ROM_MAX_BANKS;
+
+    // Give mapper a chance to copy / map all the bytes needed
     mapper->on_load_ram(*this);
+}
 
-    _mapper = mapper;
-    _mapper->get_info(_mapper_info);
+void nes_memory::map_pages()
+{
+    for (uint32_t page = 0; page < MEMORY_PAGE_COUNT; ++page)
+    {
+        uint32_t addr = page << MEMORY_PAGE_SHIFT;
+
+        // $0000~$07FF is mirrored until $1FFF
+        uint8_t *ptr = _ram.data() + (addr < 0x2000 ? (addr & 0x7ff) : addr);
+
+        // PPU registers (and their mirrors) until $3FFF. $4000~$40FF shares its page with APU and 
+        // controller registers at $4000~$401F
+        bool is_io = (addr >= 0x2000 && addr < 0x4100);
+
+        // Mapper registers have their own handler, and PRG writes need to invalidate decoded instructions
+        bool is_mapper_reg = _mapper && (_mapper_info.flags & nes_mapper_flags_has_registers) &&
+            addr + MEMORY_PAGE_SIZE - 1 >= _mapper_info.reg_start && addr <= _mapper_info.reg_end;
+
+        _read_pages[page] = is_io ? nullptr : ptr;
+        _write_pages[page] = (is_io || is_mapper_reg || addr >= PRG_WINDOW_START) ? nullptr : ptr;
+    }
 }
 
-void nes_memory::set_byte(uint16_t addr, uint8_t val)
+void nes_memory::map_prg(uint16_t addr, vector<uint8_t> &prg_rom, uint32_t offset, uint32_t size)
+{
+    assert(addr >= PRG_WINDOW_START && addr % PRG_WINDOW_SIZE == 0 && size % PRG_WINDOW_SIZE == 0);
+    assert(offset % PRG_WINDOW_SIZE == 0 && offset + size <= prg_rom.size());
+    assert((offset >> PRG_WINDOW_SHIFT) < PRG_ROM_MAX_BANKS);
+
+    for (uint32_t window = 0; window < size; window += PRG_WINDOW_SIZE)
+    {
+        uint32_t window_addr = addr + window;
+        uint8_t *src = prg_rom.data() + offset + window;
+        for (uint32_t page = 0; page < PRG_WINDOW_SIZE; page += MEMORY_PAGE_SIZE)
+            _read_pages[(window_addr + page) >> MEMORY_PAGE_SHIFT] = src + page;
+
+        _prg_version[(window_addr >> PRG_WINDOW_SHIFT) & (PRG_WINDOW_COUNT - 1)] = 
+            _prg_rom_version + ((offset + window) >> PRG_WINDOW_SHIFT);
+    }
+}
+
+uint8_t nes_memory::read_page_handler(uint16_t addr)
+{
+    redirect_addr(addr);
+    if (is_io_reg(addr))
+    {
+        _cpu->sync_ppu();
+        return read_io_reg(addr);
+    }
+
+    return _ram[addr];
+}
+
+void nes_memory::write_page_handler(uint16_t addr, uint8_t val)
 {
     redirect_addr(addr);
     if (is_io_reg(addr))
     {
+        _cpu->sync_ppu();
         write_io_reg(addr, val);
         return;
     }
@@ -66,10 +147,15 @@ void nes_memory::set_byte(uint16_t addr, uint8_t val)
     {
         if (addr >= _mapper_info.reg_start && addr <= _mapper_info.reg_end)
         {
+            // Bank switches / mirroring changes apply from here on
+            _cpu->sync_ppu();
             _mapper->write_reg(addr, val);
             return;
         }
     }
 
+    if (addr >= PRG_WINDOW_START && _ram[addr] != val)
+        invalidate_prg(addr, 1);
+
     _ram[addr] = val;
 }
\ No newline at end of file
@@ -4,6 +4,10 @@
 #include "nes_system.h"
 #include "nes_memory.h"
 
+#ifdef NES_PPU_SSE2
+#include <emmintrin.h>
+#endif
+
 nes_ppu_protect::nes_ppu_protect(nes_ppu *ppu)
 {
     _ppu = ppu;
@@ -17,6 +21,7 @@ nes_ppu_protect::~nes_ppu_protect()
 
 nes_ppu::~nes_ppu()
 {
+    stop_render_threads();
     _oam = nullptr;
     _vram = nullptr;
 }
@@ -41,14 +46,26 @@ void nes_ppu::oam_dma(uint16_t addr)
         _system->ram()->get_bytes(_oam.get() + _oam_addr, copy_before_wrap, addr, copy_before_wrap);
         _system->ram()->get_bytes(_oam.get(), PPU_OAM_SIZE - copy_before_wrap, addr + copy_before_wrap, PPU_OAM_SIZE - copy_before_wrap);
     }
+
+    _sprite_buckets_dirty = true;
+
+    if (nes_ppu_log_entry *entry = log_op(nes_ppu_log_op_oam_dma, 0))
+    {
+        vector<uint8_t> &log_data = _recording_frame->_log_data;
+        entry->offset = (uint32_t)log_data.size();
+        log_data.insert(log_data.end(), _oam.get(), _oam.get() + PPU_OAM_SIZE);
+    }
 }
 
 void nes_ppu::load_mapper(shared_ptr<nes_mapper> &mapper)
 {
     // unset previous mapper
     _mapper = nullptr;
+    discard_deferred_frames();
+    map_chr_ram(0, PPU_PATTERN_TABLE_SIZE);
+    _chr_rom_rows_src = nullptr;
 
-    // Give mapper a chance to copy all the bytes needed
+    // Give mapper a chance to copy / map all the bytes needed
     mapper->on_load_ppu(*this);
 
     nes_mapper_info info;
@@ -60,7 +77,19 @@ void nes_ppu::load_mapper(shared_ptr<nes_mapper> &mapper)
 
 void nes_ppu::set_mirroring(nes_mapper_flags flags)
 {
-    _mirroring_flags = nes_mapper_flags(flags & nes_mapper_flags_mirroring_mask);
+    log_op(nes_ppu_log_op_set_mirroring, flags);
+
+    // Physical name table for $2000/$2400/$2800/$2C00, indexed by nes_mapper_flags_mirroring_mask bits
+    static const uint8_t s_name_tbl_mirroring[][PPU_NAME_TBL_COUNT] = {
+        { 0, 0, 0, 0 },     // one screen lower bank - $2000 mapped to all the other 3
+        { 1, 1, 1, 1 },     // one screen upper bank - $2400 mapped to all the other 3
+        { 0, 1, 0, 1 },     // vertical - $2000=$2800, $2400=$2c00
+        { 0, 0, 1, 1 },     // horizontal - $2000=$2400, $2800=$2c00
+    };
+
+    const uint8_t *name_tbls = s_name_tbl_mirroring[flags & nes_mapper_flags_mirroring_mask];
+    for (int i = 0; i < PPU_NAME_TBL_COUNT; ++i)
+        _name_tbl_pages[i] = _vram.get() + PPU_NAME_TBL_ADDR + name_tbls[i] * PPU_NAME_TBL_SIZE;
 }
 
 void nes_ppu::init()
@@ -78,6 +107,7 @@ void nes_ppu::init()
     _show_bg = false;
     _show_sprites = false;
     _gray_scale_mode = false;
+    _color_mode = 0;
 
     // PPUSTATUS
     _latch = 0;
@@ -113,11 +143,22 @@ void nes_ppu::init()
     _frame_buffer = _frame_buffer_1;
     memset(_frame_buffer_1, 0, sizeof(_frame_buffer_1));
     memset(_frame_buffer_2, 0, sizeof(_frame_buffer_2));
-    memset(_frame_buffer_bg, 0, sizeof(_frame_buffer_bg));
+    _frame_color_mode = _frame_color_mode_1;
+    _render_frame = _frame_render_enabled && !_deferred_render_enabled;
+    discard_deferred_frames();
+    memset(_frame_color_mode_1, 0, sizeof(_frame_color_mode_1));
+    memset(_frame_color_mode_2, 0, sizeof(_frame_color_mode_2));
+    memset(_bg_line_index, 0, sizeof(_bg_line_index));
+    memset(_sprite_line, 0, sizeof(_sprite_line));
+    memset(_sprite_front_line, 0, sizeof(_sprite_front_line));
+    _line_has_pixels = false;
+    _line_palette_dirty = true;
+    _line_colors_resolved = false;
 
     _last_sprite_id = 0;
     _has_sprite_0 = 0;
     _mask_oam_read = 0; 
+    _sprite_buckets_dirty = true;
 }
 
 void nes_ppu::reset()
@@ -153,19 +194,25 @@ void nes_ppu::fetch_tile()
         scanline_render_cycle = (_scanline_cycle - nes_ppu_cycle_t(1) + nes_ppu_cycle_t(16));
     }
 
-    auto data_access_cycle = scanline_render_cycle % 8;
+    fetch_tile((int)scanline_render_cycle.count(), cur_scanline);
+}
+
+// scanline_render_cycle counts from the first prefetch cycle (321) of the previous scanline
+void nes_ppu::fetch_tile(int scanline_render_cycle, uint16_t cur_scanline)
+{
+    int data_access_cycle = scanline_render_cycle % 8;
 
     // which of 8 rows witin a tile
     uint8_t tile_row_index = (cur_scanline + _scroll_y) % 8;
 
-    if (data_access_cycle == nes_ppu_cycle_t(0))
+    if (data_access_cycle == 0)
     {
         // fetch nametable byte for current 8-pixel-tile
         // http://wiki.nesdev.com/w/index.php/PPU_nametables
         uint16_t name_tbl_addr = (_ppu_addr & 0xfff) | 0x2000;
-        _tile_index = read_byte(name_tbl_addr);
+        _tile_index = read_name_tbl(name_tbl_addr);
     }
-    else if (data_access_cycle == nes_ppu_cycle_t(2))
+    else if (data_access_cycle == 2)
     {
         // fetch attribute table byte
         // each attribute pixel is 4 quadrant of 2x2 tile (so total of 8x8) tile
@@ -177,34 +224,36 @@ void nes_ppu::fetch_tile()
         uint8_t tile_attr_column = (tile_column >> 2) & 0x7;
         uint8_t tile_attr_row = (tile_row >> 2) & 0x7;
         uint16_t attr_tbl_addr = 0x23c0 | (_ppu_addr & 0x0c00) | (tile_attr_row << 3) | tile_attr_column;
-        uint8_t color_byte = read_byte(attr_tbl_addr);
+        uint8_t color_byte = read_name_tbl(attr_tbl_addr);
 
         // each quadrant has 2x2 tile and each row/column has 4 tiles, so divide by 2 (& 0x2 is faster)
         uint8_t _quadrant_id = (tile_row & 0x2) + ((tile_column & 0x2) >> 1);
         uint8_t color_bit32 = (color_byte & (0x3 << (_quadrant_id * 2))) >> (_quadrant_id * 2); 
         _tile_palette_bit32 = color_bit32 << 2;
     }
-    else if (data_access_cycle == nes_ppu_cycle_t(4))
+    else if (data_access_cycle == 4)
     {
         // Pattern table is area of memory define all the tiles make up background and sprites.
         // Think it as "lego blocks" that you can build up your background and sprites which 
         // simply consists of indexes. It is quite convoluted by today's standards but it is 
         // just a space saving technique.
         // http://wiki.nesdev.com/w/index.php/PPU_pattern_tables
-        _bitplane0 = read_pattern_table_column(/* sprite = */false, _tile_index, /* bitplane = */ 0, tile_row_index);
+        // bitplane 1 is fetched later (a CHR bank switch in between could change it)
+        _tile_row = read_pattern_table_row(/* sprite = */false, _tile_index, tile_row_index).pixels;
     }
-    else if (data_access_cycle == nes_ppu_cycle_t(6))
+    else if (data_access_cycle == 6)
     {
         // fetch tilebitmap high
         // add one more cycle for memory access to skip directly to next access
-        uint8_t bitplane1 = read_pattern_table_column(/* sprite = */false, _tile_index, /* bitplane = */ 1, tile_row_index);
+        uint16_t tile_row = (_tile_row & PPU_CHR_ROW_BITPLANE0_MASK) | 
+            (read_pattern_table_row(/* sprite = */false, _tile_index, tile_row_index).pixels & PPU_CHR_ROW_BITPLANE1_MASK);
 
         // for each column - bitplane0/bitplane1 has entire 8 column
         // high bit -> low bit
         int start_bit = 7;
         int end_bit = 0;
         
-        int tile = (int)(scanline_render_cycle.count() - /* current_access_cycle */ 6) / 8;
+        int tile = (scanline_render_cycle - /* current_access_cycle */ 6) / 8;
         if (_fine_x_scroll > 0)
         {
             if (tile == 0)
@@ -229,23 +278,33 @@ void nes_ppu::fetch_tile()
             if (tile > 31) return;
         }
 
-        for (int i = start_bit; i >= end_bit; --i)
+        uint8_t palette_bit32 = _tile_palette_bit32;
+        uint8_t x = _x_offset;
+        if (cur_scanline != _cur_scanline && cur_scanline == 0)
         {
-            uint8_t column_mask = 1 << i;
-            uint8_t tile_palette_bit01 = ((_bitplane0 & column_mask) >> i) | ((bitplane1 & column_mask) >> i << 1);
-            uint8_t color_4_bit = _tile_palette_bit32 | tile_palette_bit01;
-
-            _pixel_cycle[i] = get_palette_color(/* is_background = */ true, color_4_bit);
-
-            uint16_t frame_addr = uint16_t(cur_scanline) * PPU_SCREEN_X + _x_offset++;
-            if (frame_addr >= sizeof(_frame_buffer_1))
-                continue;
-            _frame_buffer[frame_addr] = _pixel_cycle[i];
-
-            // record the palette index just for sprite 0 hit detection
-            // the detection use palette 0 instead of actual color
-            _frame_buffer_bg[frame_addr] = tile_palette_bit01;
+            // Prefetch in scanline 239 for the next frame goes straight into current frame
+            if (!_render_frame)
+                x += start_bit - end_bit + 1;
+            else
+            {
+                for (int i = start_bit; i >= end_bit; --i, ++x)
+                    _frame_buffer[x] = get_palette_color(/* is_background = */ true, palette_bit32 | ((tile_row >> (i * 2)) & 0x3));
+            }
+        }
+        else
+        {
+            // color is looked up in composite_scanline. bit 1/0 is also used for priority and sprite 0 
+            // hit detection - the detection use palette 0 instead of actual color
+            for (int i = start_bit; i >= end_bit; --i, ++x)
+            {
+                uint8_t palette_index = palette_bit32 | ((tile_row >> (i * 2)) & 0x3);
+                _bg_line_index[x] = PPU_BG_LINE_FETCHED | palette_index;
+                if (_line_colors_resolved)
+                    _bg_line_color[x] = get_palette_color(/* is_background = */ true, palette_index);
+            }
+            _line_has_pixels = true;
         }
+        _x_offset = x;
 
         // Increment X position
         if ((_ppu_addr & 0x1f) == 0x1f)
@@ -274,44 +333,12 @@ void nes_ppu::fetch_tile_pipeline()
         fetch_tile();
 
         if (_scanline_cycle == nes_ppu_cycle_t(256))
-        {
-            if ((_ppu_addr & 0x7000) != 0x7000)
-            {
-                // Increase fine Y position (within tile)
-                _ppu_addr += 0x1000;
-            }
-            else
-            {
-                _ppu_addr &= ~0x7000;
-
-                // == row 29?
-                if ((_ppu_addr & 0x3e0) != 0x3a0)
-                {
-                     // Increase coarse Y position (next tile)
-                    _ppu_addr += 0x20;
-                }
-                else
-                {
-                    // wrap around
-                    _ppu_addr &= ~0x3e0;
-
-                    // switch to another vertical name table
-                    _ppu_addr ^= 0x0800;
-                }
-            }
-        }
+            increment_scroll_y();
     }
     else if (_scanline_cycle < nes_ppu_cycle_t(321))
     {
         if (_scanline_cycle == nes_ppu_cycle_t(257))
-        {
-            // Reset horizontal position
-            // This includes resetting horizontal name table (2000~2400, 2800~2c00)
-            // NNYY YYYX XXXX
-            //  ^      ^ ^^^^
-            _ppu_addr = (_ppu_addr & 0xfbe0) | (_temp_ppu_addr & ~0xfbe0);
-            _x_offset = 0;
-        }
+            reset_scroll_x();
 
         // fetch tile data for sprites on the next scanline
     }
@@ -371,17 +398,7 @@ void nes_ppu::fetch_sprite_pipeline()
         if ((_scanline_cycle.count() % 2) == 0)
         {
             // even cycle - write to secondary OAM
-            // if in range
-            if (_sprite_pos_y + 1 <= _cur_scanline && _cur_scanline < _sprite_pos_y + 1 + _sprite_height)
-            {
-                if (sprite_id == 0)
-                    _has_sprite_0 = true;
-
-                if (_last_sprite_id >= PPU_ACTIVE_SPRITE_MAX)
-                    _sprite_overflow = true;
-                else
-                    _sprite_buf[_last_sprite_id++] = *get_sprite(sprite_id);
-            }
+            evaluate_sprite(sprite_id);
         }
         else
         {
@@ -405,10 +422,356 @@ void nes_ppu::fetch_sprite_pipeline()
     }
 }
 
+void nes_ppu::increment_scroll_y()
+{
+    if ((_ppu_addr & 0x7000) != 0x7000)
+    {
+        // Increase fine Y position (within tile)
+        _ppu_addr += 0x1000;
+    }
+    else
+    {
+        _ppu_addr &= ~0x7000;
+
+        // == row 29?
+        if ((_ppu_addr & 0x3e0) != 0x3a0)
+        {
+             // Increase coarse Y position (next tile)
+            _ppu_addr += 0x20;
+        }
+        else
+        {
+            // wrap around
+            _ppu_addr &= ~0x3e0;
+
+            // switch to another vertical name table
+            _ppu_addr ^= 0x0800;
+        }
+    }
+}
+
+void nes_ppu::reset_scroll_x()
+{
+    // Reset horizontal position
+    // This includes resetting horizontal name table (2000~2400, 2800~2c00)
+    // NNYY YYYX XXXX
+    //  ^      ^ ^^^^
+    _ppu_addr = (_ppu_addr & 0xfbe0) | (_temp_ppu_addr & ~0xfbe0);
+    _x_offset = 0;
+}
+
+// copy sprite into secondary OAM if in range - _sprite_pos_y is read in the cycle before
+void nes_ppu::evaluate_sprite(uint8_t sprite_id)
+{
+    if (_sprite_pos_y + 1 <= _cur_scanline && _cur_scanline < _sprite_pos_y + 1 + _sprite_height)
+    {
+        if (sprite_id == 0)
+            _has_sprite_0 = true;
+
+        if (_last_sprite_id >= PPU_ACTIVE_SPRITE_MAX)
+            _sprite_overflow = true;
+        else
+            _sprite_buf[_last_sprite_id++] = *get_sprite(sprite_id);
+    }
+}
+
+//
+// Renders cycle 1~340 of a visible scanline in one go, producing exactly the same state as the
+// per-cycle pipelines. Only safe when nothing else can touch PPU state in the middle of the line -
+// register writes, mapper CHR switches and PPUSTATUS reads (sprite 0) all come from the CPU, which is
+// never ahead of step_to's target, so a scanline that fits entirely in one step_to qualifies
+//
+void nes_ppu::render_scanline()
+{
+    assert(_cur_scanline < PPU_SCREEN_Y);
+    assert(_scanline_cycle == nes_ppu_cycle_t(0));
+
+    // 1~256: background tiles (only the odd cycles do any work), 256/257: scroll update
+    // The sprite pipeline doesn't look at background state before 257 so running it first is fine
+    if (_show_bg)
+    {
+        for (int cycle = 1; cycle < 257; cycle += 2)
+            fetch_tile(cycle - 1 + 16, (uint16_t)_cur_scanline);
+
+        increment_scroll_y();
+        reset_scroll_x();
+    }
+
+    // 65~256: sprite evaluation, 257~320: sprite fetch - sprite 0 hit needs the background above
+    // Nothing can write OAM in the middle so evaluation takes the sprites in range from the buckets
+    if (_show_sprites && _cur_scanline != 0)
+    {
+        if (_sprite_buckets_dirty || _sprite_bucket_height != _sprite_height)
+            bucket_sprites();
+
+        _last_sprite_id = _sprite_bucket_count[_cur_scanline];
+        for (uint8_t i = 0; i < _last_sprite_id; ++i)
+            _sprite_buf[i] = *get_sprite(_sprite_bucket[_cur_scanline][i]);
+
+        _has_sprite_0 = (_last_sprite_id > 0 && _sprite_bucket[_cur_scanline][0] == 0);
+        _sprite_overflow = _sprite_bucket_overflow[_cur_scanline];
+        _sprite_pos_y = get_sprite(PPU_SPRITE_MAX - 1)->pos_y;
+        _mask_oam_read = false;
+
+        for (uint8_t sprite_id = 0; sprite_id < _last_sprite_id; ++sprite_id)
+            fetch_sprite(sprite_id);
+    }
+
+    composite_scanline();
+
+    // 321~336: first two tiles for next scanline
+    // This has to come after compositing - they go into the line buffers for the next scanline
+    if (_show_bg)
+    {
+        uint16_t next_scanline = (_cur_scanline + 1) % PPU_SCREEN_Y;
+        for (int cycle = 321; cycle < 337; cycle += 2)
+            fetch_tile(cycle - 321, next_scanline);
+    }
+
+    _master_cycle += nes_ppu_cycle_t(340);
+    _scanline_cycle = nes_ppu_cycle_t(340);
+}
+
+//
+// Does sprite evaluation for all scanlines in one pass over OAM, the same way evaluate_sprite does - 
+// the first 8 sprites in range go into the bucket, and any more sets overflow. Games usually 
+// write OAM once a frame so this is a lot cheaper than going through all 64 sprites every scanline
+//
+void nes_ppu::bucket_sprites()
+{
+    memset(_sprite_bucket_count, 0, sizeof(_sprite_bucket_count));
+    memset(_sprite_bucket_overflow, 0, sizeof(_sprite_bucket_overflow));
+
+    for (uint8_t sprite_id = 0; sprite_id < PPU_SPRITE_MAX; ++sprite_id)
+    {
+        // in range for scanline [pos_y + 1, pos_y + 1 + _sprite_height)
+        int start = get_sprite(sprite_id)->pos_y + 1;
+        int end = min(start + _sprite_height, PPU_SCREEN_Y);
+        for (int scanline = start; scanline < end; ++scanline)
+        {
+            uint8_t &count = _sprite_bucket_count[scanline];
+            if (count >= PPU_ACTIVE_SPRITE_MAX)
+                _sprite_bucket_overflow[scanline] = true;
+            else
+                _sprite_bucket[scanline][count++] = sprite_id;
+        }
+    }
+
+    _sprite_buckets_dirty = false;
+    _sprite_bucket_height = _sprite_height;
+}
+
+//
+// Writes the current scanline into _frame_buffer, then clears the line buffers for the next one:
+// * Pixels where background is fetched take the background, otherwise they are left alone 
+// * Sprites go on top, except over opaque background where only the ones in front of it do
+// This is what drawing background and then each sprite straight into _frame_buffer would give
+// Colors come from palette as of now, unless it is written after some pixels are fetched - see
+// resolve_line_colors
+//
+void nes_ppu::composite_scanline()
+{
+    // Applies to whatever ends up in the line, including pixels left alone
+    _frame_color_mode[_cur_scanline] = _color_mode;
+
+    if (!_line_has_pixels)
+        return;
+
+    // Background is only there for sprite 0 hit, which fetch_sprite has already done
+    if (!_render_frame)
+    {
+        memset(_bg_line_index, 0, sizeof(_bg_line_index));
+        _line_has_pixels = false;
+        _line_colors_resolved = false;
+        return;
+    }
+
+    uint8_t *frame_line = _frame_buffer + _cur_scanline * PPU_SCREEN_X;
+    if (_line_colors_resolved)
+    {
+        composite_line_colors(frame_line);
+        _line_colors_resolved = false;
+    }
+    else
+    {
+        update_line_palette();
+#ifdef NES_PPU_SSE2
+        composite_line_sse2(_bg_line_index, _sprite_line, _sprite_front_line, _line_palette, frame_line);
+#else
+        composite_line(_bg_line_index, _sprite_line, _sprite_front_line, _line_palette, frame_line);
+#endif
+    }
+
+    memset(_bg_line_index, 0, sizeof(_bg_line_index));
+    memset(_sprite_line, 0, sizeof(_sprite_line));
+    memset(_sprite_front_line, 0, sizeof(_sprite_front_line));
+    _line_has_pixels = false;
+}
+
+void nes_ppu::update_line_palette()
+{
+    if (_line_palette_dirty)
+    {
+        for (int i = 0; i < 0x20; ++i)
+            _line_palette[i] = get_palette_color(/* is_background = */ i < 0x10, i & 0xf);
+        _line_palette_dirty = false;
+    }
+}
+
+//
+// Palette is about to be written while the line buffers have pixels - either in the middle of a
+// scanline or after the next one is prefetched. Pixels fetched so far take their colors from the 
+// palette before the write, and the rest of the line looks colors up as they are fetched, which is
+// what drawing straight into _frame_buffer would give. Colors stay in the line buffers until 
+// composite_scanline
+//
+void nes_ppu::resolve_line_colors()
+{
+    update_line_palette();
+
+    // Pixels not fetched get a color too - composite_line_colors never looks at them
+    for (int x = 0; x < PPU_SCREEN_X; ++x)
+    {
+        _bg_line_color[x] = _line_palette[_bg_line_index[x] & PPU_BG_LINE_INDEX_MASK];
+        _sprite_line_color[x] = _line_palette[_sprite_line[x]];
+        _sprite_front_line_color[x] = _line_palette[_sprite_front_line[x]];
+    }
+
+    _line_colors_resolved = true;
+}
+
+// Same as composite_line with colors from resolve_line_colors
+void nes_ppu::composite_line_colors(uint8_t *frame_line)
+{
+    for (int x = 0; x < PPU_SCREEN_X; ++x)
+    {
+        uint8_t bg = _bg_line_index[x];
+        if (bg & PPU_BG_LINE_OPAQUE_MASK)
+        {
+            if (_sprite_front_line[x])
+                frame_line[x] = _sprite_front_line_color[x];
+            else
+                frame_line[x] = _bg_line_color[x];
+        }
+        else if (_sprite_line[x])
+            frame_line[x] = _sprite_line_color[x];
+        else if (bg & PPU_BG_LINE_FETCHED)
+            frame_line[x] = _bg_line_color[x];
+    }
+}
+
+void nes_ppu::composite_line(const uint8_t *bg_line, const uint8_t *sprite_line, const uint8_t *sprite_front_line, const uint8_t *palette, uint8_t *frame_line)
+{
+    for (int x = 0; x < PPU_SCREEN_X; ++x)
+    {
+        uint8_t bg = bg_line[x];
+        uint8_t sprite = (bg & PPU_BG_LINE_OPAQUE_MASK) ? sprite_front_line[x] : sprite_line[x];
+        if (sprite)
+            frame_line[x] = palette[sprite];
+        else if (bg & PPU_BG_LINE_FETCHED)
+            frame_line[x] = palette[bg & PPU_BG_LINE_INDEX_MASK];
+    }
+}
+
+#ifdef NES_PPU_SSE2
+void nes_ppu::composite_line_sse2(const uint8_t *bg_line, const uint8_t *sprite_line, const uint8_t *sprite_front_line, const uint8_t *palette, uint8_t *frame_line)
+{
+    // Work out the palette index for 16 pixels at a time (PPU_COMPOSITE_KEEP for pixels left alone)
+    // and then look them up. There is no byte shuffle in SSE2 for the lookup itself
+    alignas(16) uint8_t palette_index[PPU_SCREEN_X];
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i opaque_mask = _mm_set1_epi8(PPU_BG_LINE_OPAQUE_MASK);
+    const __m128i index_mask = _mm_set1_epi8(PPU_BG_LINE_INDEX_MASK);
+    const __m128i keep = _mm_set1_epi8((char)PPU_COMPOSITE_KEEP);
+    for (int x = 0; x < PPU_SCREEN_X; x += 16)
+    {
+        // PPU_BG_LINE_FETCHED is the sign bit
+        __m128i bg = _mm_loadu_si128((const __m128i *)(bg_line + x));
+        __m128i bg_fetched = _mm_cmplt_epi8(bg, zero);
+        __m128i bg_transparent = _mm_cmpeq_epi8(_mm_and_si128(bg, opaque_mask), zero);
+        bg = _mm_or_si128(_mm_and_si128(bg, index_mask), _mm_andnot_si128(bg_fetched, keep));
+
+        // pick the sprite layer that applies - 0 means no sprite
+        __m128i sprite = _mm_or_si128(
+            _mm_and_si128(bg_transparent, _mm_loadu_si128((const __m128i *)(sprite_line + x))),
+            _mm_andnot_si128(bg_transparent, _mm_loadu_si128((const __m128i *)(sprite_front_line + x))));
+        __m128i no_sprite = _mm_cmpeq_epi8(sprite, zero);
+
+        __m128i index = _mm_or_si128(_mm_and_si128(no_sprite, bg), _mm_andnot_si128(no_sprite, sprite));
+        _mm_store_si128((__m128i *)(palette_index + x), index);
+    }
+
+    for (int x = 0; x < PPU_SCREEN_X; ++x)
+    {
+        uint8_t index = palette_index[x];
+        frame_line[x] = (index == PPU_COMPOSITE_KEEP) ? frame_line[x] : palette[index];
+    }
+}
+#endif
+
+void nes_ppu::get_frame_argb(uint32_t *pixels, int pitch)
+{
+    nes_ppu *frame = completed_frame();
+    const uint8_t *frame_buffer = this->frame_buffer();
+    const uint8_t *frame_color_mode = (frame->_frame_color_mode == frame->_frame_color_mode_1) ? frame->_frame_color_mode_2 : frame->_frame_color_mode_1;
+
+    for (int y = 0; y < PPU_SCREEN_Y; ++y)
+    {
+        uint8_t color_mode = frame_color_mode[y];
+        const uint32_t *palette = _argb_palette + ((color_mode & PPUMASK_EMPHASIZE_MASK) >> PPUMASK_EMPHASIZE_SHIFT) * PPU_COLOR_COUNT;
+        uint8_t color_mask = (color_mode & PPUMASK_GRAYSCALE) ? PPU_GRAYSCALE_COLOR_MASK : PPU_COLOR_MASK;
+
+        const uint8_t *src = frame_buffer + y * PPU_SCREEN_X;
+        uint32_t *dest = (uint32_t *)((uint8_t *)pixels + y * pitch);
+        for (int x = 0; x < PPU_SCREEN_X; ++x)
+            dest[x] = palette[src[x] & color_mask];
+    }
+}
+
+//
+// NES colors in RGB, and then the same colors for each combination of PPUMASK emphasis bits - 
+// emphasizing a color darkens the other two
+// http://wiki.nesdev.com/w/index.php/PPU_palettes
+//
+void nes_ppu::init_argb_palette()
+{
+    static const uint8_t s_colors[PPU_COLOR_COUNT][3] =
+    {
+        { 84,  84,  84}, {  0,  30, 116}, {  8,  16, 144}, { 48,   0, 136}, { 68,   0, 100}, { 92,   0,  48}, { 84,   4,   0}, { 60,  24,   0}, { 32,  42,   0}, {  8,  58,   0}, {  0,  64,   0}, {  0,  60,   0}, {  0,  50,  60}, {  0,   0,   0}, {  0,   0,   0}, {  0,   0,   0},
+        {152, 150, 152}, {  8,  76, 196}, { 48,  50, 236}, { 92,  30, 228}, {136,  20, 176}, {160,  20, 100}, {152,  34,  32}, {120,  60,   0}, { 84,  90,   0}, { 40, 114,   0}, {  8, 124,   0}, {  0, 118,  40}, {  0, 102, 120}, {  0,   0,   0}, {  0,   0,   0}, {  0,   0,   0},
+        {236, 238, 236}, { 76, 154, 236}, {120, 124, 236}, {176,  98, 236}, {228,  84, 236}, {236,  88, 180}, {236, 106, 100}, {212, 136,  32}, {160, 170,   0}, {116, 196,   0}, { 76, 208,  32}, { 56, 204, 108}, { 56, 180, 204}, { 60,  60,  60}, {  0,   0,   0}, {  0,   0,   0},
+        {236, 238, 236}, {168, 204, 236}, {188, 188, 236}, {212, 178, 236}, {236, 174, 236}, {236, 174, 212}, {236, 180, 176}, {228, 196, 144}, {204, 210, 120}, {180, 222, 120}, {168, 226, 144}, {152, 226, 180}, {160, 214, 228}, {160, 162, 160}, {  0,   0,   0}, {  0,   0,   0},
+    };
+
+    for (int emphasis = 0; emphasis < 8; ++emphasis)
+    {
+        for (int color = 0; color < PPU_COLOR_COUNT; ++color)
+        {
+            // emphasis bit 0/1/2 is red/green/blue
+            uint32_t argb = 0xff000000;
+            for (int channel = 0; channel < 3; ++channel)
+            {
+                uint32_t val = s_colors[color][channel];
+                if (emphasis & ~(1 << channel))
+                    val = val * 3 / 4;
+                argb |= val << (16 - channel * 8);
+            }
+
+            _argb_palette[emphasis * PPU_COLOR_COUNT + color] = argb;
+        }
+    }
+}
+
 void nes_ppu::fetch_sprite(uint8_t sprite_id)
 {
     assert(sprite_id < PPU_ACTIVE_SPRITE_MAX);
 
+    // Without rendering the only thing that can be observed is sprite 0 hit
+    bool test_sprite_0_hit = (_has_sprite_0 && sprite_id == 0);
+    if (!_render_frame && !test_sprite_0_hit)
+        return;
+
     sprite_info *sprite = &_sprite_buf[sprite_id];
     uint8_t tile_index = sprite->tile_index;
 
@@ -417,17 +780,12 @@ void nes_ppu::fetch_sprite(uint8_t sprite_id)
     if (sprite->attr & PPU_SPRITE_ATTR_VERTICAL_FLIP)
         tile_row_index = _sprite_height - 1 - tile_row_index;
 
-    uint8_t bitplane0, bitplane1;
-    if (_use_8x16_sprite)
-    {
-        bitplane0 = read_pattern_table_column_8x16_sprite(tile_index, 0, tile_row_index);
-        bitplane1 = read_pattern_table_column_8x16_sprite(tile_index, 1, tile_row_index);
-    }
-    else
-    {
-        bitplane0 = read_pattern_table_column(/* sprite = */ true, tile_index, 0, tile_row_index);
-        bitplane1 = read_pattern_table_column(/* sprite = */ true, tile_index, 1, tile_row_index);
-    }
+    const nes_chr_row &row = _use_8x16_sprite ? 
+        read_pattern_table_row_8x16_sprite(tile_index, tile_row_index) : 
+        read_pattern_table_row(/* sprite = */ true, tile_index, tile_row_index);
+
+    // pixels are always written high -> low - use the flipped row for horizontal flip
+    uint16_t pixels = (sprite->attr & PPU_SPRITE_ATTR_HORIZONTAL_FLIP) ? row.flipped_pixels : row.pixels;
 
     // bit3/2 is shared for the entire sprite (just like background attribute table)
     uint8_t palette_index_bit32 = (sprite->attr & PPU_SPRITE_ATTR_BIT32_MASK) << 2;
@@ -435,8 +793,7 @@ void nes_ppu::fetch_sprite(uint8_t sprite_id)
     // loop all bits - high -> low
     for (int i = 7; i >= 0; --i)
     {
-        uint8_t column_mask = 1 << i;
-        uint8_t palette_index_bit01 = ((bitplane1 & column_mask) >> i << 1) | ((bitplane0 & column_mask) >> i);
+        uint8_t palette_index_bit01 = (pixels >> (i * 2)) & 0x3;
 
         // palette 0 is always background
         if (palette_index_bit01 == 0)
@@ -444,56 +801,73 @@ void nes_ppu::fetch_sprite(uint8_t sprite_id)
 
         uint8_t palette_index = palette_index_bit32 | palette_index_bit01;
 
-        uint8_t color = get_palette_color(/* is_background = */false, palette_index);
-        uint16_t frame_addr = _cur_scanline * PPU_SCREEN_X + sprite->pos_x;
-        if (sprite->attr & PPU_SPRITE_ATTR_HORIZONTAL_FLIP)
-            frame_addr += i;     // low -> high in horizontal flip
-        else
-            frame_addr += 7 - i; // high -> low as usual
+        int x = sprite->pos_x + 7 - i;
 
-        if (frame_addr >= sizeof(_frame_buffer_1))
+        if (x >= PPU_SCREEN_X)
         {
             // part of the sprite might be over
             continue;
         }
 
-        bool is_sprite_0 = (_has_sprite_0 && sprite_id == 0);
-        bool behind_bg = sprite->attr & PPU_SPRITE_ATTR_BEHIND_BG;
-        if (behind_bg || is_sprite_0)
-        {
-            // use the recorded 2-bit palette index for sprite 0 hit detection
-            // don't use the actual color as some times game use all 0f 'black' palette to black out screen
-            bool overlap = (_frame_buffer_bg[frame_addr] != 0);
-            if (overlap)
-            {
-                if (is_sprite_0)
-                {
-                    // sprite 0 hit detection
-                    _sprite_0_hit = true;
-                }
+        // use the recorded 2-bit palette index for sprite 0 hit detection
+        // don't use the actual color as some times game use all 0f 'black' palette to black out screen
+        if (test_sprite_0_hit && (_bg_line_index[x] & PPU_BG_LINE_OPAQUE_MASK))
+            _sprite_0_hit = true;
 
-                if (behind_bg)
-                {
-                    // behind background
-                    continue;
-                }
-             }
-        }
+        if (!_render_frame)
+            continue;
+
+        // Later sprites overwrite earlier ones - whether background wins is decided in composite_scanline
+        _sprite_line[x] = PPU_SPRITE_LINE_PALETTE | palette_index;
+        _line_has_pixels = true;
+        if (!(sprite->attr & PPU_SPRITE_ATTR_BEHIND_BG))
+            _sprite_front_line[x] = PPU_SPRITE_LINE_PALETTE | palette_index;
 
-        _frame_buffer[frame_addr] = color;
+        if (_line_colors_resolved)
+        {
+            uint8_t color = get_palette_color(/* is_background = */ false, palette_index);
+            _sprite_line_color[x] = color;
+            if (!(sprite->attr & PPU_SPRITE_ATTR_BEHIND_BG))
+                _sprite_front_line_color[x] = color;
+        }
     }
 }
 
 void nes_ppu::step_to(nes_cycle_t count)
 {
-    while (_master_cycle < count && !_system->stop_requested())
+    // Copies for deferred rendering don't have a system
+    while (_master_cycle < count && !(_system && _system->stop_requested()))
     {     
+        // Take the rest of the scanline in one go if it fits - see render_scanline
+        if (_scanline_renderer_enabled && _scanline_cycle == nes_ppu_cycle_t(0) && count - _master_cycle >= nes_ppu_cycle_t(340))
+        {
+            if (_cur_scanline < PPU_SCREEN_Y)
+            {
+                render_scanline();
+                if (_deferred_render_enabled)
+                    step_deferred_render();
+                continue;
+            }
+
+            // Nothing happens in these scanlines - 241 has VBlank and 260 has the VBlank @HACK below
+            if (_cur_scanline == 240 || (_cur_scanline > 241 && _cur_scanline < 260))
+            {
+                _master_cycle += nes_ppu_cycle_t(340);
+                _scanline_cycle = nes_ppu_cycle_t(340);
+                continue;
+            }
+        }
+
         step_ppu(nes_ppu_cycle_t(1));
 
         if (_cur_scanline <= 239)
         {
             fetch_tile_pipeline();
             fetch_sprite_pipeline();
+
+            // All sprites are fetched and next scanline's prefetch is about to go into line buffers
+            if (_scanline_cycle == nes_ppu_cycle_t(320))
+                composite_scanline();
         }
         else if (_cur_scanline == 240)
         {
@@ -545,6 +919,332 @@ void nes_ppu::step_to(nes_cycle_t count)
                 step_ppu(nes_ppu_cycle_t(1));
             }
         }
+
+        if (_deferred_render_enabled)
+            step_deferred_render();
+    }
+}
+
+void nes_ppu::enable_deferred_render(bool enable)
+{
+    _deferred_render_enabled = enable;
+    if (enable)
+        create_deferred_frames();
+    discard_deferred_frames();
+}
+
+void nes_ppu::enable_parallel_render(bool enable, uint32_t thread_count)
+{
+    if (thread_count == 0)
+        thread_count = max(thread::hardware_concurrency(), 1u);
+
+    stop_render_threads();
+    _render_band_count = enable ? min(thread_count, uint32_t(PPU_RENDER_BAND_MAX)) : 1;
+    start_render_threads(_render_band_count - 1);
+
+    if (_recording_frame)
+        create_deferred_frames();
+    discard_deferred_frames();
+}
+
+void nes_ppu::create_deferred_frames()
+{
+    if (!_recording_frame)
+    {
+        _recording_frame = make_unique<nes_ppu>();
+        _completed_frame = make_unique<nes_ppu>();
+    }
+
+    for (nes_ppu *frame : { _recording_frame.get(), _completed_frame.get() })
+    {
+        frame->_bands.resize(_render_band_count - 1);
+        for (auto &band : frame->_bands)
+        {
+            if (!band)
+                band = make_unique<nes_ppu>();
+        }
+
+        for (uint32_t band = 0; band < _render_band_count; ++band)
+        {
+            nes_ppu *band_ppu = (band == 0) ? frame : frame->_bands[band - 1].get();
+            memset(band_ppu->_frame_buffer_1, 0, sizeof(band_ppu->_frame_buffer_1));
+            memset(band_ppu->_frame_color_mode_1, 0, sizeof(band_ppu->_frame_color_mode_1));
+        }
+    }
+}
+
+void nes_ppu::discard_deferred_frames()
+{
+    if (!_recording_frame)
+        return;
+
+    _recording_frame->_log_valid = false;
+    _completed_frame->_log_valid = false;
+}
+
+//
+// Called at the start of every scanline - takes the copies at the start of the frame and each band
+//
+void nes_ppu::step_deferred_render()
+{
+    if (_scanline_cycle != nes_ppu_cycle_t(0))
+        return;
+
+    if (_cur_scanline == 0)
+    {
+        start_deferred_frame();
+        return;
+    }
+
+    if (_cur_scanline >= PPU_SCREEN_Y || !_recording_frame->_log_valid)
+        return;
+
+    for (uint32_t band = 1; band < _render_band_count; ++band)
+    {
+        if (_cur_scanline == band_first_line(band) - 1)
+            _recording_frame->_bands[band - 1]->copy_frame_state(*this);
+    }
+}
+
+//
+// Frame just completed - the one being recorded is now the completed one, and the next frame is
+// recorded starting from a copy of the current state
+//
+void nes_ppu::start_deferred_frame()
+{
+    swap(_recording_frame, _completed_frame);
+
+    _recording_frame->copy_frame_state(*this);
+    _recording_frame->_log.clear();
+    _recording_frame->_log_data.clear();
+    _recording_frame->_log_valid = true;
+    _recording_frame->_log_rendered = false;
+}
+
+//
+// Copies everything that affects rendering from ppu. Pattern table pages mapped to CHR RAM and 
+// name tables point to our own copy, while CHR ROM is shared
+//
+void nes_ppu::copy_frame_state(const nes_ppu &ppu)
+{
+    _system = nullptr;
+
+    memcpy(_vram.get(), ppu._vram.get(), PPU_NAME_TBL_ADDR + PPU_NAME_TBL_SIZE * PPU_NAME_TBL_COUNT);
+    memcpy(_chr_ram_rows.get(), ppu._chr_ram_rows.get(), sizeof(nes_chr_row) * PPU_PATTERN_TABLE_SIZE / 2);
+    for (int page = 0; page < PPU_CHR_PAGE_COUNT; ++page)
+    {
+        if (ppu._chr_write_pages[page])
+        {
+            _chr_pages[page] = _vram.get() + (ppu._chr_pages[page] - ppu._vram.get());
+            _chr_write_pages[page] = _vram.get() + (ppu._chr_write_pages[page] - ppu._vram.get());
+            _chr_row_pages[page] = _chr_ram_rows.get() + (ppu._chr_row_pages[page] - ppu._chr_ram_rows.get());
+        }
+        else
+        {
+            _chr_pages[page] = ppu._chr_pages[page];
+            _chr_write_pages[page] = nullptr;
+            _chr_row_pages[page] = ppu._chr_row_pages[page];
+        }
+    }
+    for (int i = 0; i < PPU_NAME_TBL_COUNT; ++i)
+        _name_tbl_pages[i] = _vram.get() + (ppu._name_tbl_pages[i] - ppu._vram.get());
+    memcpy(_oam.get(), ppu._oam.get(), PPU_OAM_SIZE);
+    memcpy(_palette, ppu._palette, sizeof(_palette));
+
+    // registers
+    _name_tbl_addr = ppu._name_tbl_addr;
+    _bg_pattern_tbl_addr = ppu._bg_pattern_tbl_addr;
+    _sprite_pattern_tbl_addr = ppu._sprite_pattern_tbl_addr;
+    _ppu_addr_inc = ppu._ppu_addr_inc;
+    _vblank_nmi = ppu._vblank_nmi;
+    _use_8x16_sprite = ppu._use_8x16_sprite;
+    _sprite_height = ppu._sprite_height;
+    _show_bg = ppu._show_bg;
+    _show_sprites = ppu._show_sprites;
+    _gray_scale_mode = ppu._gray_scale_mode;
+    _color_mode = ppu._color_mode;
+    _latch = ppu._latch;
+    _sprite_overflow = ppu._sprite_overflow;
+    _vblank_started = ppu._vblank_started;
+    _sprite_0_hit = ppu._sprite_0_hit;
+    _oam_addr = ppu._oam_addr;
+    _addr_toggle = ppu._addr_toggle;
+    _ppu_addr = ppu._ppu_addr;
+    _temp_ppu_addr = ppu._temp_ppu_addr;
+    _fine_x_scroll = ppu._fine_x_scroll;
+    _scroll_y = ppu._scroll_y;
+    _vram_read_buf = ppu._vram_read_buf;
+
+    _master_cycle = ppu._master_cycle;
+    _scanline_cycle = ppu._scanline_cycle;
+    _cur_scanline = ppu._cur_scanline;
+    _frame_count = ppu._frame_count;
+    _protect_register = false;
+    _auto_stop = false;
+
+    // rendering states - always render into _frame_buffer_1 (see replay_frame_log)
+    _tile_index = ppu._tile_index;
+    _tile_palette_bit32 = ppu._tile_palette_bit32;
+    _tile_row = ppu._tile_row;
+    _frame_buffer = _frame_buffer_1;
+    _frame_color_mode = _frame_color_mode_1;
+    memcpy(_bg_line_index, ppu._bg_line_index, sizeof(_bg_line_index));
+    memcpy(_sprite_line, ppu._sprite_line, sizeof(_sprite_line));
+    memcpy(_sprite_front_line, ppu._sprite_front_line, sizeof(_sprite_front_line));
+    _line_has_pixels = ppu._line_has_pixels;
+    _line_palette_dirty = true;
+    _line_colors_resolved = ppu._line_colors_resolved;
+    memcpy(_bg_line_color, ppu._bg_line_color, sizeof(_bg_line_color));
+    memcpy(_sprite_line_color, ppu._sprite_line_color, sizeof(_sprite_line_color));
+    memcpy(_sprite_front_line_color, ppu._sprite_front_line_color, sizeof(_sprite_front_line_color));
+    _shift_reg = ppu._shift_reg;
+    _x_offset = ppu._x_offset;
+
+    memcpy(_sprite_buf, ppu._sprite_buf, sizeof(_sprite_buf));
+    _last_sprite_id = ppu._last_sprite_id;
+    _has_sprite_0 = ppu._has_sprite_0;
+    _mask_oam_read = ppu._mask_oam_read;
+    _sprite_pos_y = ppu._sprite_pos_y;
+    _sprite_buckets_dirty = true;
+
+    _scanline_renderer_enabled = ppu._scanline_renderer_enabled;
+    _render_frame = true;
+}
+
+//
+// Renders scanlines up to end_line from the state copied into this PPU (at the start of the frame 
+// or one scanline before a band), applying each op in frame's log at the cycle it happened. Lines
+// go into _frame_buffer_1. Pixels the frame doesn't draw are left from the last frame rendered 
+// here, which is 2 frames earlier if every frame is rendered - the same as the double buffering 
+// without deferred rendering
+//
+void nes_ppu::replay_frame_log(const nes_ppu &frame, int end_line)
+{
+    assert(frame._log_valid && !frame._log_rendered);
+    assert(_scanline_cycle == nes_ppu_cycle_t(0));
+
+    nes_cycle_t end = _master_cycle + nes_ppu_cycle_t(PPU_SCANLINE_CYCLE * (end_line - _cur_scanline));
+    auto entry = lower_bound(frame._log.begin(), frame._log.end(), _master_cycle, 
+        [](const nes_ppu_log_entry &log_entry, nes_cycle_t cycle) { return log_entry.cycle < cycle; });
+    for (; entry != frame._log.end() && entry->cycle < end; ++entry)
+    {
+        step_to(entry->cycle);
+
+        switch (entry->op)
+        {
+        case nes_ppu_log_op_write_PPUCTRL: write_PPUCTRL(entry->val); break;
+        case nes_ppu_log_op_write_PPUMASK: write_PPUMASK(entry->val); break;
+        case nes_ppu_log_op_read_PPUSTATUS: read_PPUSTATUS(); break;
+        case nes_ppu_log_op_write_OAMADDR: write_OAMADDR(entry->val); break;
+        case nes_ppu_log_op_write_OAMDATA: write_OAMDATA(entry->val); break;
+        case nes_ppu_log_op_write_PPUSCROLL: write_PPUSCROLL(entry->val); break;
+        case nes_ppu_log_op_write_PPUADDR: write_PPUADDR(entry->val); break;
+        case nes_ppu_log_op_write_PPUDATA: write_PPUDATA(entry->val); break;
+        case nes_ppu_log_op_read_PPUDATA: read_PPUDATA(); break;
+        case nes_ppu_log_op_oam_dma:
+            memcpy(_oam.get(), frame._log_data.data() + entry->offset, PPU_OAM_SIZE);
+            _sprite_buckets_dirty = true;
+            break;
+        case nes_ppu_log_op_map_chr: map_chr(entry->addr, *entry->chr_rom, entry->offset, entry->size); break;
+        case nes_ppu_log_op_set_mirroring: set_mirroring(nes_mapper_flags(entry->val)); break;
+        default: assert(!"Unknown PPU log op");
+        }
+    }
+
+    step_to(end);
+}
+
+//
+// Renders band 0 here while _render_threads take the other bands, and then puts the bands together
+// in frame's _frame_buffer_1 which becomes the completed buffer
+//
+void nes_ppu::render_deferred_frame(nes_ppu &frame)
+{
+    uint32_t band_count = uint32_t(frame._bands.size()) + 1;
+    assert(band_count == _render_band_count);
+
+    if (band_count > 1)
+    {
+        lock_guard<mutex> lock(_render_mutex);
+        _render_job = &frame;
+        _render_pending = band_count - 1;
+        _render_generation++;
+        _render_start.notify_all();
+    }
+
+    frame.replay_frame_log(frame, band_first_line(1));
+
+    if (band_count > 1)
+    {
+        unique_lock<mutex> lock(_render_mutex);
+        _render_done.wait(lock, [this] { return _render_pending == 0; });
+        _render_job = nullptr;
+    }
+
+    for (uint32_t band = 1; band < band_count; ++band)
+    {
+        const nes_ppu &band_ppu = *frame._bands[band - 1];
+        int first_line = band_first_line(band);
+        int end_line = band_first_line(band + 1);
+        memcpy(frame._frame_buffer_1 + first_line * PPU_SCREEN_X, band_ppu._frame_buffer_1 + first_line * PPU_SCREEN_X, (end_line - first_line) * PPU_SCREEN_X);
+        memcpy(frame._frame_color_mode_1 + first_line, band_ppu._frame_color_mode_1 + first_line, end_line - first_line);
+    }
+
+    frame.swap_buffer();
+    frame._log_rendered = true;
+}
+
+nes_ppu *nes_ppu::completed_frame()
+{
+    if (!_deferred_render_enabled || !_completed_frame->_log_valid)
+        return this;
+
+    if (!_completed_frame->_log_rendered)
+        render_deferred_frame(*_completed_frame);
+
+    return _completed_frame.get();
+}
+
+void nes_ppu::start_render_threads(uint32_t count)
+{
+    _render_threads_exit = false;
+    for (uint32_t i = 0; i < count; ++i)
+        _render_threads.emplace_back(&nes_ppu::render_thread, this, i + 1, _render_generation);
+}
+
+void nes_ppu::stop_render_threads()
+{
+    {
+        lock_guard<mutex> lock(_render_mutex);
+        _render_threads_exit = true;
+        _render_start.notify_all();
+    }
+
+    for (auto &render_thread : _render_threads)
+        render_thread.join();
+    _render_threads.clear();
+}
+
+void nes_ppu::render_thread(uint32_t band, uint32_t generation)
+{
+    for (;;)
+    {
+        nes_ppu *frame;
+        {
+            unique_lock<mutex> lock(_render_mutex);
+            _render_start.wait(lock, [&] { return _render_threads_exit || _render_generation != generation; });
+            if (_render_threads_exit)
+                return;
+
+            generation = _render_generation;
+            frame = _render_job;
+        }
+
+        frame->_bands[band - 1]->replay_frame_log(*frame, band_first_line(band + 1));
+
+        lock_guard<mutex> lock(_render_mutex);
+        if (--_render_pending == 0)
+            _render_done.notify_one();
     }
 }
 
@@ -562,8 +1262,12 @@ void nes_ppu::step_ppu(nes_ppu_cycle_t count)
         if (_cur_scanline >= PPU_SCANLINE_COUNT)
         {
             _cur_scanline %= PPU_SCANLINE_COUNT;
-            swap_buffer();
+
+            // A frame that wasn't rendered leaves frame_buffer showing the last one that was
+            if (_render_frame)
+                swap_buffer();
             _frame_count++;
+            _render_frame = _frame_render_enabled && !_deferred_render_enabled;
             NES_TRACE4("[NES_PPU] FRAME " << std::dec << _frame_count << " ------ ");
 
             if (_auto_stop && _frame_count > _stop_after_frame)
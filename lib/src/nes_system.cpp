@@ -3,6 +3,7 @@
 #include "nes_cpu.h"
 #include "nes_system.h"
 #include "nes_ppu.h"
+#include "nes_apu.h"
 
 using namespace std;
 
@@ -11,11 +12,13 @@ nes_system::nes_system()
     _ram = make_unique<nes_memory>();
     _cpu = make_unique<nes_cpu>();
     _ppu = make_unique<nes_ppu>();
+    _apu = make_unique<nes_apu>();
     _input = make_unique<nes_input>();
 
     _components.push_back(_ram.get());
     _components.push_back(_cpu.get());
     _components.push_back(_ppu.get());
+    _components.push_back(_apu.get());
     _components.push_back(_input.get());
 }
                          
@@ -79,10 +82,9 @@ void nes_system::run_rom(const char *rom_path, nes_rom_exec_mode mode)
 
 void nes_system::test_loop()
 {
-    auto tick = nes_cycle_t(1);
     while (!_stop_requested)
     {
-        step(tick);
+        run_frame();
     }
 }
 
@@ -95,5 +97,24 @@ void nes_system::step(nes_cycle_t count)
     // first place. Such as ram / controller, etc. 
     _cpu->step_to(_master_cycle);
     _ppu->step_to(_master_cycle);
+    _apu->step_to(_master_cycle);
+}
+    
+
+void nes_system::run_until(nes_cycle_t target)
+{
+    // target is usually computed from PPU cycle, which can be one cycle ahead of ours after PPU skips
+    // the last cycle of an odd frame
+    if (target > _master_cycle)
+        step(target - _master_cycle);
+}
+
+void nes_system::run_frame()
+{
+    run_until(_ppu->master_cycle() + _ppu->cycles_until(/* scanline = */ 0, /* cycle = */ 0));
+}
+
+void nes_system::run_until_vblank()
+{
+    run_until(_ppu->master_cycle() + _ppu->cycles_until(/* scanline = */ 241, /* cycle = */ 1));
 }
-    
\ No newline at end of file
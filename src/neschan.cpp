@@ -4,16 +4,20 @@
 #include "stdafx.h"
 #include "neschan.h"
 #include <iostream>
+#include <atomic>
+#include <thread>
+#include <chrono>
 
 using namespace std;
 
-uint32_t make_argb(uint8_t r, uint8_t g, uint8_t b)
-{
-    return (r << 16) | (g << 8) | b;
-}
-
 #define JOYSTICK_DEADZONE 8000
 
+// ~93ms at 44.1KHz - rate control keeps it around half full, which is a couple of callbacks
+#define AUDIO_RING_SAMPLES 4096
+
+// Samples per SDL audio callback
+#define AUDIO_CALLBACK_SAMPLES 1024
+
 class neschan_exception : runtime_error 
 {
 public :
@@ -22,16 +26,41 @@ public :
     {}
 };
 
-class sdl_keyboard_controller : public nes_input_device
+//
+// SDL input can only be read from the main thread (where events are pumped) while the emulation
+// thread polls the controllers. The main thread takes a snapshot of the buttons every loop in update()
+// and the emulation thread simply reads the latest one
+//
+class sdl_input_device : public nes_input_device
+{
+public :
+    sdl_input_device()
+        :_status(nes_button_flags_none)
+    {
+    }
+
+    virtual nes_button_flags poll_status()
+    {
+        return _status.load(memory_order_relaxed);
+    }
+
+    // main thread only
+    virtual void update() = 0;
+
+protected :
+    atomic<nes_button_flags> _status;
+};
+
+class sdl_keyboard_controller : public sdl_input_device
 {
 public:
     sdl_keyboard_controller()
     {
     }
 
-    virtual nes_button_flags poll_status()
+    virtual void update()
     {
-        return sdl_keyboard_controller::get_status();
+        _status.store(sdl_keyboard_controller::get_status(), memory_order_relaxed);
     }
 
     ~sdl_keyboard_controller()
@@ -69,7 +98,7 @@ const SDL_Scancode sdl_keyboard_controller::s_buttons[] = {
     SDL_SCANCODE_D
 };
 
-class sdl_game_controller : public nes_input_device
+class sdl_game_controller : public sdl_input_device
 {
 public :
     sdl_game_controller(int id)
@@ -93,7 +122,7 @@ public :
         SDL_GameControllerEventState(SDL_DISABLE);
     }
 
-    virtual nes_button_flags poll_status()
+    virtual void update()
     {
         SDL_GameControllerUpdate();
 
@@ -110,7 +139,7 @@ public :
             flags |= sdl_keyboard_controller::get_status();
         }
 
-        return (nes_button_flags)flags;
+        _status.store((nes_button_flags)flags, memory_order_relaxed);
     }
 
     ~sdl_game_controller()
@@ -138,6 +167,148 @@ const SDL_GameControllerButton sdl_game_controller::s_buttons[] = {
     SDL_CONTROLLER_BUTTON_DPAD_RIGHT
 };
 
+//
+// Hands completed frames from the emulation thread to the main thread without locking. There are
+// 3 buffers - one being written (back), one being presented (front), and the latest completed one 
+// in the middle. Publishing and taking a frame each swap their own buffer with the middle one 
+// atomically, so neither side ever waits and the reader always gets the newest frame. Frames 
+// carry a sequence number so that the reader knows whether there is anything new
+//
+class frame_triple_buffer
+{
+public :
+    frame_triple_buffer()
+        :_middle(1), _back(0), _front(2)
+    {
+        for (auto &buffer : _buffers)
+        {
+            buffer.pixels.resize(PPU_SCREEN_X * PPU_SCREEN_Y);
+            buffer.seq = 0;
+        }
+    }
+
+    //
+    // Writer (emulation thread)
+    //
+    uint32_t *back_buffer() { return _buffers[_back].pixels.data(); }
+
+    void publish(uint32_t seq)
+    {
+        _buffers[_back].seq = seq;
+        _back = _middle.exchange(_back | FRAME_NEW_BIT, memory_order_acq_rel) & FRAME_INDEX_MASK;
+    }
+
+    //
+    // Reader (main thread)
+    // Takes the newest frame if there is one published since the last call
+    //
+    bool take_front()
+    {
+        if (!(_middle.load(memory_order_relaxed) & FRAME_NEW_BIT))
+            return false;
+
+        _front = _middle.exchange(_front, memory_order_acq_rel) & FRAME_INDEX_MASK;
+        return true;
+    }
+
+    const uint32_t *front_buffer() { return _buffers[_front].pixels.data(); }
+    uint32_t front_seq() { return _buffers[_front].seq; }
+
+private :
+    static const uint32_t FRAME_INDEX_MASK = 0x3;
+    static const uint32_t FRAME_NEW_BIT = 0x4;
+
+    struct frame
+    {
+        vector<uint32_t> pixels;
+        uint32_t seq;                   // PPU frame count
+    };
+
+    frame _buffers[3];
+    atomic<uint32_t> _middle;           // index of the middle buffer | FRAME_NEW_BIT if not taken yet
+    uint32_t _back;                     // only touched by the writer
+    uint32_t _front;                    // only touched by the reader
+};
+
+//
+// Moves the samples APU has produced into the audio ring. They are read straight into the ring's
+// free space, and anything that still doesn't fit is dropped (and counted) by the ring
+//
+void write_audio(nes_apu *apu, nes_audio_ring *audio, vector<int16_t> &overflow)
+{
+    nes_audio_span spans[2];
+    audio->get_write_spans(spans);
+
+    size_t written = 0;
+    for (auto &span : spans)
+        written += apu->read_samples(span.data, (int)span.size);
+    audio->commit_write(written);
+
+    int remaining = apu->samples_avail();
+    if (remaining > 0)
+    {
+        overflow.resize(remaining);
+        apu->read_samples(overflow.data(), remaining);
+        audio->write(overflow.data(), remaining);
+    }
+}
+
+//
+// SDL audio thread - never blocks on emulation. Runs dry with silence
+//
+void read_audio(void *userdata, Uint8 *stream, int len)
+{
+    auto audio = reinterpret_cast<nes_audio_ring *>(userdata);
+    audio->read(reinterpret_cast<int16_t *>(stream), len / sizeof(int16_t));
+}
+
+//
+// Runs the NES in real time and publishes every completed frame - on its own thread so that 
+// presenting (which may block on vsync) never slows down emulation
+//
+void run_emulation(nes_system *system, frame_triple_buffer *frames, nes_audio_ring *audio, nes_audio_rate_control *audio_rate, atomic<bool> *quit)
+{
+    vector<int16_t> audio_overflow;
+    Uint64 prev_counter = SDL_GetPerformanceCounter();
+    Uint64 count_per_second = SDL_GetPerformanceFrequency();
+    uint32_t published_frame_count = system->ppu()->frame_count();
+
+    while (!quit->load(memory_order_relaxed))
+    {
+        // 
+        // Calculate delta tick as the current frame
+        // We ask the NES to step corresponding CPU cycles
+        //
+        Uint64 cur_counter = SDL_GetPerformanceCounter();
+
+        Uint64 delta_ticks = cur_counter - prev_counter;
+        prev_counter = cur_counter;
+        if (delta_ticks == 0)
+            delta_ticks = 1;
+        auto cpu_cycles = ms_to_nes_cycle((double)delta_ticks * 1000 / count_per_second);
+
+        // Avoids a scenario where the loop keeps getting longer
+        if (cpu_cycles > nes_cycle_t(NES_CLOCK_HZ))
+            cpu_cycles = nes_cycle_t(NES_CLOCK_HZ);
+
+        system->run_cycles(cpu_cycles);
+
+        system->apu()->set_resample_ratio(audio_rate->update());
+        write_audio(system->apu(), audio, audio_overflow);
+
+        // Only the last completed frame is available from PPU, and that's all we need
+        if (system->ppu()->frame_count() != published_frame_count)
+        {
+            published_frame_count = system->ppu()->frame_count();
+            system->ppu()->get_frame_argb(frames->back_buffer(), PPU_SCREEN_X * sizeof(uint32_t));
+            frames->publish(published_frame_count);
+        }
+
+        // A frame is ~16ms - no point spinning for a handful of cycles at a time
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+}
+
 int main(int argc, char *argv[])
 {
     // Initialize SDL with everything (video, audio, joystick, events, etc)
@@ -197,98 +368,104 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    vector<uint32_t> pixels(PPU_SCREEN_Y * PPU_SCREEN_X);
-
-    static uint32_t palette[] = 
-    {
-        make_argb(84,  84,  84),    make_argb(0,  30, 116),    make_argb(8,  16, 144),    make_argb(48,   0, 136),   make_argb(68,   0, 100),   make_argb(92,   0,  48),   make_argb(84,   4,   0),   make_argb(60,  24,   0),   make_argb(32,  42,   0),   make_argb(8,  58,   0),   make_argb(0,  64,   0),    make_argb(0,  60,   0),    make_argb(0,  50,  60),    make_argb(0,   0,   0),   make_argb(0, 0, 0), make_argb(0, 0, 0),
-        make_argb(152, 150, 152),   make_argb(8,  76, 196),    make_argb(48,  50, 236),   make_argb(92,  30, 228),   make_argb(136,  20, 176),  make_argb(160,  20, 100),  make_argb(152,  34,  32),  make_argb(120,  60,   0),  make_argb(84,  90,   0),   make_argb(40, 114,   0),  make_argb(8, 124,   0),    make_argb(0, 118,  40),    make_argb(0, 102, 120),    make_argb(0,   0,   0),   make_argb(0, 0, 0), make_argb(0, 0, 0),
-        make_argb(236, 238, 236),   make_argb(76, 154, 236),   make_argb(120, 124, 236),  make_argb(176,  98, 236),  make_argb(228,  84, 236),  make_argb(236,  88, 180),  make_argb(236, 106, 100),  make_argb(212, 136,  32),  make_argb(160, 170,   0),  make_argb(116, 196,   0), make_argb(76, 208,  32),   make_argb(56, 204, 108),   make_argb(56, 180, 204),   make_argb(60,  60,  60),  make_argb(0, 0, 0), make_argb(0, 0, 0),
-        make_argb(236, 238, 236),   make_argb(168, 204, 236),  make_argb(188, 188, 236),  make_argb(212, 178, 236),  make_argb(236, 174, 236),  make_argb(236, 174, 212),  make_argb(236, 180, 176),  make_argb(228, 196, 144),  make_argb(204, 210, 120),  make_argb(180, 222, 120), make_argb(168, 226, 144),  make_argb(152, 226, 180),  make_argb(160, 214, 228),  make_argb(160, 162, 160), make_argb(0, 0, 0), make_argb(0, 0, 0)
-    };
-    assert(sizeof(palette) == sizeof(uint32_t) * 0x40);
-
+    vector<shared_ptr<sdl_input_device>> inputs;
     int num_joysticks = SDL_NumJoysticks();
     NES_LOG("[NESCHAN] " << num_joysticks << " JoySticks detected.");
     if (num_joysticks == 0)
     {
-        system.input()->register_input(0, std::make_shared<sdl_keyboard_controller>());
+        inputs.push_back(std::make_shared<sdl_keyboard_controller>());
     }
     else
     {
         for (int i = 0; i < num_joysticks; i++)
         {
             if (i < NES_MAX_PLAYER)
-                system.input()->register_input(i, std::make_shared<sdl_game_controller>(i));
+                inputs.push_back(std::make_shared<sdl_game_controller>(i));
         }
     }
 
-    SDL_Event sdl_event;
-    Uint64 prev_counter = SDL_GetPerformanceCounter();
-    Uint64 count_per_second = SDL_GetPerformanceFrequency();
+    for (size_t i = 0; i < inputs.size(); ++i)
+        system.input()->register_input((int)i, inputs[i]);
 
     //
-    // Game main loop
+    // From here on the emulation thread owns system - the main thread only does SDL
     //
-    bool quit = false;
-    while (!quit)
+    frame_triple_buffer frames;
+    nes_audio_ring audio(AUDIO_RING_SAMPLES);
+    nes_audio_rate_control audio_rate(&audio);
+    atomic<bool> quit(false);
+    int sample_rate = system.apu()->sample_rate();
+    thread emulation_thread(run_emulation, &system, &frames, &audio, &audio_rate, &quit);
+
+    //
+    // SDL pulls 16-bit mono samples from the audio ring on its own thread. SDL converts if the 
+    // device wants something else. No audio device isn't fatal
+    //
+    SDL_AudioSpec audio_spec = {};
+    audio_spec.freq = sample_rate;
+    audio_spec.format = AUDIO_S16SYS;
+    audio_spec.channels = 1;
+    audio_spec.samples = AUDIO_CALLBACK_SAMPLES;
+    audio_spec.callback = read_audio;
+    audio_spec.userdata = &audio;
+
+    SDL_AudioDeviceID audio_device = SDL_OpenAudioDevice(NULL, 0, &audio_spec, NULL, 0);
+    if (audio_device == 0)
+    {
+        NES_LOG("[NESCHAN] Failed to open audio device:" << SDL_GetError());
+    }
+    else
+    {
+        SDL_PauseAudioDevice(audio_device, 0);
+    }
+
+    //
+    // Main loop
+    //
+    SDL_Event sdl_event;
+    while (!quit.load(memory_order_relaxed))
     {
         while (SDL_PollEvent(&sdl_event) != 0)
         {
             switch (sdl_event.type)
             {
                 case SDL_QUIT:
-                    quit = true;
+                    quit.store(true, memory_order_relaxed);
                     break;
             }
         }
 
-        // 
-        // Calculate delta tick as the current frame
-        // We ask the NES to step corresponding CPU cycles
-        //
-        Uint64 cur_counter = SDL_GetPerformanceCounter();
-
-        Uint64 delta_ticks = cur_counter - prev_counter;
-        prev_counter = cur_counter;
-        if (delta_ticks == 0)
-            delta_ticks = 1;
-        auto cpu_cycles = ms_to_nes_cycle((double)delta_ticks * 1000 / count_per_second);
-
-        // Avoids a scenario where the loop keeps getting longer
-        if (cpu_cycles > nes_cycle_t(NES_CLOCK_HZ))
-            cpu_cycles = nes_cycle_t(NES_CLOCK_HZ);
-
-        for (nes_cycle_t i = nes_cycle_t(0); i < cpu_cycles; ++i)
-            system.step(nes_cycle_t(1));
+        for (auto &input : inputs)
+            input->update();
 
         //
-        // Copy frame buffer to our texture
-        // @TODO - Handle this buffer directly to PPU
+        // Present the newest frame if there is one. Otherwise wait a bit - the texture still has 
+        // the last frame and there is nothing to present
         //
-        uint32_t *cur_pixel = pixels.data();
-        uint8_t *frame_buffer = system.ppu()->frame_buffer();
-        for (int y = 0; y < PPU_SCREEN_Y; ++y)
+        if (!frames.take_front())
         {
-            for (int x = 0; x < PPU_SCREEN_X; ++x)
-            {
-                *cur_pixel = palette[(*frame_buffer & 0xff)];
-                frame_buffer++;
-                cur_pixel++;
-            }
+            SDL_Delay(1);
+            continue;
         }
 
-        //
-        // Render
-        //
-        SDL_UpdateTexture(sdl_texture, NULL, pixels.data(), PPU_SCREEN_X * sizeof(uint32_t));
+        SDL_UpdateTexture(sdl_texture, NULL, frames.front_buffer(), PPU_SCREEN_X * sizeof(uint32_t));
         SDL_RenderClear(sdl_renderer);
         SDL_RenderCopy(sdl_renderer, sdl_texture, NULL, NULL);
         SDL_RenderPresent(sdl_renderer);
     }
 
+    if (audio_device != 0)
+        SDL_CloseAudioDevice(audio_device);
+
+    emulation_thread.join();
+
+    NES_LOG("[NESCHAN] Audio underrun samples = " << std::dec << audio.underrun_samples() << 
+            ", overrun samples = " << audio.overrun_samples() << 
+            ", fill level = " << audio_rate.fill_level() << ", rate ratio = " << audio_rate.ratio());
+
     // Unregister all inputs and free the game controllers
     system.input()->unregister_all_inputs();
+    inputs.clear();
 
     SDL_DestroyRenderer(sdl_renderer);
     SDL_DestroyTexture(sdl_texture);
@@ -26,6 +26,7 @@
 #include <nes_system.h>
 #include <nes_ppu.h>
 #include <nes_cpu.h>
+#include <nes_apu.h>
 #include <nes_input.h>
 #include <nes_trace.h>
 
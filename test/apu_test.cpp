@@ -0,0 +1,265 @@
+#include "stdafx.h"
+
+#include <algorithm>
+#include <thread>
+#include <cmath>
+
+#include "doctest.h"
+#include "nes_trace.h"
+#include "nes_mapper.h"
+#include "nes_system.h"
+#include "nes_apu.h"
+
+using namespace std;
+
+TEST_CASE("apu_tests") {
+    nes_system system;
+
+    SUBCASE("length_counter") {
+        INIT_TRACE("neschan.apu.length_counter.log");
+        cout << "Running [APU][length_counter]..." << endl;
+
+        system.power_on();
+
+        system.run_program(
+            {
+                0xa9, 0x01,         // LDA #$01
+                0x8d, 0x15, 0x40,   // STA $4015    -> enable pulse 1
+                0xa9, 0x08,         // LDA #$08
+                0x8d, 0x03, 0x40,   // STA $4003    -> length counter = 254
+                0xad, 0x15, 0x40,   // LDA $4015
+                0x85, 0x20,         // STA $20      -> $20 = #$01
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x15, 0x40,   // STA $4015    -> disable pulse 1 and clear its length counter
+                0xad, 0x15, 0x40,   // LDA $4015
+                0x85, 0x21,         // STA $21      -> $21 = #$00
+                0x00,               // BRK
+            },
+            0x1000);
+
+        auto cpu = system.cpu();
+
+        CHECK(cpu->peek(0x20) == 0x01);
+        CHECK(cpu->peek(0x21) == 0x00);
+    }
+    SUBCASE("frame_irq") {
+        INIT_TRACE("neschan.apu.frame_irq.log");
+        cout << "Running [APU][frame_irq]..." << endl;
+
+        system.power_on();
+
+        system.run_program(
+            {
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x17, 0x40,   // STA $4017    -> 4-step sequence, IRQ not inhibited
+                0xa0, 0x1c,         // LDY #$1c
+                0xa2, 0x00,         // LDX #$00
+                0xca,               // DEX          -> ~36K cycles, longer than one frame sequence
+                0xd0, 0xfd,         // BNE -3
+                0x88,               // DEY
+                0xd0, 0xfa,         // BNE -6
+                0xad, 0x15, 0x40,   // LDA $4015
+                0x85, 0x20,         // STA $20      -> $20 = #$40 (frame interrupt)
+                0xad, 0x15, 0x40,   // LDA $4015
+                0x85, 0x21,         // STA $21      -> $21 = #$00 (cleared by the read)
+                0x00,               // BRK
+            },
+            0x1000);
+
+        auto cpu = system.cpu();
+
+        CHECK(cpu->peek(0x20) == 0x40);
+        CHECK(cpu->peek(0x21) == 0x00);
+    }
+    SUBCASE("samples") {
+        INIT_TRACE("neschan.apu.samples.log");
+        cout << "Running [APU][samples]..." << endl;
+
+        system.power_on();
+
+        system.run_program(
+            {
+                0xa9, 0x01,         // LDA #$01
+                0x8d, 0x15, 0x40,   // STA $4015    -> enable pulse 1
+                0xa9, 0xbf,         // LDA #$bf
+                0x8d, 0x00, 0x40,   // STA $4000    -> 50% duty, constant volume 15
+                0xa9, 0xfd,         // LDA #$fd
+                0x8d, 0x02, 0x40,   // STA $4002
+                0xa9, 0x08,         // LDA #$08
+                0x8d, 0x03, 0x40,   // STA $4003    -> timer = $0fd (~440Hz)
+                0xa0, 0x1c,         // LDY #$1c
+                0xa2, 0x00,         // LDX #$00
+                0xca,               // DEX
+                0xd0, 0xfd,         // BNE -3
+                0x88,               // DEY
+                0xd0, 0xfa,         // BNE -6
+                0x00,               // BRK
+            },
+            0x1000);
+
+        // ~36K CPU cycles is ~20ms of audio
+        auto apu = system.apu();
+        int avail = apu->samples_avail();
+        CHECK(avail > apu->sample_rate() / 60);
+
+        vector<int16_t> samples(avail);
+        CHECK(apu->read_samples(samples.data(), avail) == avail);
+        CHECK(apu->samples_avail() == 0);
+
+        int16_t min_sample = *min_element(samples.begin(), samples.end());
+        int16_t max_sample = *max_element(samples.begin(), samples.end());
+        CHECK(max_sample - min_sample > 1000);
+    }
+    SUBCASE("mixer") {
+        INIT_TRACE("neschan.apu.mixer.log");
+        cout << "Running [APU][mixer]..." << endl;
+
+        nes_apu_mixer mixer;
+
+        CHECK(mixer.mix(0, 0, 0, 0, 0) == 0);
+        CHECK(mixer.mix_float(0, 0, 0, 0, 0) == 0.0f);
+
+        // Table values from http://wiki.nesdev.com/w/index.php/APU_Mixer
+        CHECK(mixer.mix_float(15, 15, 0, 0, 0) == doctest::Approx(95.52 / (8128.0 / 30 + 100)));
+        CHECK(mixer.mix_float(0, 0, 15, 15, 127) == doctest::Approx(163.67 / (24329.0 / 202 + 100)));
+        CHECK(mixer.mix_float(15, 15, 15, 15, 127) == doctest::Approx(1.0).epsilon(0.01));
+
+        // Nonlinear - two pulses together are quieter than the sum of each
+        CHECK(mixer.mix(15, 15, 0, 0, 0) < 2 * mixer.mix(15, 0, 0, 0, 0));
+
+        // Fixed point is the float path scaled
+        bool match = true;
+        for (int triangle = 0; triangle <= 15; ++triangle)
+            for (int dmc = 0; dmc <= 127; ++dmc)
+            {
+                int expected = int(lround(mixer.mix_float(7, 8, uint8_t(triangle), 3, uint8_t(dmc)) * APU_AMPLITUDE));
+                match = match && (abs(mixer.mix(7, 8, uint8_t(triangle), 3, uint8_t(dmc)) - expected) <= 1);
+            }
+        CHECK(match);
+    }
+    SUBCASE("resample_ratio") {
+        INIT_TRACE("neschan.apu.resample_ratio.log");
+        cout << "Running [APU][resample_ratio]..." << endl;
+
+        // Same program producing 0.5% more samples
+        nes_system ref_system;
+        ref_system.power_on();
+        system.power_on();
+        system.apu()->set_resample_ratio(1.005);
+        CHECK(system.apu()->resample_ratio() == 1.005);
+
+        vector<uint8_t> program = {
+            0xa9, 0x0a,         // LDA #$0a
+            0xa2, 0x00,         // LDX #$00
+            0xca,               // DEX
+            0xd0, 0xfd,         // BNE -3
+            0xe9, 0x01,         // SBC #$01
+            0xd0, 0xf9,         // BNE -7   -> ~13K cycles
+            0x00,               // BRK
+        };
+        ref_system.run_program(vector<uint8_t>(program), 0x1000);
+        system.run_program(vector<uint8_t>(program), 0x1000);
+
+        int ref_avail = ref_system.apu()->samples_avail();
+        int avail = system.apu()->samples_avail();
+        CHECK(ref_avail > 0);
+        CHECK(abs(avail - ref_avail * 1.005) <= 1.0);
+
+        // Clamped to what rate control would ever ask for
+        system.apu()->set_resample_ratio(2.0);
+        CHECK(system.apu()->resample_ratio() == APU_RESAMPLE_RATIO_MAX);
+
+        // Rate control steers towards half full
+        nes_audio_ring ring(1024);
+        nes_audio_rate_control rate_control(&ring);
+        CHECK(rate_control.update() == 1.0 + AUDIO_RATE_MAX_DEVIATION);
+        CHECK(rate_control.fill_level() == 0.0);
+
+        vector<int16_t> samples(1024);
+        ring.write(samples.data(), 512);
+        CHECK(rate_control.update() == 1.0);
+        CHECK(rate_control.fill_level() == 0.5);
+
+        ring.write(samples.data(), 512);
+        CHECK(rate_control.update() == 1.0 - AUDIO_RATE_MAX_DEVIATION);
+        CHECK(rate_control.ratio() == 1.0 - AUDIO_RATE_MAX_DEVIATION);
+    }
+    SUBCASE("audio_ring") {
+        INIT_TRACE("neschan.apu.audio_ring.log");
+        cout << "Running [APU][audio_ring]..." << endl;
+
+        nes_audio_ring ring(1000);
+        CHECK(ring.capacity() == 1024);
+
+        // Wraps around the end, and drops what doesn't fit
+        vector<int16_t> in(1024), out(1024);
+        for (int i = 0; i < 1024; ++i)
+            in[i] = int16_t(i);
+        CHECK(ring.write(in.data(), 1000) == 1000);
+        CHECK(ring.read(out.data(), 1000) == 1000);
+        CHECK(ring.write(in.data(), 1024) == 1024);
+        CHECK(ring.write(in.data(), 10) == 0);
+        CHECK(ring.overrun_samples() == 10);
+        CHECK(ring.size() == 1024);
+
+        nes_audio_span spans[2];
+        CHECK(ring.get_read_spans(spans) == 1024);
+        CHECK(spans[0].size == 24);
+        CHECK(spans[1].size == 1000);
+
+        // Runs dry with silence
+        out.assign(1024, -1);
+        CHECK(ring.read(out.data(), 1024) == 1024);
+        CHECK(ring.read(out.data(), 4) == 0);
+        CHECK(ring.underrun_samples() == 4);
+        CHECK(equal(in.begin() + 4, in.end(), out.begin() + 4));
+        CHECK(count(out.begin(), out.begin() + 4, int16_t(0)) == 4);
+
+        // Producer and consumer on different threads see every sample in order
+        // (doctest asserts aren't thread safe - the producer only keeps track)
+        const int total = 1000000;
+        bool no_overrun = true;
+        thread producer([&ring, &no_overrun, total]() {
+            vector<int16_t> buf(100);
+            for (int written = 0; written < total; )
+            {
+                int count = min(int(buf.size()), total - written);
+                for (int i = 0; i < count; ++i)
+                    buf[i] = int16_t(written + i);
+
+                nes_audio_span spans[2];
+                if (ring.get_write_spans(spans) < size_t(count))
+                {
+                    this_thread::yield();
+                    continue;
+                }
+                no_overrun = no_overrun && (ring.write(buf.data(), count) == size_t(count));
+                written += count;
+            }
+        });
+
+        bool in_order = true;
+        vector<int16_t> buf(64);
+        for (int read = 0; read < total; )
+        {
+            nes_audio_span spans[2];
+            size_t avail = ring.get_read_spans(spans);
+            if (avail == 0)
+            {
+                this_thread::yield();
+                continue;
+            }
+
+            size_t count = ring.read(buf.data(), min(avail, buf.size()));
+            for (size_t i = 0; i < count; ++i)
+                in_order = in_order && (buf[i] == int16_t(read + i));
+            read += int(count);
+        }
+        producer.join();
+
+        CHECK(no_overrun);
+        CHECK(in_order);
+        CHECK(ring.overrun_samples() == 10);
+        CHECK(ring.size() == 0);
+    }
+}
@@ -63,6 +63,42 @@ TEST_CASE("CPU tests") {
         CHECK(cpu->A() == 1);
         CHECK((cpu->P() & PROCESSOR_STATUS_CARRY_MASK));
     }
+    SUBCASE("self_modifying_prg") {
+        INIT_TRACE("neschan.instrtest.self_modifying_prg.log");
+
+        cout << "Running [CPU][self_modifying_prg]..." << endl;
+
+        system.power_on();
+
+        // Code in $8000~$FFFF comes from decoded cache - make sure writes into it are picked up
+        system.run_program(
+            {
+                0xa2, 0x00,         // LDX #$0
+                0xa9, 0x00,         // LDA #$0      -> A = X
+                0xe8,               // INX
+                0x8e, 0x03, 0x80,   // STX $8003    -> patch the LDA above
+                0xe0, 0x02,         // CPX #$2
+                0xd0, 0xf6,         // BNE $8002
+                0x00,               // BRK
+            },
+            0x8000);
+
+        auto cpu = system.cpu();
+
+        CHECK(cpu->A() == 1);
+        CHECK(cpu->X() == 2);
+
+        // Load a different program at the same address
+        system.power_on();
+        system.run_program(
+            {
+                0xa9, 0x42,         // LDA #$42
+                0x00,               // BRK
+            },
+            0x8000);
+
+        CHECK(cpu->A() == 0x42);
+    }
     SUBCASE("nestest") {
         INIT_TRACE("neschan.instrtest.full.log");
         cout << "Running [CPU][nestest]..." << endl;
@@ -81,16 +117,36 @@ TEST_CASE("CPU tests") {
         CHECK(cpu->peek(0x2) == 0);
         CHECK(cpu->peek(0x3) == 0);
     }
-#define INSTR_V5_TEST_CASE(test) \
-    SUBCASE("instr_test-v5 " test) { \
-        INIT_TRACE("neschan.instrtest.instr_test-v5." test ".log"); \
-        cout << "Running [CPU][instr_test-v5-" << test << "]" << endl; \
+    SUBCASE("nestest_jit") {
+        INIT_TRACE("neschan.instrtest.full_jit.log");
+        cout << "Running [CPU][nestest_jit]..." << endl;
+
+        system.power_on();
+
+        auto cpu = system.cpu();
+        cpu->enable_jit(true);
+
+        system.run_rom("./roms/nestest/nestest.nes", nes_rom_exec_mode_direct);
+
+        CHECK(cpu->PC() == 0x0005);
+        CHECK(cpu->S() == 0xff);
+        CHECK(cpu->peek(0x2) == 0);
+        CHECK(cpu->peek(0x3) == 0);
+    }
+#define INSTR_V5_TEST_CASE_(test, suffix, jit) \
+    SUBCASE("instr_test-v5 " test suffix) { \
+        INIT_TRACE("neschan.instrtest.instr_test-v5." test suffix ".log"); \
+        cout << "Running [CPU][instr_test-v5-" << test << suffix << "]" << endl; \
         system.power_on(); \
         auto cpu = system.cpu(); \
+        cpu->enable_jit(jit); \
         cpu->stop_at_infinite_loop(); \
         system.run_rom("./roms/instr_test-v5/rom_singles/" test ".nes", nes_rom_exec_mode_reset); \
         CHECK(cpu->peek(0x6000) == 0); \
     } 
+#define INSTR_V5_TEST_CASE(test) \
+    INSTR_V5_TEST_CASE_(test, "", false) \
+    INSTR_V5_TEST_CASE_(test, "_jit", true)
     INSTR_V5_TEST_CASE("01-basics")
     INSTR_V5_TEST_CASE("02-implied")
     // INSTR_V5_TEST_CASE("03-immediate")
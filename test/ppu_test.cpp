@@ -1,5 +1,7 @@
 #include "stdafx.h"
 
+#include <functional>
+
 #include "doctest.h"
 #include "nes_trace.h"
 #include "nes_mapper.h"
@@ -7,8 +9,84 @@
 
 using namespace std;
 
+//
+// FNV-1a hash of the completed frame and the CPU registers, to compare against a recorded run
+//
+static uint32_t hash_frame(nes_system &system)
+{
+    uint32_t hash = 0x811c9dc5;
+    auto add = [&hash](uint8_t val) { hash = (hash ^ val) * 0x01000193; };
+
+    const uint8_t *frame_buffer = system.ppu()->frame_buffer();
+    for (int i = 0; i < PPU_SCREEN_X * PPU_SCREEN_Y; ++i)
+        add(frame_buffer[i]);
+
+    auto cpu = system.cpu();
+    add(uint8_t(cpu->PC() & 0xff));
+    add(uint8_t(cpu->PC() >> 8));
+    add(cpu->A());
+    add(cpu->X());
+    add(cpu->Y());
+    add(cpu->P());
+
+    return hash;
+}
+
+//
+// Runs frame by frame on ref_system and on system, after configure has set them up differently and 
+// load has loaded the code, and checks that the CPU ends up in the same state after every frame. 
+// Frame buffers are compared from first_frame_compared on
+//
+static void run_same_frames(nes_system &ref_system, nes_system &system, const function<void(nes_system &system)> &load, 
+    int frame_count, const function<void(nes_system &ref_system, nes_system &system)> &configure, int first_frame_compared)
+{
+    ref_system.power_on();
+    system.power_on();
+    configure(ref_system, system);
+
+    load(ref_system);
+    load(system);
+
+    auto cpu = system.cpu();
+    auto ref_cpu = ref_system.cpu();
+    for (int i = 0; i < frame_count; ++i)
+    {
+        ref_system.run_frame();
+        system.run_frame();
+
+        CHECK(cpu->PC() == ref_cpu->PC());
+        CHECK(cpu->A() == ref_cpu->A());
+        CHECK(cpu->X() == ref_cpu->X());
+        CHECK(cpu->Y() == ref_cpu->Y());
+        CHECK(cpu->P() == ref_cpu->P());
+        if (i >= first_frame_compared)
+            CHECK(memcmp(system.ppu()->frame_buffer(), ref_system.ppu()->frame_buffer(), PPU_SCREEN_X * PPU_SCREEN_Y) == 0);
+    }
+}
+
+static void run_same_frames(nes_system &ref_system, nes_system &system, const char *rom, int frame_count,
+    const function<void(nes_system &ref_system, nes_system &system)> &configure, int first_frame_compared = 0)
+{
+    auto load = [rom](nes_system &system) { system.load_rom(rom, nes_rom_exec_mode_reset); };
+    run_same_frames(ref_system, system, load, frame_count, configure, first_frame_compared);
+}
+
+//
+// Same as above for a program running from $1000 (RAM $0000) that never returns
+//
+static void run_same_frames(nes_system &ref_system, nes_system &system, vector<uint8_t> &program, int frame_count,
+    const function<void(nes_system &ref_system, nes_system &system)> &configure, int first_frame_compared = 0)
+{
+    auto load = [&program](nes_system &system) {
+        system.ram()->set_bytes(0x1000, program.data(), program.size());
+        system.cpu()->PC() = 0x1000;
+    };
+    run_same_frames(ref_system, system, load, frame_count, configure, first_frame_compared);
+}
+
 TEST_CASE("ppu_tests") {
     nes_system system;
+    nes_system ref_system;
 
     SUBCASE("color_test") {
         INIT_TRACE("neschan.ppu.colortest.log");
@@ -74,6 +152,216 @@ TEST_CASE("ppu_tests") {
 
         CHECK(cpu->peek(0xf0) == 0x1);
     }
+    SUBCASE("run_frame") {
+        INIT_TRACE("neschan.ppu.run_frame.log");
+        cout << "Running [PPU][run_frame]..." << endl;
+
+        // Bulk stepping should produce exactly the same frames as stepping one cycle at a time - these
+        // were recorded with step(1), no idle loop skipping and the per-cycle PPU pipeline
+        const uint32_t frame_hashes[] = {
+            0x390baf0f, 0x741e02ef, 0x980c2720, 0x0ebc4ca2, 0x751c85b8,
+            0x751c85b8, 0x751c85b8, 0x751c85b8, 0x751c85b8, 0x751c85b8,
+        };
+
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+
+        for (int i = 0; i < 10; ++i)
+        {
+            system.run_frame();
+
+            CHECK(system.ppu()->scanline() == 0);
+            CHECK(system.ppu()->scanline_cycle() == nes_ppu_cycle_t(0));
+            CHECK(system.ppu()->frame_count() == uint32_t(i + 1));
+            CHECK(hash_frame(system) == frame_hashes[i]);
+        }
+
+        system.run_until_vblank();
+        CHECK(system.ppu()->scanline() == 241);
+        CHECK(system.ppu()->scanline_cycle() == nes_ppu_cycle_t(1));
+    }
+    SUBCASE("idle_loop_skip") {
+        INIT_TRACE("neschan.ppu.idle_loop_skip.log");
+        cout << "Running [PPU][idle_loop_skip]..." << endl;
+
+        // Skipping idle loops should produce exactly the same state as running every iteration
+        run_same_frames(ref_system, system, "./roms/color_test/color_test.nes", 10, [](nes_system &ref_system, nes_system &system) {
+            ref_system.cpu()->enable_idle_loop_skip(false);
+            system.cpu()->enable_idle_loop_skip(true);
+        });
+    }
+    SUBCASE("scanline_renderer") {
+        INIT_TRACE("neschan.ppu.scanline_renderer.log");
+        cout << "Running [PPU][scanline_renderer]..." << endl;
+
+        // Rendering whole scanlines should produce exactly the same frames as the per-cycle pipeline
+        auto configure = [](nes_system &ref_system, nes_system &system) {
+            ref_system.ppu()->enable_scanline_renderer(false);
+            system.ppu()->enable_scanline_renderer(true);
+        };
+        run_same_frames(ref_system, system, "./roms/color_test/color_test.nes", 10, configure);
+
+        // The blargg tests poke at the PPU mid-frame - and pass the same way
+        const char *blargg_roms[] = {
+            "./roms/blargg_ppu_tests/vbl_clear_time.nes",
+            "./roms/blargg_ppu_tests/sprite_ram.nes",
+            "./roms/blargg_ppu_tests/vram_access.nes",
+            "./roms/blargg_ppu_tests/palette_ram.nes",
+        };
+        for (auto rom : blargg_roms)
+        {
+            nes_system blargg_ref_system;
+            nes_system blargg_system;
+            run_same_frames(blargg_ref_system, blargg_system, rom, 10, configure);
+
+            CHECK(blargg_ref_system.cpu()->peek(0xf0) == 0x1);
+            CHECK(blargg_system.cpu()->peek(0xf0) == 0x1);
+        }
+    }
+    SUBCASE("frame_skip") {
+        INIT_TRACE("neschan.ppu.frame_skip.log");
+        cout << "Running [PPU][frame_skip]..." << endl;
+
+        // Frames without rendering should look exactly the same to the CPU
+        run_same_frames(ref_system, system, "./roms/color_test/color_test.nes", 10, [](nes_system &, nes_system &system) {
+            system.ppu()->enable_frame_render(false);
+        }, /* first_frame_compared = */ 10);
+
+        // Rendering comes back from the next frame, and then each of the 2 frame buffers gets a frame
+        system.ppu()->enable_frame_render(true);
+        for (int i = 0; i < 3; ++i)
+        {
+            ref_system.run_frame();
+            system.run_frame();
+        }
+        CHECK(memcmp(system.ppu()->frame_buffer(), ref_system.ppu()->frame_buffer(), PPU_SCREEN_X * PPU_SCREEN_Y) == 0);
+
+        // Frames that aren't rendered keep showing the last one that was - rather than flipping back 
+        // to the one before it. The frame already started is still rendered
+        system.ppu()->enable_frame_render(false);
+        system.run_frame();
+        const uint8_t *last_frame = system.ppu()->frame_buffer();
+        for (int i = 0; i < 3; ++i)
+        {
+            system.run_frame();
+            CHECK(system.ppu()->frame_buffer() == last_frame);
+        }
+    }
+    SUBCASE("frame_skip_sprite_0_hit") {
+        INIT_TRACE("neschan.ppu.frame_skip_sprite_0_hit.log");
+        cout << "Running [PPU][frame_skip_sprite_0_hit]..." << endl;
+
+        // Without rendering sprite 0 hit comes from a cheap test against opaque background pixels - 
+        // it should still hit at exactly the same time
+        vector<uint8_t> program = {
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x01, 0x20,   // STA $2001    -> rendering off while setting up
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x10,         // LDA #$10
+                0x8d, 0x06, 0x20,   // STA $2006    -> CHR RAM $0010 (tile 1)
+                0xa9, 0xff,         // LDA #$ff
+                0xa2, 0x08,         // LDX #$08
+                0x8d, 0x07, 0x20,   // STA $2007
+                0xca,               // DEX
+                0xd0, 0xfa,         // BNE -6       -> tile 1 is solid color 1
+                0xa9, 0x20,         // LDA #$20
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x84,         // LDA #$84
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x01,         // LDA #$01
+                0x8d, 0x07, 0x20,   // STA $2007    -> tile 1 at (32, 32) in name table 0
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x03, 0x20,   // STA $2003
+                0xa9, 0x1f,         // LDA #$1f
+                0x8d, 0x04, 0x20,   // STA $2004
+                0xa9, 0x01,         // LDA #$01
+                0x8d, 0x04, 0x20,   // STA $2004
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x04, 0x20,   // STA $2004
+                0xa9, 0x20,         // LDA #$20
+                0x8d, 0x04, 0x20,   // STA $2004    -> sprite 0 is tile 1 at (32, 32) too
+                0x2c, 0x02, 0x20,   // BIT $2002
+                0x10, 0xfb,         // BPL -5       -> wait for vblank
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x00, 0x20,   // STA $2000
+                0x8d, 0x05, 0x20,   // STA $2005
+                0x8d, 0x05, 0x20,   // STA $2005    -> name table 0, no scrolling
+                0xa9, 0x1e,         // LDA #$1e
+                0x8d, 0x01, 0x20,   // STA $2001    -> show background and sprites
+                0xa2, 0x00,         // LDX #$00
+                0xa0, 0x00,         // LDY #$00
+                0xe8,               // INX
+                0xd0, 0x03,         // BNE +3
+                0xc8,               // INY
+                0xf0, 0x05,         // BEQ +5       -> give up after 64K polls
+                0x2c, 0x02, 0x20,   // BIT $2002
+                0x50, 0xf5,         // BVC -11       -> poll for sprite 0 hit
+                0x8e, 0x00, 0x03,   // STX $0300
+                0x8c, 0x01, 0x03,   // STY $0301    -> polls it took
+                0x00,               // BRK
+        };
+
+        ref_system.power_on();
+        ref_system.run_program(vector<uint8_t>(program), 0x1000);
+
+        system.power_on();
+        system.ppu()->enable_frame_render(false);
+        system.run_program(vector<uint8_t>(program), 0x1000);
+
+        auto cpu = system.cpu();
+        auto ref_cpu = ref_system.cpu();
+        CHECK(ref_cpu->peek(0x301) != 0);
+        CHECK(cpu->peek(0x300) == ref_cpu->peek(0x300));
+        CHECK(cpu->peek(0x301) == ref_cpu->peek(0x301));
+    }
+    SUBCASE("deferred_render") {
+        INIT_TRACE("neschan.ppu.deferred_render.log");
+        cout << "Running [PPU][deferred_render]..." << endl;
+
+        // Frames rendered from the register write log should be exactly the same as rendered on the fly
+        // The first frame is recorded from the end of the first frame on
+        run_same_frames(ref_system, system, "./roms/color_test/color_test.nes", 10, [](nes_system &, nes_system &system) {
+            system.ppu()->enable_deferred_render(true);
+        }, /* first_frame_compared = */ 1);
+    }
+    SUBCASE("parallel_render") {
+        INIT_TRACE("neschan.ppu.parallel_render.log");
+        cout << "Running [PPU][parallel_render]..." << endl;
+
+        // Frames put together from bands rendered on different threads should be exactly the same
+        run_same_frames(ref_system, system, "./roms/color_test/color_test.nes", 10, [](nes_system &, nes_system &system) {
+            system.ppu()->enable_deferred_render(true);
+            system.ppu()->enable_parallel_render(true, 4);
+            CHECK(system.ppu()->is_parallel_render_enabled());
+        }, /* first_frame_compared = */ 1);
+
+        system.ppu()->enable_parallel_render(false);
+        CHECK(!system.ppu()->is_parallel_render_enabled());
+    }
+    SUBCASE("argb_output") {
+        INIT_TRACE("neschan.ppu.argb_output.log");
+        cout << "Running [PPU][argb_output]..." << endl;
+
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+        for (int i = 0; i < 10; ++i)
+            system.run_frame();
+
+        auto ppu = system.ppu();
+        vector<uint32_t> pixels(PPU_SCREEN_X * PPU_SCREEN_Y);
+        ppu->get_frame_argb(pixels.data(), PPU_SCREEN_X * sizeof(uint32_t));
+
+        // color_test doesn't use grayscale or color emphasis
+        const uint8_t *frame_buffer = ppu->frame_buffer();
+        bool match = true;
+        for (int i = 0; i < PPU_SCREEN_X * PPU_SCREEN_Y; ++i)
+            match = match && (pixels[i] == ppu->get_argb_color(frame_buffer[i], 0));
+        CHECK(match);
+
+        CHECK(ppu->get_argb_color(0x30, 0) == 0xffeceeec);
+        CHECK(ppu->get_argb_color(0x16, PPUMASK_GRAYSCALE) == ppu->get_argb_color(0x10, 0));
+        CHECK(ppu->get_argb_color(0x30, PPUMASK_EMPHASIZE_RED) == 0xffecb2b1);
+    }
     SUBCASE("palette_ram") {
         INIT_TRACE("neschan.ppu.palette_ram.log");
         cout << "Running [PPU][palette_ram]..." << endl;
@@ -88,4 +376,462 @@ TEST_CASE("ppu_tests") {
 
         CHECK(cpu->peek(0xf0) == 0x1);
     }
+    SUBCASE("chr_row_cache") {
+        INIT_TRACE("neschan.ppu.chr_row_cache.log");
+        cout << "Running [PPU][chr_row_cache]..." << endl;
+
+        system.power_on();
+        auto ppu = system.ppu();
+
+        // Row 2 of tile 1 - leftmost pixel is color 1 and rightmost is color 3 (pixels go high -> low)
+        ppu->write_byte(0x0012, 0x81);
+        ppu->write_byte(0x001a, 0x01);
+        CHECK(ppu->read_chr_row(0x0012).pixels == 0x4003);
+        CHECK(ppu->read_chr_row(0x0012).flipped_pixels == 0xc001);
+        CHECK(ppu->read_chr_row(0x001a).pixels == 0x4003);
+
+        // Writing CHR RAM re-decodes the row - one byte at a time or in bulk
+        ppu->write_byte(0x001a, 0x80);
+        CHECK(ppu->read_chr_row(0x0012).pixels == 0xc001);
+        CHECK(ppu->read_chr_row(0x0012).flipped_pixels == 0x4003);
+
+        vector<uint8_t> tile(16, 0xff);
+        ppu->write_bytes(0x0010, tile.data(), tile.size());
+        CHECK(ppu->read_chr_row(0x0012).pixels == 0xffff);
+        CHECK(ppu->read_chr_row(0x0017).flipped_pixels == 0xffff);
+
+        // CHR ROM banks are decoded when they are mapped, and writes to them are ignored
+        vector<uint8_t> chr_rom(0x2000);
+        chr_rom[0x1012] = 0x81;
+        chr_rom[0x101a] = 0x01;
+        ppu->map_chr(0x0000, chr_rom, 0x1000, 0x1000);
+        CHECK(ppu->read_chr_row(0x0012).pixels == 0x4003);
+
+        ppu->write_byte(0x0012, 0x00);
+        CHECK(ppu->read_byte(0x0012) == 0x81);
+        CHECK(ppu->read_chr_row(0x0012).pixels == 0x4003);
+
+        // Switching banks switches rows
+        ppu->map_chr(0x0000, chr_rom, 0x0000, 0x1000);
+        CHECK(ppu->read_chr_row(0x0012).pixels == 0);
+
+        // and write_bytes puts CHR RAM back
+        ppu->write_bytes(0x0010, tile.data(), tile.size());
+        CHECK(ppu->read_chr_row(0x0012).pixels == 0xffff);
+    }
+    SUBCASE("compositor") {
+        INIT_TRACE("neschan.ppu.compositor.log");
+        cout << "Running [PPU][compositor]..." << endl;
+
+        uint8_t palette[0x20];
+        for (int i = 0; i < 0x20; ++i)
+            palette[i] = uint8_t(0x20 + i);
+
+        uint8_t bg_line[PPU_SCREEN_X] = {};
+        uint8_t sprite_line[PPU_SCREEN_X] = {};
+        uint8_t sprite_front_line[PPU_SCREEN_X] = {};
+        uint8_t frame_line[PPU_SCREEN_X];
+        memset(frame_line, 0x3f, sizeof(frame_line));
+
+        bg_line[0] = PPU_BG_LINE_FETCHED | 0x5;                 // opaque background
+        bg_line[1] = PPU_BG_LINE_FETCHED | 0x4;                 // transparent background over a sprite
+        sprite_line[1] = PPU_SPRITE_LINE_PALETTE | 0x6;
+        bg_line[2] = PPU_BG_LINE_FETCHED | 0x5;                 // opaque background over a sprite
+        sprite_line[2] = PPU_SPRITE_LINE_PALETTE | 0x6;
+        bg_line[3] = PPU_BG_LINE_FETCHED | 0x5;                 // sprite in front of opaque background
+        sprite_line[3] = PPU_SPRITE_LINE_PALETTE | 0x7;
+        sprite_front_line[3] = PPU_SPRITE_LINE_PALETTE | 0x7;
+        sprite_line[4] = PPU_SPRITE_LINE_PALETTE | 0x6;         // background not fetched
+        nes_ppu::composite_line(bg_line, sprite_line, sprite_front_line, palette, frame_line);
+
+        CHECK(frame_line[0] == 0x25);
+        CHECK(frame_line[1] == 0x36);
+        CHECK(frame_line[2] == 0x25);
+        CHECK(frame_line[3] == 0x37);
+        CHECK(frame_line[4] == 0x36);
+        CHECK(frame_line[5] == 0x3f);
+
+#ifdef NES_PPU_SSE2
+        // SSE2 should agree with the plain loop on any line
+        uint32_t seed = 1;
+        auto next_random = [&seed]() { seed = seed * 1103515245 + 12345; return uint8_t(seed >> 16); };
+
+        bool match = true;
+        for (int i = 0; i < 1000; ++i)
+        {
+            uint8_t frame_line_sse2[PPU_SCREEN_X];
+            for (int x = 0; x < PPU_SCREEN_X; ++x)
+            {
+                bg_line[x] = next_random() & (PPU_BG_LINE_FETCHED | PPU_BG_LINE_INDEX_MASK);
+                sprite_line[x] = (next_random() & 1) ? (PPU_SPRITE_LINE_PALETTE | (next_random() & 0xf)) : 0;
+                sprite_front_line[x] = (next_random() & 1) ? sprite_line[x] : 0;
+                frame_line[x] = frame_line_sse2[x] = next_random();
+            }
+
+            nes_ppu::composite_line(bg_line, sprite_line, sprite_front_line, palette, frame_line);
+            nes_ppu::composite_line_sse2(bg_line, sprite_line, sprite_front_line, palette, frame_line_sse2);
+            match = match && (memcmp(frame_line, frame_line_sse2, PPU_SCREEN_X) == 0);
+        }
+        CHECK(match);
+#endif
+    }
+    SUBCASE("sprite_clip_and_priority") {
+        INIT_TRACE("neschan.ppu.sprite_clip_and_priority.log");
+        cout << "Running [PPU][sprite_clip_and_priority]..." << endl;
+
+        // One frame with background and then one without
+        system.power_on();
+        system.run_program(
+            {
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x01, 0x20,   // STA $2001    -> rendering off while setting up
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x10,         // LDA #$10
+                0x8d, 0x06, 0x20,   // STA $2006    -> CHR RAM $0010 (tile 1)
+                0xa9, 0xff,         // LDA #$ff
+                0xa2, 0x10,         // LDX #$10
+                0x8d, 0x07, 0x20,   // STA $2007
+                0xca,               // DEX
+                0xd0, 0xfa,         // BNE -6       -> tile 1 is solid color 3
+                0xa9, 0x20,         // LDA #$20
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x80,         // LDA #$80
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x01,         // LDA #$01
+                0xa2, 0x20,         // LDX #$20
+                0x8d, 0x07, 0x20,   // STA $2007
+                0xca,               // DEX
+                0xd0, 0xfa,         // BNE -6       -> background is tile 1 on lines 32~39
+                0xa9, 0x3f,         // LDA #$3f
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x03,         // LDA #$03
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x01,         // LDA #$01
+                0x8d, 0x07, 0x20,   // STA $2007    -> background color 3 = $01
+                0xa9, 0x3f,         // LDA #$3f
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x13,         // LDA #$13
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x27,         // LDA #$27
+                0x8d, 0x07, 0x20,   // STA $2007    -> sprite color 3 = $27
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x03, 0x20,   // STA $2003
+                0xa2, 0x00,         // LDX #$00
+                0xbd, 0x85, 0x10,   // LDA $1085,X
+                0x8d, 0x04, 0x20,   // STA $2004
+                0xe8,               // INX
+                0xe0, 0x08,         // CPX #$08
+                0xd0, 0xf5,         // BNE -11
+                0x2c, 0x02, 0x20,   // BIT $2002
+                0x10, 0xfb,         // BPL -5
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x00, 0x20,   // STA $2000
+                0x8d, 0x05, 0x20,   // STA $2005
+                0x8d, 0x05, 0x20,   // STA $2005
+                0xa9, 0x1e,         // LDA #$1e
+                0x8d, 0x01, 0x20,   // STA $2001    -> show background and sprites
+                0x2c, 0x02, 0x20,   // BIT $2002
+                0x10, 0xfb,         // BPL -5
+                0xa9, 0x14,         // LDA #$14
+                0x8d, 0x01, 0x20,   // STA $2001    -> show sprites only from the next frame
+                0x2c, 0x02, 0x20,   // BIT $2002
+                0x10, 0xfb,         // BPL -5
+                0x2c, 0x02, 0x20,   // BIT $2002
+                0x10, 0xfb,         // BPL -5       -> the frame without background is complete
+                0x00,               // BRK
+                0x1f, 0x01, 0x00, 0xfc,   // sprite 0 - (252, 32) in front of background
+                0x1f, 0x01, 0x20, 0x64,   // sprite 1 - (100, 32) behind background
+            },
+            0x1000);
+
+        // Background left over from the frame before doesn't count as opaque - sprite 1 shows
+        const uint8_t *frame_buffer = system.ppu()->frame_buffer();
+        CHECK(frame_buffer[32 * PPU_SCREEN_X + 100] == 0x27);
+        CHECK(frame_buffer[39 * PPU_SCREEN_X + 107] == 0x27);
+
+        // Sprite 0 is clipped at x = 255 rather than spilling into the start of the next line
+        CHECK(frame_buffer[32 * PPU_SCREEN_X + 252] == 0x27);
+        CHECK(frame_buffer[32 * PPU_SCREEN_X + 255] == 0x27);
+        CHECK(frame_buffer[33 * PPU_SCREEN_X + 0] != 0x27);
+        CHECK(frame_buffer[40 * PPU_SCREEN_X + 3] != 0x27);
+    }
+    SUBCASE("sprite_buckets") {
+        INIT_TRACE("neschan.ppu.sprite_buckets.log");
+        cout << "Running [PPU][sprite_buckets]..." << endl;
+
+        // Sprites move through OAM DMA and OAMDATA, switch between 8x8 and 8x16 without OAM writes and 
+        // overflow - the scanline renderer has to re-bucket them to match the dot pipeline
+        vector<uint8_t> program = {
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x01, 0x20,   // STA $2001    -> rendering off while setting up
+                0x8d, 0x06, 0x20,   // STA $2006
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa2, 0x00,         // LDX #$00
+                0x8e, 0x00, 0x03,   // STX $0300
+                0x8a,               // TXA
+                0x0a,               // ASL A
+                0x0a,               // ASL A
+                0x0a,               // ASL A
+                0x4d, 0x00, 0x03,   // EOR $0300
+                0x8d, 0x07, 0x20,   // STA $2007
+                0xe8,               // INX
+                0xd0, 0xf0,         // BNE -16      -> tiles 0~15 in CHR RAM
+                0xa9, 0x20,         // LDA #$20
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa0, 0x04,         // LDY #$04
+                0x8a,               // TXA
+                0x29, 0x0f,         // AND #$0f
+                0x8d, 0x07, 0x20,   // STA $2007
+                0xe8,               // INX
+                0xd0, 0xf7,         // BNE -9
+                0x88,               // DEY
+                0xd0, 0xf4,         // BNE -12      -> name table 0 and its attributes
+                0xa9, 0x3f,         // LDA #$3f
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x06, 0x20,   // STA $2006
+                0x8a,               // TXA
+                0x09, 0x20,         // ORA #$20
+                0x8d, 0x07, 0x20,   // STA $2007
+                0xe8,               // INX
+                0xe0, 0x20,         // CPX #$20
+                0xd0, 0xf5,         // BNE -11      -> palette
+                0x2c, 0x02, 0x20,   // BIT $2002
+                0x10, 0xfb,         // BPL -5
+                0xad, 0x01, 0x03,   // LDA $0301
+                0x29, 0x3f,         // AND #$3f
+                0xaa,               // TAX
+                0xad, 0x02, 0x20,   // LDA $2002
+                0x9d, 0x80, 0x03,   // STA $0380,X  -> sprite overflow of the last frame
+                0xad, 0x01, 0x03,   // LDA $0301
+                0x29, 0x03,         // AND #$03
+                0xd0, 0x0b,         // BNE +11
+                0x8d, 0x03, 0x20,   // STA $2003
+                0xa9, 0x02,         // LDA #$02
+                0x8d, 0x14, 0x40,   // STA $4014    -> OAM DMA from $0200 in frame 0 out of 4
+                0x4c, 0x7e, 0x10,   // JMP $107e
+                0xc9, 0x01,         // CMP #$01
+                0xd0, 0x0d,         // BNE +13
+                0xad, 0x01, 0x03,   // LDA $0301
+                0x0a,               // ASL A
+                0x0a,               // ASL A
+                0x8d, 0x03, 0x20,   // STA $2003
+                0xa9, 0x50,         // LDA #$50
+                0x8d, 0x04, 0x20,   // STA $2004    -> one sprite moved to line $51 through OAMDATA in frame 1
+                0xad, 0x01, 0x03,   // LDA $0301
+                0x18,               // CLC
+                0x69, 0x01,         // ADC #$01
+                0x0a,               // ASL A
+                0x0a,               // ASL A
+                0x0a,               // ASL A
+                0x29, 0x20,         // AND #$20
+                0x8d, 0x00, 0x20,   // STA $2000    -> 8x16 sprites switched in frame 3, without OAM writes
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x05, 0x20,   // STA $2005
+                0x8d, 0x05, 0x20,   // STA $2005
+                0xad, 0x01, 0x03,   // LDA $0301
+                0x29, 0x08,         // AND #$08
+                0x49, 0x1e,         // EOR #$1e
+                0x8d, 0x01, 0x20,   // STA $2001    -> background off 8 frames out of 16
+                0xa2, 0x00,         // LDX #$00
+                0xfe, 0x00, 0x02,   // INC $0200,X
+                0xbd, 0x03, 0x02,   // LDA $0203,X
+                0x18,               // CLC
+                0x69, 0x03,         // ADC #$03
+                0x9d, 0x03, 0x02,   // STA $0203,X
+                0xe8,               // INX
+                0xe8,               // INX
+                0xe8,               // INX
+                0xe8,               // INX
+                0xd0, 0xee,         // BNE -18      -> every sprite moves for the next DMA
+                0xee, 0x01, 0x03,   // INC $0301
+                0xa2, 0x20,         // LDX #$20
+                0xa0, 0x16,         // LDY #$16
+                0xca,               // DEX
+                0xd0, 0xfd,         // BNE -3
+                0x88,               // DEY
+                0xd0, 0xfa,         // BNE -6      -> ~27K cycles without touching the PPU, so scanlines down to the bottom are rendered whole
+                0x4c, 0x4a, 0x10,   // JMP $104a
+        };
+
+        // OAM table for the DMA at $0200, with every priority/flip combination, some sprites past 
+        // x = 248 and too many sprites on the lines moving through the bottom of the screen
+        program.resize(0x200);
+        for (int i = 0; i < PPU_SPRITE_MAX; ++i)
+        {
+            program.push_back(uint8_t(i < 12 ? 225 + i / 2 : i * 3));
+            program.push_back(uint8_t(i & 0xf));
+            program.push_back(uint8_t((i << 2) | (i & 0x3)));
+            program.push_back(uint8_t(i * 4 + 200));
+        }
+
+        run_same_frames(ref_system, system, program, 20, [](nes_system &ref_system, nes_system &system) {
+            ref_system.ppu()->enable_scanline_renderer(false);
+            system.ppu()->enable_scanline_renderer(true);
+        });
+
+        // PPUSTATUS at the start of every vblank - overflow is from the last scanline
+        bool overflow = false;
+        bool same_status = true;
+        for (uint16_t addr = 0x380; addr < 0x380 + 20; ++addr)
+        {
+            overflow = overflow || (ref_system.cpu()->peek(addr) & PPUSTATUS_SPRITE_OVERFLOW);
+            same_status = same_status && (system.cpu()->peek(addr) == ref_system.cpu()->peek(addr));
+        }
+        CHECK(overflow);
+        CHECK(same_status);
+    }
+    SUBCASE("mirroring") {
+        INIT_TRACE("neschan.ppu.mirroring.log");
+        cout << "Running [PPU][mirroring]..." << endl;
+
+        system.power_on();
+        auto ppu = system.ppu();
+
+        // Writes a different value into each name table, last one wins where they share physical tables
+        auto write_name_tbls = [ppu]() {
+            for (uint16_t i = 0; i < PPU_NAME_TBL_COUNT; ++i)
+                ppu->write_byte(PPU_NAME_TBL_ADDR + i * PPU_NAME_TBL_SIZE + 0x45, uint8_t(i + 1));
+        };
+
+        ppu->set_mirroring(nes_mapper_flags_vertical_mirroring);
+        write_name_tbls();
+        CHECK(ppu->read_byte(0x2045) == 3);
+        CHECK(ppu->read_byte(0x2445) == 4);
+        CHECK(ppu->read_byte(0x2845) == 3);
+        CHECK(ppu->read_byte(0x2c45) == 4);
+        CHECK(ppu->read_byte(0x3045) == 3);     // $3000~$3eff mirrors $2000~$2eff
+        CHECK(ppu->read_byte(0x3445) == 4);
+
+        ppu->set_mirroring(nes_mapper_flags_horizontal_mirroring);
+        write_name_tbls();
+        CHECK(ppu->read_byte(0x2045) == 2);
+        CHECK(ppu->read_byte(0x2445) == 2);
+        CHECK(ppu->read_byte(0x2845) == 4);
+        CHECK(ppu->read_byte(0x2c45) == 4);
+        CHECK(ppu->read_byte(0x3845) == 4);
+
+        // Each one screen mode has its own physical table
+        ppu->set_mirroring(nes_mapper_flags_one_screen_lower_bank);
+        write_name_tbls();
+        ppu->set_mirroring(nes_mapper_flags_one_screen_upper_bank);
+        ppu->write_byte(0x2845, 0x10);
+        CHECK(ppu->read_byte(0x2045) == 0x10);
+        CHECK(ppu->read_byte(0x2c45) == 0x10);
+        ppu->set_mirroring(nes_mapper_flags_one_screen_lower_bank);
+        CHECK(ppu->read_byte(0x2045) == 4);
+        CHECK(ppu->read_byte(0x2445) == 4);
+        CHECK(ppu->read_byte(0x2845) == 4);
+        CHECK(ppu->read_byte(0x2c45) == 4);
+
+        // $3f10/$3f14/$3f18/$3f1c are $3f00/$3f04/$3f08/$3f0c, and $3f20~$3fff mirrors $3f00~$3f1f
+        ppu->write_byte(0x3f10, 0x2a);
+        CHECK(ppu->read_byte(0x3f00) == 0x2a);
+        ppu->write_byte(0x3f04, 0x15);
+        CHECK(ppu->read_byte(0x3f14) == 0x15);
+        ppu->write_byte(0x3f11, 0x21);
+        CHECK(ppu->read_byte(0x3f01) != 0x21);
+        CHECK(ppu->read_byte(0x3f31) == 0x21);
+        ppu->write_byte(0x3ffc, 0x0c);
+        CHECK(ppu->read_byte(0x3f0c) == 0x0c);
+        CHECK(ppu->read_byte(0x3f1c) == 0x0c);
+
+        // The backdrop written through $3f10 shows up in rendering, the same in both renderers
+        vector<uint8_t> program = {
+                0x2c, 0x02, 0x20,   // BIT $2002
+                0x10, 0xfb,         // BPL -5
+                0xa9, 0x3f,         // LDA #$3f
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x10,         // LDA #$10
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x2a,         // LDA #$2a
+                0x8d, 0x07, 0x20,   // STA $2007    -> $3f10 is $3f00 - the backdrop color
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x00, 0x20,   // STA $2000
+                0x8d, 0x05, 0x20,   // STA $2005
+                0x8d, 0x05, 0x20,   // STA $2005
+                0xa9, 0x1e,         // LDA #$1e
+                0x8d, 0x01, 0x20,   // STA $2001    -> show background and sprites
+                0x4c, 0x24, 0x10,   // JMP $1024
+        };
+
+        run_same_frames(ref_system, system, program, 3, [](nes_system &ref_system, nes_system &system) {
+            ref_system.ppu()->enable_scanline_renderer(false);
+            system.ppu()->enable_scanline_renderer(true);
+        });
+
+        const uint8_t *frame_buffer = system.ppu()->frame_buffer();
+        CHECK(count(frame_buffer, frame_buffer + PPU_SCREEN_X * PPU_SCREEN_Y, 0x2a) == PPU_SCREEN_X * PPU_SCREEN_Y);
+    }
+    SUBCASE("palette_mid_line") {
+        INIT_TRACE("neschan.ppu.palette_mid_line.log");
+        cout << "Running [PPU][palette_mid_line]..." << endl;
+
+        // Background is solid color 3 everywhere, and every frame it changes from $01 to $27 in the 
+        // middle of a scanline
+        vector<uint8_t> program = {
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x01, 0x20,   // STA $2001    -> rendering off while setting up
+                0x8d, 0x06, 0x20,   // STA $2006
+                0x8d, 0x06, 0x20,   // STA $2006    -> CHR RAM $0000 (tile 0)
+                0xa9, 0xff,         // LDA #$ff
+                0xa2, 0x10,         // LDX #$10
+                0x8d, 0x07, 0x20,   // STA $2007
+                0xca,               // DEX
+                0xd0, 0xfa,         // BNE -6       -> tile 0 is solid color 3
+                0x2c, 0x02, 0x20,   // BIT $2002
+                0x10, 0xfb,         // BPL -5
+                0xa9, 0x3f,         // LDA #$3f
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x03,         // LDA #$03
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x01,         // LDA #$01
+                0x8d, 0x07, 0x20,   // STA $2007    -> background color 3 = $01
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x00, 0x20,   // STA $2000
+                0x8d, 0x05, 0x20,   // STA $2005
+                0x8d, 0x05, 0x20,   // STA $2005
+                0xa9, 0x0a,         // LDA #$0a
+                0x8d, 0x01, 0x20,   // STA $2001    -> show background
+                0xa0, 0x0a,         // LDY #$0a
+                0xa2, 0x00,         // LDX #$00
+                0xca,               // DEX
+                0xd0, 0xfd,         // BNE -3
+                0x88,               // DEY
+                0xd0, 0xf8,         // BNE -8
+                0xa2, 0xaa,         // LDX #$aa
+                0xca,               // DEX
+                0xd0, 0xfd,         // BNE -3       -> wait until the middle of the frame
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x01, 0x20,   // STA $2001    -> rendering off in the middle of a scanline
+                0xa9, 0x3f,         // LDA #$3f
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x03,         // LDA #$03
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x27,         // LDA #$27
+                0x8d, 0x07, 0x20,   // STA $2007    -> background color 3 = $27
+                0xa9, 0x0a,         // LDA #$0a
+                0x8d, 0x01, 0x20,   // STA $2001    -> show background again
+                0x4c, 0x15, 0x10,   // JMP $1015
+        };
+
+        run_same_frames(ref_system, system, program, 3, [](nes_system &ref_system, nes_system &system) {
+            ref_system.ppu()->enable_scanline_renderer(false);
+            system.ppu()->enable_scanline_renderer(true);
+        });
+
+        // Pixels fetched before the write stay $01 - line 0 is skipped as it starts with the two tiles
+        // prefetched before the palette goes back to $01
+        const uint8_t *frame_buffer = system.ppu()->frame_buffer();
+        auto line = [frame_buffer](int y) { return frame_buffer + y * PPU_SCREEN_X; };
+        int y = 1;
+        while (y < PPU_SCREEN_Y - 1 && find(line(y), line(y + 1), 0x27) == line(y + 1))
+            ++y;
+        CHECK(y < PPU_SCREEN_Y - 1);
+        CHECK(count(line(y - 1), line(y), 0x01) == PPU_SCREEN_X);
+        CHECK(line(y)[0] == 0x01);
+        CHECK(count(line(y + 1), line(y + 2), 0x27) == PPU_SCREEN_X);
+    }
 }
\ No newline at end of file